@@ -1,884 +1,6367 @@
-#pragma warning(disable : 4996)
-
-#include <stdlib.h>
-#include <stdio.h>
-#include <vector>
-#include <set>
-#include <filesystem>
-
-#define STB_TRUETYPE_IMPLEMENTATION
-#define STB_RECT_PACK_IMPLEMENTATION
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-
-#include "stb_rect_pack.h"
-#include "stb_image_write.h"
-#include "stb_truetype.h"
-
-#include <ft2build.h>
-#include FT_FREETYPE_H
-
-struct Range {
-  Range(int s, int e) : start(s), end(e) { };
-  bool inRange(int v) {
-    return v >= start && v <= end;
-  }
-  int start = 0;
-  int end = 0;
-};
-
-struct Options {
-  std::string font_filename;
-  bool verbose = false;
-  bool light = false;
-  float font_size = 0.0f;
-  int font_index = 0;
-  int oversample = 1;
-  int alpha_min = 0;
-  int alpha_max = 255;
-  int padding = 1;
-  int atlas_width = 0;
-  int atlas_height = 0;
-  int glyph_height = 0;   // if > 0 then all glyphs will be the same height in the atlas
-  int y_offset = 0;
-  float shift_x = 0;
-  float shift_y = 0;
-  int debug_color[3] = { 0xFF, 0xFF, 0xFF };
-  bool show_grid = false;
-  bool ignore_errors = false;  // used to generate output during debugging
-  bool error_on_crop = false;
-  std::string out_name;
-  std::vector<Range> ranges;
-};
-
-bool readFile(const char* filename, std::vector<unsigned char>* data) {
-  std::experimental::filesystem::path path(filename);
-  if (!std::experimental::filesystem::exists(path)) {
-    fprintf(stderr, "%s does not exist\n", filename);
-    return false;
-  }
-  unsigned int file_size = (unsigned int)std::experimental::filesystem::file_size(path);
-  data->resize(file_size);
-
-  printf("read: %s\n", filename);
-  FILE* fp = fopen(filename, "rb");
-  if (!fp) {
-    return false;
-  }
-  fread(data->data(), 1, file_size, fp);
-  fclose(fp);
-
-  return true;
-}
-
-bool addUsedCodepointsFromUTF8File(const char* filename, std::set<int>* used) {
-  std::vector<unsigned char> data;
-  if (!readFile(filename, &data)) {
-    return false;
-  }
-
-  size_t start = 0;
-
-  // check for BOM
-  if (data.size() >= 3 &&
-      data[0] == 0xEF &&
-      data[1] == 0xBB &&
-      data[2] == 0xBF) {
-    start = 3;
-  }
-
-  for (size_t i = start; i < data.size(); ++i) {
-    const unsigned char c = data[i];
-    if (c < 32) {
-      continue;
-    } else if (c < 128) {
-      used->insert(c);
-    } else {
-      size_t remain = data.size() - i;
-      size_t need = 0;
-      int v = 0;
-      const unsigned char masks[] = { 0xF8, 0xF0, 0xE0, };
-      const unsigned char match[] = { 0xF0, 0xE0, 0xC0, };
-      const size_t needs[] =        {    4,    3,    2, };
-
-      bool found = false;
-      for (size_t m = 0; m < std::size(masks); ++m) {
-        unsigned char mask = masks[m];
-        if ((c & mask) == match[m]) {
-          found = true;
-          need = needs[m];
-          v = c & ~mask;
-          break;
-        }
-      }
-
-      if (!found) {
-        fprintf(stderr, "error: bad char %02x at offset %d in %s\n", c, i, filename);
-        return false;
-      }
-
-      if (remain < need) {
-        fprintf(stderr, "error: bad end, needed %d chars but only %d left in %s\n", need, remain, filename);
-        return false;
-      }
-
-      for (size_t j = 1; j < need; ++j) {
-        const unsigned char c = data[i + j];
-        if ((c & 0xC0) != 0x80) {
-          fprintf(stderr, "error: bad char %02x at offset %d in %s\n", c, i + j, filename);
-          return false;
-        }
-        v = (v << 6) | (c & 0x3F);
-      }
-
-      used->insert(v);
-
-      i += need - 1;
-    }
-  }
-  return true;
-}
-
-void generateRangesFromUsed(const std::set<int>& used, std::vector<Range>* ranges) {
-  if (used.empty()) {
-    return;
-  }
-  int min = *used.begin();
-  int max = min;
-  //2,3,4,11,12,13
-  int c;
-  for (const int& cc : used) {
-    c = cc;
-    if (c == max || c == max + 1) {
-      max = std::max(c, max);
-    } else {
-      ranges->push_back(Range(min, max));
-      min = c;
-      max = c;
-    }
-  }
-  ranges->push_back(Range(min, c));
-}
-
-bool parse_bool(const char* arg, bool* dst) {
-  if (!strcmp(arg, "true")) {
-    *dst = true;
-    return true;
-  }
-  if (!strcmp(arg, "false")) {
-    *dst = false;
-    return true;
-  }
-  return false;
-}
-
-std::string underscore_to_dash(std::string s) {
-  std::string t(s);
-  std::replace(t.begin(), t.end(), '_', '-');
-  return t;
-}
-
-#define ARG_PARSE_BOOL(field)  (!option.compare(underscore_to_dash(std::string("--" #field)))) \
-  { \
-    if (!parse_bool(value, &opt->field)) { \
-       fprintf(stderr, "bad value for --%s, must be true or false, was %s\n", underscore_to_dash(#field).c_str(), value); \
-       return 0; \
-    } \
-  }
-
-int parse_command_line(int argc, const char* argv[], Options* opt) {
-  std::set<int> used;
-  for (int i = 1; i < argc; ++i) {
-    const char* arg = argv[i];
-    if (arg[0] == '-' ) {
-      const char* equal = strchr(arg, '=');
-      if (!equal && i == argc - 1) {
-        fprintf(stderr, "error: missing last argument\n");
-        return 0;
-      }
-      const std::string option(arg, equal ? equal - arg : strlen(arg));
-      const char *value = equal ? equal + 1 : argv[++i];
-      if ARG_PARSE_BOOL(verbose)
-      else if ARG_PARSE_BOOL(show_grid)
-      else if ARG_PARSE_BOOL(light)
-      else if ARG_PARSE_BOOL(ignore_errors)
-      else if ARG_PARSE_BOOL(error_on_crop)
-      else if (!option.compare("--font")) {
-        opt->font_filename = value;
-      } else if (!option.compare("--font-size")) {
-        opt->font_size = (float)atof(value);
-      } else if (!option.compare("--font-index")) {
-        opt->font_index = atoi(value);
-      } else if (!option.compare("--padding")) {
-        opt->padding = atoi(value);
-      } else if (!option.compare("--y-offset")) {
-        opt->y_offset = atoi(value);
-      } else if (!option.compare("--atlas-width")) {
-        opt->atlas_width = atoi(value);
-      } else if (!option.compare("--atlas-height")) {
-        opt->atlas_height = atoi(value);
-      } else if (!option.compare("--outname")) {
-        opt->out_name = value;
-      } else if (!option.compare("--glyph-height")) {
-        opt->glyph_height = atoi(value);
-      } else if (!option.compare("--outname")) {
-        opt->out_name = value;
-      } else if (!option.compare("--oversample")) {
-        opt->oversample = atoi(value);
-        if (opt->oversample < 1 || opt->alpha_min > 32) {
-          fprintf(stderr, "oversample out of range, 1 to 32, was %d\n", opt->oversample);
-          return 0;
-        }
-      } else if (!option.compare("--shift-x")) {
-        opt->shift_x = (float)atof(value);
-      } else if (!option.compare("--shift-y")) {
-        opt->shift_y = (float)atof(value);
-      } else if (!option.compare("--alpha-min")) {
-        opt->alpha_min = atoi(value);
-        if (opt->alpha_min < 0 || opt->alpha_min > 255) {
-          fprintf(stderr, "alpha-min out of range, 0 to 255, was %d\n", opt->alpha_min);
-          return 0;
-        }
-      } else if (!option.compare("--alpha-max")) {
-        opt->alpha_max = atoi(value);
-        if (opt->alpha_max < 0 || opt->alpha_max > 255) {
-          fprintf(stderr, "alpha-max out of range, 0 to 255, was %d\n", opt->alpha_max);
-          return 0;
-        }
-      } else if (!option.compare("--debug-color")) {
-        if (value[0] != '0' && value[1] != 'x') {
-          fprintf(stderr, "error: bad debug color: %s\n", value);
-          return 0;
-        }
-        char *p;
-        int color =(int)strtol(value + 2, &p, 16);
-        opt->debug_color[0] = (color >> 16) & 0xFF;
-        opt->debug_color[1] = (color >>  8) & 0xFF;
-        opt->debug_color[2] = (color >>  0) & 0xFF;
-      } else if (!option.compare("--range")) {
-        const char* dash = strchr(value, '-');
-        if (!dash) {
-          fprintf(stderr, "error: bad range: %s\n", value);
-          return 0;
-        }
-        int start = atoi(value);
-        int end = atoi(dash + 1);
-        if (start <= 0 || end < start) {
-          fprintf(stderr, "error: bad range: %s\n", value);
-          return 0;
-        }
-        for (int i = start; i <= end; ++i) {
-          used.insert(i);
-        }
-      } else if (!option.compare("--used-chars-file")) {
-        if (!addUsedCodepointsFromUTF8File(value, &used)) {
-          fprintf(stderr, "error: can't read file: %s\n", value);
-          return 0;
-        }
-      } else {
-        fprintf(stderr, "error: unknown option: %s\n", arg);
-        return 0;
-      }
-    }
-  }
-
-  if (opt->font_filename.empty()) {
-    fprintf(stderr, "error: no font specified\n");
-    return 0;
-  }
-
-  if (opt->font_size <= 0.0) {
-    fprintf(stderr, "error: font size not specified\n");
-    return 0;
-  }
-
-  if (opt->out_name.empty()) {
-    fprintf(stderr, "error: outname not specified\n");
-    return 0;
-  }
-
-  generateRangesFromUsed(used, &opt->ranges);
-
-  if (!opt->ranges.size()) {
-    fprintf(stderr, "error: no ranges specified\n");
-    return 0;
-  }
-
-  if (opt->verbose) {
-    printf("Ranges:\n");
-    for (auto range : opt->ranges) {
-      printf("  %d - %d\n", range.start, range.end);
-    }
-  }
-
-  return 1;
-}
-
-const char* help = R"(
-font-atlas-generator [options]
-   --font <path to font>
-   --font-index <font index of font to use in font file. default: 0>
-   --font-size <size to generate, eg: 14>
-   --padding <padding between characters, default: 1>
-   --light <true> use FreeType's light rendering mode
-   --atlas-width <width of atlas to generate, default: 0 = automatic>
-   --atlas-height <height of atlas to generate, default: 0 = automatic>
-   --glyph-height <make all glyphs this size, 0 = varying size, default: 0>
-   --y-offset <offset to baseline, default: 0>
-   --outname <base name of output, eg: foo, generates foo.json and foo.png>
-   --oversample <amount to oversample, default: 1>
-   --alpha-min <alpha> min alpha, alpha is stretched between min and max. default = 0
-   --alpha-max <alpha> max alpha, alpha is stretched between min and max. default = 255
-   --range <range to generate eg 32-127> note you can specify this multiple times
-   --used-chars-file <file to scan for used files>
-   --verbose <true> show more stuff
-   --shift-x <shift-x> fractional amount to shift
-   --shift-y <shift-y> fractional amount to shift
-   --show-grid <true> change colors of each character rect
-   --debug-color <hexcolor eg 0xFF0000> color to use for show-grid
-   --ignore-errors <true> used for debugging to generate output
-)";
-
-std::string json_string(const std::string& s) {
-  std::string d("\"");
-
-  for (const auto c : s) {
-    switch (c) {
-    case '"':
-    case '\\':
-    case '\b':
-    case '\f':
-    case '\n':
-    case '\r':
-    case '\t':
-      d.push_back('\\');
-      d.push_back(c);
-      break;
-    default:
-      d.push_back(c);
-      break;
-    }
-  }
-
-  d.push_back('\"');
-  return d;
-}
-
-//////////////////////////////////////////////////////////////////////////////
-//
-// bitmap baking
-//
-// This is SUPER-AWESOME (tm Ryan Gordon) packing using stb_rect_pack.h. If
-// stb_rect_pack.h isn't available, it uses the BakeFontBitmap strategy.
-
-STBTT_DEF int PackBegin(stbtt_pack_context *spc, int pw, int ph, int stride_in_bytes, int padding, void *alloc_context)
-{
-   stbrp_context *context = (stbrp_context *) STBTT_malloc(sizeof(*context)            ,alloc_context);
-   int            num_nodes = pw - padding;
-   stbrp_node    *nodes   = (stbrp_node    *) STBTT_malloc(sizeof(*nodes  ) * num_nodes,alloc_context);
-
-   if (context == NULL || nodes == NULL) {
-      if (context != NULL) STBTT_free(context, alloc_context);
-      if (nodes   != NULL) STBTT_free(nodes  , alloc_context);
-      return 0;
-   }
-
-   spc->user_allocator_context = alloc_context;
-   spc->width = pw;
-   spc->height = ph;
-   spc->pack_info = context;
-   spc->nodes = nodes;
-   spc->padding = padding;
-   spc->stride_in_bytes = stride_in_bytes != 0 ? stride_in_bytes : pw;
-   spc->h_oversample = 1;
-   spc->v_oversample = 1;
-
-   stbrp_init_target(context, pw-padding, ph-padding, nodes, num_nodes);
-
-   return 1;
-}
-
-STBTT_DEF void PackEnd  (stbtt_pack_context *spc)
-{
-   STBTT_free(spc->nodes    , spc->user_allocator_context);
-   STBTT_free(spc->pack_info, spc->user_allocator_context);
-}
-
-STBTT_DEF void PackFontRangesPackRects(stbtt_pack_context *spc, stbrp_rect *rects, int num_rects)
-{
-   stbrp_pack_rects((stbrp_context *) spc->pack_info, rects, num_rects);
-}
-
-unsigned char GetPixel(const FT_Bitmap& bm, int x, int y) {
-  if (x < 0 || x >= (int)bm.width || y < 0 || y >= (int)bm.rows) {
-    return 0;
-  }
-
-  switch (bm.pixel_mode) {
-    case FT_PIXEL_MODE_MONO:
-      return (bm.buffer[y * bm.pitch + (x >> 3)] & (0x80 >> (x & 0x7)))
-        ? 255
-        : 0;
-    case FT_PIXEL_MODE_GRAY:
-      return bm.buffer[y * bm.pitch + x];
-    default:
-      fprintf(stderr, "unknown pixel mode!!!!\n");
-      return 0;
-  }
-}
-
-void DumpBitmap(const FT_Bitmap& bm) {
-  for (int y = 0; y < (int)bm.rows; ++y) {
-    for (int x = 0; x < (int)bm.width; ++x) {
-      printf("%s", GetPixel(bm, x, y) > 0 ? "*" : ".");
-    }
-    printf("\n");
-  }
-}
-
-int PackFontRanges(stbtt_pack_context *spc, FT_Face face, stbtt_pack_range *ranges, int num_ranges, const Options& opt, std::vector<unsigned char>* pixels)
-{
-  stbrp_rect    *rects;
-
-  //int baseline = opt.font_size * opt.oversample * ((float)face->ascender / (float)face->units_per_EM + 0.5f);
-  //printf("  font size: %f\n", opt.font_size);
-  //printf(" face height: %d\n", face->size->metrics.height >> 6);
-  //printf(" face ascender: %d\n", face->size->metrics.ascender >> 6);
-  //printf("  ascender: %d\n", face->ascender);
-  //printf("  units_per_EM: %d\n", face->units_per_EM);
-  //printf("  baseline: %d\n", baseline);
-  int baseline = ((face->size->metrics.ascender + 63) >> 6) / opt.oversample + opt.y_offset;
-
-  // flag all characters as NOT packed
-  for (int i = 0; i < num_ranges; ++i) {
-    for (int j = 0; j < ranges[i].num_chars; ++j) {
-      ranges[i].chardata_for_range[j].x0 = 0;
-      ranges[i].chardata_for_range[j].y0 = 0;
-      ranges[i].chardata_for_range[j].x1 = 0;
-      ranges[i].chardata_for_range[j].y1 = 0;
-     }
-   }
-
-  int num_chars = 0;
-  for (int i = 0; i < num_ranges; ++i) {
-    num_chars += ranges[i].num_chars;
-  }
-
-   rects = (stbrp_rect *) STBTT_malloc(sizeof(*rects) * num_chars, spc->user_allocator_context);
-   if (rects == NULL)
-      return 0;
-
-   int load_flags = opt.light ? FT_LOAD_TARGET_LIGHT : FT_LOAD_TARGET_NORMAL;
-   FT_Render_Mode render_flags = opt.light ? FT_RENDER_MODE_LIGHT : FT_RENDER_MODE_NORMAL;
-
-   {
-     int k = 0;
-     for (int i = 0; i < num_ranges; ++i) {
-       const stbtt_pack_range& range = ranges[i];
-       for (int j = 0; j < range.num_chars; ++j) {
-         stbrp_rect* rect = &rects[k];
-         const int codepoint = range.array_of_unicode_codepoints
-            ? range.array_of_unicode_codepoints[j]
-            : range.first_unicode_codepoint_in_range + j;
-         int glyph_index = FT_Get_Char_Index(face, codepoint);
-         if (glyph_index) {
-           int error = FT_Load_Glyph(
-               face,          /* handle to face object */
-               glyph_index,   /* glyph index           */
-               load_flags);   /* load flags, see below */
-           // should probably pad each side separate?
-           if (error) {
-             fprintf(stderr, "warn: could not load glyph for codepoint: 0x%x\n", codepoint);
-           } else {
-             rect->w = (stbrp_coord)(((face->glyph->metrics.width + 63) >> 6) / opt.oversample + opt.padding * 2);
-             rect->h = (stbrp_coord)(((face->glyph->metrics.height + 63) >> 6) / opt.oversample + opt.padding * 2);
-             if (opt.verbose) {
-               printf("   codepoint: 0x%x - %d x %d\n", codepoint, rect->w, rect->h);
-             }
-           }
-         } else {
-           fprintf(stderr, "warn: no glpyh for codepoint: 0x%x\n", codepoint);
-           rect->w = 0;
-           rect->h = 0;
-         }
-         ++k;
-       }
-     }
-   }
-
-   if (opt.glyph_height) {
-     for (int i = 0; i < num_chars; ++i) {
-       stbrp_rect* r = &rects[i];
-       r->h = opt.glyph_height;
-     }
-   }
-
-   bool auto_size = !opt.atlas_width;
-   int atlas_width = auto_size ? 8 : opt.atlas_width;
-   int atlas_height = auto_size ? 8 : opt.atlas_height;
-
-   int return_value = 1;
-   for (;;) {
-     if (!PackBegin(spc, atlas_width, atlas_height, atlas_width, opt.padding, NULL)) {
-       fprintf(stderr, "error: PackBegin\n");
-       return_value = 0;
-       break;
-     }
-
-     if (false && opt.glyph_height > 0) {
-       // just pack in order if all the same height
-       // this is only to make it easier to compare
-       int x = 0;
-       int y = 0;
-       for (int i = 0; i < num_chars; ++i) {
-         stbrp_rect* r = &rects[i];
-         r->was_packed = true;
-         int horiz_space_left = spc->width - x;
-         if (horiz_space_left < r->w) {
-           x = 0;
-           y += r->h;
-         }
-         int vert_space_left = spc->height - y;
-         if (vert_space_left < r->h) {
-           r->was_packed = false;
-           break;
-         }
-         r->x = x;
-         r->y = y;
-         x += r->w;
-       }
-     } else {
-       PackFontRangesPackRects(spc, rects, num_chars);
-     }
-
-     bool pack_successful = true;
-     for (int i = 0; i < num_chars; ++i) {
-       stbrp_rect* r = &rects[i];
-       if (!r->was_packed) {
-         pack_successful = false;
-         break;
-       }
-     }
-
-     if (pack_successful) {
-       break;
-     } else {
-       if (auto_size) {
-         if (atlas_width > atlas_height) {
-           atlas_height *= 2;
-         } else {
-           atlas_width *= 2;
-         }
-       } else {
-         return_value = 0;
-         break;
-       }
-     }
-     if (opt.verbose) {
-       printf("trying: %d x %d\n", atlas_width, atlas_height);
-     }
-     PackEnd(spc);
-   }
-
-   if (return_value) {
-     if (auto_size) {
-       pixels->resize(spc->width * spc->height);
-       spc->pixels = pixels->data();
-       spc->stride_in_bytes = spc->width;
-     }
-
-
-     bool crop_error = false;
-     {
-       int k = 0;
-       for (int i = 0; i < num_ranges; ++i) { 
-         const stbtt_pack_range& range = ranges[i];
-         for (int j = 0; j < range.num_chars; ++j) {
-           stbtt_packedchar* packed_char = &range.chardata_for_range[j];
-           const int codepoint = range.array_of_unicode_codepoints
-              ? range.array_of_unicode_codepoints[j]
-              : range.first_unicode_codepoint_in_range + j;
-           int glyph_index = FT_Get_Char_Index(face, codepoint);
-           if (glyph_index) {
-             int error = FT_Load_Glyph(
-                 face,          /* handle to face object */
-                 glyph_index,   /* glyph index           */
-                 load_flags);   /* load flags, see below */
-             if (error) {
-               fprintf(stderr, "warn: could not load glyph for codepoint: 0x%x\n", codepoint);
-               packed_char->x0 = 0;
-               packed_char->y0 = 0;
-               packed_char->x1 = 0;
-               packed_char->y1 = 0;
-               packed_char->xadvance = 0;
-               packed_char->xoff = 0;
-               packed_char->yoff = 0;
-               packed_char->xoff2 = 0;
-               packed_char->yoff2 = 0;
-             } else {
-               FT_Render_Glyph(
-                 face->glyph,
-                 render_flags);
-               const stbrp_rect rect = rects[k];
-               const auto& glyph = face->glyph;
-               const auto& bm = glyph->bitmap;
-               //DumpBitmap(bm);
-
-               int src_y_start = 0;
-               int dst_y_start = opt.glyph_height ? baseline - ((glyph->bitmap_top + opt.oversample - 1) / opt.oversample) : 0;
-               int dst_y_end = dst_y_start + ((bm.rows + opt.oversample - 1) / opt.oversample);
-               if (dst_y_start < 0) {
-                 dst_y_end += dst_y_start;
-                 src_y_start -= dst_y_start;
-                 fprintf(stderr, "codepoint 0x%x truncated at top by %d pixels\n", codepoint, -dst_y_start);
-                 dst_y_start = 0;
-                 crop_error = true;
-               }
-               int max_height = rect.h;
-               if (dst_y_end > max_height) {
-                 fprintf(stderr, "codepoint 0x%x truncated at bottom by %d pixels\n", codepoint, dst_y_end - max_height);
-                 dst_y_end = max_height;
-                 crop_error = true;
-               }
-               static unsigned char masks[] = { 0x66, 0x44, 0x88 };
-
-               int alpha_range = opt.alpha_max - opt.alpha_min;
-               int scale_sq = opt.oversample * opt.oversample;
-               int num_rows = dst_y_end - dst_y_start;
-               for (int y = 0; y < num_rows; ++y) {
-                 unsigned char* dst = spc->pixels + (rect.y + dst_y_start + y + opt.padding) * spc->stride_in_bytes + rect.x + opt.padding;
-                 for (int x = 0; x < (int)((bm.width + opt.oversample - 1) / opt.oversample); ++x) {
-                   int pixel = 0;
-                   for (int yy = 0; yy < opt.oversample; ++yy) {
-                     for (int xx = 0; xx < opt.oversample; ++xx) {
-                       pixel += GetPixel(bm, x * opt.oversample + xx, y * opt.oversample + yy);
-                     }
-                   }
-                   pixel = (pixel + opt.oversample / 2) / scale_sq;
-
-                   if (alpha_range > 1) {
-                     pixel = std::min(255, std::max(0, pixel - opt.alpha_min) * 255 / alpha_range);
-                   } else {
-                     pixel = pixel > opt.alpha_min ? 255 : 0;
-                   }
-
-                   if (opt.show_grid) {
-                     pixel |= masks[k % sizeof(masks)];
-                   }
-                   *dst++ = pixel;
-                 }
-               }
-
-               packed_char->x0 = rect.x + opt.padding;
-               packed_char->y0 = rect.y + opt.padding;
-               packed_char->x1 = rect.x + rect.w - opt.padding * 2 + 1;
-               packed_char->y1 = rect.y + rect.h - opt.padding * 2 + 1;
-               packed_char->xadvance = (float)(glyph->advance.x) / 64.0f / opt.oversample;
-               packed_char->xoff = (float)(glyph->metrics.horiBearingX) / 64.0f / (float)opt.oversample;
-               packed_char->yoff = opt.glyph_height > 0
-                 ? (float)(glyph->metrics.horiBearingY) / 64.0f / (float)opt.oversample
-                 : 0;
-               packed_char->xoff2 = -123456; // not implemented
-               packed_char->yoff2 = -123456; // not implemented
-             }
-           }
-           ++k;
-         }
-       }
-     }
-
-     if (opt.error_on_crop && crop_error) {
-       return_value = 0;
-     }
-   }
-
-   STBTT_free(rects, spc->user_allocator_context);
-   stbtt_PackEnd(spc);
-   return return_value;
-}
-
-int main(int argc, const char *argv[])
-{
-  Options opt;
-  if (!parse_command_line(argc, argv, &opt)) {
-    fprintf(stderr, help);
-    return EXIT_FAILURE;
-  }
-
-  FT_Library library;
-
-  int error = FT_Init_FreeType(&library);
-  if (error) {
-    fprintf(stderr, "an error occurred during freetype library initialization");
-    return EXIT_FAILURE;
-  }
-
-  FT_Face face;
-  error = FT_New_Face(library, opt.font_filename.c_str(), opt.font_index, &face);
-  if (error) {
-    fprintf(stderr, "error: could not read: %s\n", opt.font_filename.c_str());
-    return EXIT_FAILURE;
-  }
-
-  printf("font: %s\n", opt.font_filename.c_str());
-  if (opt.verbose) {
-    printf("  num glyphs: %d\n", face->num_glyphs);
-    printf("  num fixed sizes: %d\n", face->num_fixed_sizes);
-    for (int i = 0; i < face->num_fixed_sizes; ++i) {
-      const FT_Bitmap_Size& size = face->available_sizes[i];
-      printf("    %d: %d x %d\n", i, size.width, size.height);
-    }
-  }
-
-  error = FT_Set_Char_Size(
-      face,                /* handle to face object           */
-      0,                   /* char_width in 1/64th of points  */
-      (FT_F26Dot6)(opt.font_size * 64),  /* char_height in 1/64th of points */
-      72 * opt.oversample,      /* horizontal device resolution    */
-      72 * opt.oversample);     /* vertical device resolution      */
-
-
-
-  std::vector<unsigned char> pixels(opt.atlas_width * opt.atlas_height);
-
-  int total_chars = 0;
-  for (const auto& range : opt.ranges) {
-    int num_chars = range.end - range.start + 1;
-    total_chars += num_chars;
-  }
-  std::vector<stbtt_packedchar> chardata_for_range(total_chars);
-  std::vector<stbtt_pack_range> ranges(opt.ranges.size());
-  int dst_ndx = 0;
-  for (size_t i = 0; i < opt.ranges.size(); ++i) {
-    const auto& range = opt.ranges[i];
-    auto& pack_range = ranges[i];
-
-    pack_range.font_size = opt.font_size;
-    pack_range.first_unicode_codepoint_in_range = range.start;
-    pack_range.array_of_unicode_codepoints = NULL;
-    pack_range.num_chars = range.end - range.start + 1;
-    pack_range.chardata_for_range = &chardata_for_range[dst_ndx];
-    dst_ndx += pack_range.num_chars;
-  }
-
-  // printf("pack font: %s\n", opt.font_filename.c_str());
-
-  stbtt_pack_context context = {};
-  if (!PackFontRanges(&context, face, ranges.data(), ranges.size(), opt, &pixels)) {
-    fprintf(stderr, "error packing font: %s\n", opt.font_filename.c_str());
-    return EXIT_FAILURE;
-  }
-
-
-  // printf("end pack font: %s\n", opt.out_name.c_str());
-
-  std::string png_filename = std::string(opt.out_name) + ".png";
-
-  printf("write font atlas: %s\n", png_filename.c_str());
-
-  // expand to 4 channels
-  int channels = 4;
-  std::vector<unsigned char> rgba(context.width * context.height * channels);
-  for (int y = 0; y < context.height; ++y) {
-    for (int x = 0; x < context.width; ++x) {
-      const int srcOffset = y * context.width + x;
-      const int dstOffset = srcOffset * 4;
-      const int alpha = pixels[srcOffset];
-      rgba[dstOffset + 0] = alpha ? opt.debug_color[0] : 0;
-      rgba[dstOffset + 1] = alpha ? opt.debug_color[1] : 0;
-      rgba[dstOffset + 2] = alpha ? opt.debug_color[2] : 0;
-      rgba[dstOffset + 3] = alpha;
-    }
-  }
-  if (!stbi_write_png(png_filename.c_str(), context.width, context.height, channels, rgba.data(), context.stride_in_bytes * 4)) {
-    fprintf(stderr, "error: couldn't write %s\n", png_filename.c_str());
-    return EXIT_FAILURE;
-  }
-  /*
-  } else {
-    int channels = 1;
-    if (!stbi_write_png(png_filename.c_str(), context.width, context.height, channels, pixels.data(), context.stride_in_bytes)) {
-      fprintf(stderr, "error: couldn't write %s\n", png_filename.c_str());
-      return EXIT_FAILURE;
-    }
-  }
-  */
-
-  int baseline = 0;
-#if 0
-  {
-    stbtt_fontinfo font;
-    stbtt_InitFont(&font, font_data.data(), 0);
-
-    const float scale = stbtt_ScaleForPixelHeight(&font, opt.font_size);
-    int ascent;
-    stbtt_GetFontVMetrics(&font, &ascent, 0, 0);
-    baseline = (int)(ascent * scale) + opt.y_offset;
-  }
-#endif
-
-  std::string json_filename = std::string(opt.out_name) + ".json";
-
-  printf("write font data: %s\n", json_filename.c_str());
-
-  FILE* file = fopen(json_filename.c_str(), "wb");
-  fprintf(file, R"({
-  "font": %s,
-  "fontSize": %g,
-  "fontIndex": %d,
-  "baseline": %d,
-  "yOffset": %d,
-  "oversample": %d,
-  "padding": %d,
-  "atlasWidth": %d,
-  "atlasHeight": %d,
-  "atlas": %s,
-  "glyphs": [
-)", json_string(opt.font_filename).c_str(),
-    opt.font_size,
-    opt.font_index,
-    baseline,
-    opt.y_offset,
-    opt.oversample,
-    opt.padding,
-    context.width,
-    context.height,
-    json_string(png_filename).c_str());
-
-  const int last_ndx = total_chars - 1;
-  int ndx = 0;
-  for (const auto& pack_range : ranges) {
-    for (int i = 0; i < pack_range.num_chars; ++i) {
-      const stbtt_packedchar& packed_char = pack_range.chardata_for_range[i];
-      fprintf(file, R"(    {
-      "codePoint": %d,
-      "tex": { "x": %d, "y": %d, "w": %d, "h": %d },
-      "xOff": %g,
-      "yOff": %g,
-      "xAdvance": %g,
-      "xOff2": %g,
-      "yOff2": %g
-    }%s
-)",
-              pack_range.first_unicode_codepoint_in_range + i,
-              packed_char.x0,
-              packed_char.y0,
-              packed_char.x1 - packed_char.x0 + 1,
-              packed_char.y1 - packed_char.y0 + 1,
-              packed_char.xoff,
-              packed_char.yoff,
-              packed_char.xadvance,
-              packed_char.xoff2,
-              packed_char.yoff2,
-              ndx == last_ndx ? "" : ",");
-      ++ndx;
-    }
-  }
-  fprintf(file, R"(  ]
-}
-)");
-
-  fclose(file);
-
-  return EXIT_SUCCESS;
-}
-
+#pragma warning(disable : 4996)
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <stdint.h>
+#include <limits.h>
+#include <algorithm>
+#include <vector>
+#include <set>
+#include <map>
+#include <mutex>
+#include <filesystem>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX2__)
+#define HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define STB_TRUETYPE_IMPLEMENTATION
+#define STB_RECT_PACK_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+
+#include "stb_rect_pack.h"
+#include "stb_image_write.h"
+#include "stb_truetype.h"
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_OUTLINE_H
+#include FT_MODULE_H
+#include FT_DRIVER_H
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+struct Range {
+  Range(int s, int e) : start(s), end(e) { };
+  bool inRange(int v) {
+    return v >= start && v <= end;
+  }
+  int start = 0;
+  int end = 0;
+};
+
+// v must not be 0
+int count_trailing_zeros(uint64_t v) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward64(&index, v);
+  return (int)index;
+#else
+  return __builtin_ctzll(v);
+#endif
+}
+
+// A set of codepoints, one bit per codepoint. The Unicode space is split
+// into blocks of 4096 codepoints and a block only has storage once
+// something in it is added, so a set of a few scripts is a few KB and
+// adding or removing a big range is a memset per block, not an insert per
+// codepoint.
+struct CodepointSet {
+  static const int kNumCodepoints = 0x110000;
+  static const int kBlockBits = 12;
+  static const int kBlockSize = 1 << kBlockBits;
+  static const int kBlockWords = kBlockSize / 64;
+  static const int kNumBlocks = kNumCodepoints / kBlockSize;
+
+  // empty for a block with nothing in it
+  std::vector<std::vector<uint64_t>> blocks = std::vector<std::vector<uint64_t>>(kNumBlocks);
+
+  bool Contains(int codepoint) const {
+    const std::vector<uint64_t>& block = blocks[codepoint >> kBlockBits];
+    const int bit = codepoint & (kBlockSize - 1);
+    return !block.empty() && (block[bit / 64] >> (bit % 64) & 1);
+  }
+  void Add(int codepoint) {
+    std::vector<uint64_t>& block = blocks[codepoint >> kBlockBits];
+    if (block.empty()) {
+      block.resize(kBlockWords);
+    }
+    const int bit = codepoint & (kBlockSize - 1);
+    block[bit / 64] |= 1ULL << (bit % 64);
+  }
+  // start and end are inclusive
+  void AddRange(int start, int end) { SetRange(start, end, true); }
+
+  void Subtract(const CodepointSet& other) {
+    for (int b = 0; b < kNumBlocks; ++b) {
+      const std::vector<uint64_t>& src = other.blocks[b];
+      std::vector<uint64_t>& dst = blocks[b];
+      if (src.empty() || dst.empty()) {
+        continue;
+      }
+      for (int w = 0; w < kBlockWords; ++w) {
+        dst[w] &= ~src[w];
+      }
+    }
+  }
+
+  // Appends the runs of consecutive codepoints in the set, in order. Whole
+  // words that are all in or all out of the current run are skipped and
+  // the ends of runs are found with count_trailing_zeros.
+  void GetRanges(std::vector<Range>* ranges) const {
+    int run_start = -1;
+    for (int b = 0; b < kNumBlocks; ++b) {
+      const std::vector<uint64_t>& block = blocks[b];
+      if (block.empty()) {
+        if (run_start >= 0) {
+          ranges->push_back(Range(run_start, b * kBlockSize - 1));
+          run_start = -1;
+        }
+        continue;
+      }
+      for (int w = 0; w < kBlockWords; ++w) {
+        const uint64_t word = block[w];
+        if (word == (run_start >= 0 ? ~0ULL : 0)) {
+          continue;
+        }
+        const int base = b * kBlockSize + w * 64;
+        int bit = 0;
+        while (bit < 64) {
+          // look for the next bit that ends or starts a run
+          const uint64_t rest = (run_start >= 0 ? ~word : word) >> bit;
+          if (!rest) {
+            break;
+          }
+          bit += count_trailing_zeros(rest);
+          if (run_start >= 0) {
+            ranges->push_back(Range(run_start, base + bit - 1));
+            run_start = -1;
+          } else {
+            run_start = base + bit;
+          }
+        }
+      }
+    }
+    if (run_start >= 0) {
+      ranges->push_back(Range(run_start, kNumCodepoints - 1));
+    }
+  }
+
+ private:
+  void SetRange(int start, int end, bool value) {
+    for (int b = start >> kBlockBits; b <= end >> kBlockBits; ++b) {
+      std::vector<uint64_t>& block = blocks[b];
+      const int block_start = std::max(start, b * kBlockSize) - b * kBlockSize;
+      const int block_end = std::min(end, b * kBlockSize + kBlockSize - 1) - b * kBlockSize;
+      if (block.empty()) {
+        if (!value) {
+          continue;
+        }
+        block.resize(kBlockWords);
+      }
+      for (int w = block_start / 64; w <= block_end / 64; ++w) {
+        const int lo = std::max(block_start, w * 64) - w * 64;
+        const int hi = std::min(block_end, w * 64 + 63) - w * 64;
+        const uint64_t mask = (hi == 63 ? ~0ULL : (1ULL << (hi + 1)) - 1) & ~((1ULL << lo) - 1);
+        block[w] = value ? block[w] | mask : block[w] & ~mask;
+      }
+    }
+  }
+};
+
+enum Packer {
+  kPackerSkylineBL,
+  kPackerSkylineBF,
+  kPackerMaxRects,
+  kPackerShelf,
+  kNumPackers,
+};
+
+const char* packer_names[kNumPackers] = {
+  "skyline-bl",
+  "skyline-bf",
+  "maxrects-bssf",
+  "shelf",
+};
+
+enum PngLevel {
+  kPngFast,
+  kPngDefault,
+  kPngMax,
+  kNumPngLevels,
+};
+
+const char* png_level_names[kNumPngLevels] = {
+  "fast",
+  "default",
+  "max",
+};
+
+enum OutputFormat {
+  kOutputRGBA,   // png, debug_color with the coverage in alpha
+  kOutputGray8,  // png, 1 channel
+  kOutputRaw,    // just the bytes, 1 per pixel, width and height are in the .json
+  kOutputKTX,    // uncompressed KTX 1 texture, GL_R8
+  kNumOutputFormats,
+};
+
+const char* output_format_names[kNumOutputFormats] = {
+  "rgba",
+  "gray8",
+  "raw",
+  "ktx",
+};
+
+const char* output_format_extensions[kNumOutputFormats] = {
+  ".png",
+  ".png",
+  ".raw",
+  ".ktx",
+};
+
+struct Options {
+  std::string font_filename;
+  bool verbose = false;
+  bool light = false;
+  float font_size = 0.0f;
+  int font_index = 0;
+  int oversample = 1;
+  int threads = 1;
+  int alpha_min = 0;
+  int alpha_max = 255;
+  int padding = 1;
+  int atlas_width = 0;
+  int atlas_height = 0;
+  int glyph_height = 0;   // if > 0 then all glyphs will be the same height in the atlas
+  int y_offset = 0;
+  float shift_x = 0;
+  float shift_y = 0;
+  int debug_color[3] = { 0xFF, 0xFF, 0xFF };
+  bool show_grid = false;
+  bool ignore_errors = false;  // used to generate output during debugging
+  bool error_on_crop = false;
+  bool stats = false;
+  bool npot = false;
+  Packer packer = kPackerSkylineBL;
+  bool benchmark_packers = false;
+  bool benchmark_downsample = false;
+  PngLevel png_level = kPngDefault;
+  OutputFormat output_format = kOutputRGBA;
+  bool metrics_bin = false;  // also write the glyph metrics as outname.bin
+  bool benchmark_png = false;
+  std::string benchmark_suite;  // report .json for --benchmark-suite
+  int max_page_size = 0;  // if > 0 glyphs that don't fit go on more pages
+  bool sdf = false;
+  bool msdf = false;
+  int sdf_spread = 4;     // pixels from the edge to 0 or 255 with --sdf/--msdf
+  std::string out_name;
+  std::string manifest;
+  std::string cache_dir;
+  std::string font_cache_dir;  // defaults to cache_dir
+  std::string previous_atlas;
+  std::string profile;        // --profile report .json
+  std::string profile_trace;  // --profile-trace Chrome trace event .json
+  std::vector<Range> ranges;
+  CodepointSet excluded;  // --exclude-range, taken out of the ranges
+  std::map<int, int> codepoint_counts;  // times each codepoint was in --used-chars-file
+};
+
+bool readFile(const char* filename, std::vector<unsigned char>* data) {
+  std::experimental::filesystem::path path(filename);
+  if (!std::experimental::filesystem::exists(path)) {
+    fprintf(stderr, "%s does not exist\n", filename);
+    return false;
+  }
+  unsigned int file_size = (unsigned int)std::experimental::filesystem::file_size(path);
+  data->resize(file_size);
+
+  printf("read: %s\n", filename);
+  FILE* fp = fopen(filename, "rb");
+  if (!fp) {
+    return false;
+  }
+  fread(data->data(), 1, file_size, fp);
+  fclose(fp);
+
+  return true;
+}
+
+// A read-only mapping of a whole file, fonts and --used-chars-file text.
+// FreeType reads fonts straight out of it and the text is scanned in
+// place, so neither is copied and the pages are shared.
+struct MappedFile {
+  const unsigned char* data = NULL;
+  size_t size = 0;
+#ifdef _WIN32
+  HANDLE file = INVALID_HANDLE_VALUE;
+  HANDLE mapping = NULL;
+#endif
+
+  ~MappedFile() {
+#ifdef _WIN32
+    if (data) {
+      UnmapViewOfFile(data);
+    }
+    if (mapping) {
+      CloseHandle(mapping);
+    }
+    if (file != INVALID_HANDLE_VALUE) {
+      CloseHandle(file);
+    }
+#else
+    if (data) {
+      munmap((void*)data, size);
+    }
+#endif
+  }
+};
+
+bool map_file(const char* filename, MappedFile* file) {
+#ifdef _WIN32
+  file->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file->file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file->file, &size) || size.QuadPart == 0) {
+    return false;
+  }
+  file->mapping = CreateFileMappingA(file->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!file->mapping) {
+    return false;
+  }
+  file->data = (const unsigned char*)MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!file->data) {
+    return false;
+  }
+  file->size = (size_t)size.QuadPart;
+#else
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);  // the mapping keeps the file open
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  file->data = (const unsigned char*)data;
+  file->size = (size_t)st.st_size;
+#endif
+  return true;
+}
+
+double NowMs() {
+  return std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// CPU time used so far by the whole process or by just the calling thread
+double CpuMs(bool thread) {
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  if (thread) {
+    GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+  } else {
+    GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+  }
+  const uint64_t k = ((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+  const uint64_t u = ((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime;
+  return (k + u) / 1e4;  // 100ns units
+#else
+  timespec ts;
+  clock_gettime(thread ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+#endif
+}
+
+// --used-chars-file files are split into pieces of about this size so a
+// single big file is still scanned on every thread
+const size_t kUsedCharsChunkSize = 4 << 20;
+
+// number of bytes at the start of p[0, n) below 0x80
+size_t ascii_prefix(const unsigned char* p, size_t n) {
+  size_t i = 0;
+#if HAVE_AVX2
+  for (; i + 32 <= n; i += 32) {
+    if (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)(p + i)))) {
+      break;
+    }
+  }
+#endif
+#if HAVE_SSE2
+  for (; i + 16 <= n; i += 16) {
+    if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(p + i)))) {
+      break;
+    }
+  }
+#elif HAVE_NEON
+  for (; i + 16 <= n; i += 16) {
+    const uint8x16_t v = vld1q_u8(p + i);
+    const uint64x1_t high_bits = vreinterpret_u64_u8(vorr_u8(vget_low_u8(v), vget_high_u8(v)));
+    if (vget_lane_u64(high_bits, 0) & 0x8080808080808080ULL) {
+      break;
+    }
+  }
+#endif
+  for (; i < n && p[i] < 0x80; ++i) {
+  }
+  return i;
+}
+
+// Adds how many times each character is in data[begin, end) to counts,
+// which has an entry for every codepoint. Runs of ASCII are found with
+// SIMD and counted without decoding. Everything else is decoded and
+// checked one character at a time with scalar code: each one has to be
+// decoded anyway to find its counter, so vectorised validation alone
+// wouldn't save much. On bad UTF-8 returns false with its offset in
+// error_offset.
+bool count_utf8_chars(const unsigned char* data, size_t begin, size_t end, uint32_t* counts, size_t* error_offset) {
+  // 4 tables so runs of the same character don't wait on each other
+  uint32_t ascii[4][128] = {};
+  size_t i = begin;
+  bool ok = true;
+  while (i < end) {
+    const size_t run_end = i + ascii_prefix(data + i, end - i);
+    for (; i + 4 <= run_end; i += 4) {
+      ++ascii[0][data[i + 0]];
+      ++ascii[1][data[i + 1]];
+      ++ascii[2][data[i + 2]];
+      ++ascii[3][data[i + 3]];
+    }
+    for (; i < run_end; ++i) {
+      ++ascii[0][data[i]];
+    }
+    if (i == end) {
+      break;
+    }
+
+    const unsigned char c = data[i];
+    size_t need;
+    int v;
+    int min;
+    if ((c & 0xE0) == 0xC0) {
+      need = 2;
+      v = c & 0x1F;
+      min = 0x80;
+    } else if ((c & 0xF0) == 0xE0) {
+      need = 3;
+      v = c & 0x0F;
+      min = 0x800;
+    } else if ((c & 0xF8) == 0xF0) {
+      need = 4;
+      v = c & 0x07;
+      min = 0x10000;
+    } else {
+      ok = false;
+      break;
+    }
+    if (end - i < need) {
+      ok = false;
+      break;
+    }
+    for (size_t j = 1; j < need && ok; ++j) {
+      const unsigned char cc = data[i + j];
+      ok = (cc & 0xC0) == 0x80;
+      v = (v << 6) | (cc & 0x3F);
+    }
+    // overlong, surrogate or past the last codepoint
+    if (!ok || v < min || (v >= 0xD800 && v <= 0xDFFF) || v > 0x10FFFF) {
+      ok = false;
+      break;
+    }
+    ++counts[v];
+    i += need;
+  }
+  for (int t = 0; t < 4; ++t) {
+    for (int a = 0; a < 128; ++a) {
+      counts[a] += ascii[t][a];
+    }
+  }
+  *error_offset = i;
+  return ok;
+}
+
+// Adds every character in the UTF-8 files to used and how many times
+// each was seen to counts. Directories are scanned for files recursively.
+// Files are mapped and scanned in pieces on threads threads, each with its
+// own table with a count for every codepoint, so finding the distinct
+// characters is a walk of the merged table, not a set insert per character.
+bool addUsedCodepointsFromUTF8Files(const std::vector<std::string>& paths, int threads, CodepointSet* used, std::map<int, int>* counts) {
+  namespace fs = std::experimental::filesystem;
+  const double start = NowMs();
+
+  std::vector<std::string> filenames;
+  for (const auto& path : paths) {
+    std::error_code ec;
+    if (fs::is_directory(path, ec)) {
+      std::vector<std::string> found;
+      for (fs::recursive_directory_iterator it(path, ec), end; !ec && it != end; it.increment(ec)) {
+        if (fs::is_regular_file(it->status())) {
+          found.push_back(it->path().string());
+        }
+      }
+      if (ec) {
+        fprintf(stderr, "error: can't read directory %s: %s\n", path.c_str(), ec.message().c_str());
+        return false;
+      }
+      std::sort(found.begin(), found.end());
+      filenames.insert(filenames.end(), found.begin(), found.end());
+    } else {
+      filenames.push_back(path);
+    }
+  }
+
+  struct Chunk {
+    int file;
+    size_t begin;
+    size_t end;
+  };
+  std::vector<std::unique_ptr<MappedFile>> files;
+  std::vector<Chunk> chunks;
+  size_t total_bytes = 0;
+  for (int f = 0; f < (int)filenames.size(); ++f) {
+    const char* filename = filenames[f].c_str();
+    std::error_code ec;
+    if (!fs::exists(filename, ec)) {
+      fprintf(stderr, "%s does not exist\n", filename);
+      return false;
+    }
+    files.emplace_back(new MappedFile);
+    MappedFile& file = *files.back();
+    if (fs::file_size(filename, ec) == 0 && !ec) {
+      continue;
+    }
+    if (!map_file(filename, &file)) {
+      fprintf(stderr, "error: can't read file: %s\n", filename);
+      return false;
+    }
+    total_bytes += file.size;
+
+    size_t begin = 0;
+    // skip the BOM
+    if (file.size >= 3 && file.data[0] == 0xEF && file.data[1] == 0xBB && file.data[2] == 0xBF) {
+      begin = 3;
+    }
+    while (begin < file.size) {
+      size_t end = std::min(file.size, begin + kUsedCharsChunkSize);
+      // split before a character, not inside one
+      for (int back = 0; back < 3 && end < file.size && end > begin + 1 && (file.data[end] & 0xC0) == 0x80; ++back) {
+        --end;
+      }
+      chunks.push_back({ f, begin, end });
+      begin = end;
+    }
+  }
+
+  const int num_workers = std::max(1, std::min(threads, (int)chunks.size()));
+  std::vector<std::vector<uint32_t>> worker_counts(num_workers);
+  std::atomic<int> next_chunk(0);
+  std::atomic<bool> failed(false);
+  std::mutex error_mutex;
+  auto work = [&](int w) {
+    std::vector<uint32_t>& table = worker_counts[w];
+    table.assign(0x110000, 0);
+    for (;;) {
+      const int c = next_chunk.fetch_add(1);
+      if (c >= (int)chunks.size() || failed) {
+        break;
+      }
+      const Chunk& chunk = chunks[c];
+      const MappedFile& file = *files[chunk.file];
+      size_t offset = 0;
+      if (!count_utf8_chars(file.data, chunk.begin, chunk.end, table.data(), &offset)) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!failed) {
+          fprintf(stderr, "error: bad utf-8 %02x at offset %d in %s\n", file.data[offset], (int)offset, filenames[chunk.file].c_str());
+        }
+        failed = true;
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int w = 1; w < num_workers; ++w) {
+    workers.emplace_back(work, w);
+  }
+  work(0);
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  if (failed) {
+    return false;
+  }
+
+  std::vector<uint32_t>& total = worker_counts[0];
+  for (int w = 1; w < num_workers; ++w) {
+    const std::vector<uint32_t>& table = worker_counts[w];
+    for (int cp = 0; cp < 0x110000; ++cp) {
+      total[cp] += table[cp];
+    }
+  }
+  int distinct = 0;
+  for (int cp = 32; cp < 0x110000; ++cp) {  // control characters aren't glyphs
+    if (total[cp]) {
+      used->Add(cp);
+      (*counts)[cp] += (int)total[cp];
+      ++distinct;
+    }
+  }
+
+  const double elapsed = NowMs() - start;
+  printf("read: %d file(s), %.1f MB in %.1f ms (%.0f MB/s) on %d thread(s), %d characters\n",
+         (int)filenames.size(), total_bytes / 1e6, elapsed, total_bytes / 1e3 / std::max(elapsed, 1e-3),
+         num_workers, distinct);
+  return true;
+}
+
+bool parse_bool(const char* arg, bool* dst) {
+  if (!strcmp(arg, "true")) {
+    *dst = true;
+    return true;
+  }
+  if (!strcmp(arg, "false")) {
+    *dst = false;
+    return true;
+  }
+  return false;
+}
+
+std::string underscore_to_dash(std::string s) {
+  std::string t(s);
+  std::replace(t.begin(), t.end(), '_', '-');
+  return t;
+}
+
+#define ARG_PARSE_BOOL(field)  (!option.compare(underscore_to_dash(std::string("--" #field)))) \
+  { \
+    if (!parse_bool(value, &opt->field)) { \
+       fprintf(stderr, "bad value for --%s, must be true or false, was %s\n", underscore_to_dash(#field).c_str(), value); \
+       return 0; \
+    } \
+  }
+
+// "start-end", both inclusive
+bool parse_range(const char* value, int* start, int* end) {
+  const char* dash = strchr(value, '-');
+  if (!dash) {
+    return false;
+  }
+  *start = atoi(value);
+  *end = atoi(dash + 1);
+  return *start > 0 && *end >= *start && *end < CodepointSet::kNumCodepoints;
+}
+
+int parse_args(int argc, const char* argv[], Options* opt, CodepointSet* used) {
+  std::vector<std::string> used_chars_files;
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    if (arg[0] == '-' ) {
+      const char* equal = strchr(arg, '=');
+      if (!equal && i == argc - 1) {
+        fprintf(stderr, "error: missing last argument\n");
+        return 0;
+      }
+      const std::string option(arg, equal ? equal - arg : strlen(arg));
+      const char *value = equal ? equal + 1 : argv[++i];
+      if ARG_PARSE_BOOL(verbose)
+      else if ARG_PARSE_BOOL(show_grid)
+      else if ARG_PARSE_BOOL(light)
+      else if ARG_PARSE_BOOL(ignore_errors)
+      else if ARG_PARSE_BOOL(error_on_crop)
+      else if ARG_PARSE_BOOL(stats)
+      else if ARG_PARSE_BOOL(npot)
+      else if ARG_PARSE_BOOL(benchmark_packers)
+      else if ARG_PARSE_BOOL(benchmark_downsample)
+      else if ARG_PARSE_BOOL(benchmark_png)
+      else if ARG_PARSE_BOOL(sdf)
+      else if ARG_PARSE_BOOL(msdf)
+      else if (!option.compare("--font")) {
+        opt->font_filename = value;
+      } else if (!option.compare("--packer")) {
+        // "skyline" and "maxrects" are short for the default variants
+        int packer = !strcmp(value, "skyline") ? kPackerSkylineBL
+                   : !strcmp(value, "maxrects") ? kPackerMaxRects
+                   : -1;
+        for (int p = 0; p < kNumPackers; ++p) {
+          if (!strcmp(value, packer_names[p])) {
+            packer = p;
+          }
+        }
+        if (packer < 0) {
+          fprintf(stderr, "error: unknown packer: %s\n", value);
+          return 0;
+        }
+        opt->packer = (Packer)packer;
+      } else if (!option.compare("--output-format")) {
+        int format = -1;
+        for (int f = 0; f < kNumOutputFormats; ++f) {
+          if (!strcmp(value, output_format_names[f])) {
+            format = f;
+          }
+        }
+        if (format < 0) {
+          fprintf(stderr, "error: unknown output format: %s\n", value);
+          return 0;
+        }
+        opt->output_format = (OutputFormat)format;
+      } else if (!option.compare("--metrics-format")) {
+        if (!strcmp(value, "json")) {
+          opt->metrics_bin = false;
+        } else if (!strcmp(value, "bin")) {
+          opt->metrics_bin = true;
+        } else {
+          fprintf(stderr, "error: unknown metrics format: %s\n", value);
+          return 0;
+        }
+      } else if (!option.compare("--png-level")) {
+        int level = -1;
+        for (int l = 0; l < kNumPngLevels; ++l) {
+          if (!strcmp(value, png_level_names[l])) {
+            level = l;
+          }
+        }
+        if (level < 0) {
+          fprintf(stderr, "error: unknown png level: %s\n", value);
+          return 0;
+        }
+        opt->png_level = (PngLevel)level;
+      } else if (!option.compare("--manifest")) {
+        opt->manifest = value;
+      } else if (!option.compare("--cache-dir")) {
+        opt->cache_dir = value;
+      } else if (!option.compare("--font-cache-dir")) {
+        opt->font_cache_dir = value;
+      } else if (!option.compare("--previous-atlas")) {
+        opt->previous_atlas = value;
+      } else if (!option.compare("--benchmark-suite")) {
+        opt->benchmark_suite = value;
+      } else if (!option.compare("--profile")) {
+        opt->profile = value;
+      } else if (!option.compare("--profile-trace")) {
+        opt->profile_trace = value;
+      } else if (!option.compare("--font-size")) {
+        opt->font_size = (float)atof(value);
+      } else if (!option.compare("--font-index")) {
+        opt->font_index = atoi(value);
+      } else if (!option.compare("--padding")) {
+        opt->padding = atoi(value);
+      } else if (!option.compare("--y-offset")) {
+        opt->y_offset = atoi(value);
+      } else if (!option.compare("--atlas-width")) {
+        opt->atlas_width = atoi(value);
+      } else if (!option.compare("--atlas-height")) {
+        opt->atlas_height = atoi(value);
+      } else if (!option.compare("--outname")) {
+        opt->out_name = value;
+      } else if (!option.compare("--max-page-size")) {
+        opt->max_page_size = atoi(value);
+        if (opt->max_page_size < 0) {
+          fprintf(stderr, "error: bad max page size: %s\n", value);
+          return 0;
+        }
+      } else if (!option.compare("--sdf-spread")) {
+        opt->sdf_spread = atoi(value);
+      } else if (!option.compare("--glyph-height")) {
+        opt->glyph_height = atoi(value);
+      } else if (!option.compare("--outname")) {
+        opt->out_name = value;
+      } else if (!option.compare("--oversample")) {
+        opt->oversample = atoi(value);
+        if (opt->oversample < 1 || opt->alpha_min > 32) {
+          fprintf(stderr, "oversample out of range, 1 to 32, was %d\n", opt->oversample);
+          return 0;
+        }
+      } else if (!option.compare("--threads")) {
+        opt->threads = atoi(value);
+        if (opt->threads < 0) {
+          fprintf(stderr, "threads out of range, must be >= 0, was %d\n", opt->threads);
+          return 0;
+        }
+        if (opt->threads == 0) {
+          opt->threads = std::max(1, (int)std::thread::hardware_concurrency());
+        }
+      } else if (!option.compare("--shift-x")) {
+        opt->shift_x = (float)atof(value);
+      } else if (!option.compare("--shift-y")) {
+        opt->shift_y = (float)atof(value);
+      } else if (!option.compare("--alpha-min")) {
+        opt->alpha_min = atoi(value);
+        if (opt->alpha_min < 0 || opt->alpha_min > 255) {
+          fprintf(stderr, "alpha-min out of range, 0 to 255, was %d\n", opt->alpha_min);
+          return 0;
+        }
+      } else if (!option.compare("--alpha-max")) {
+        opt->alpha_max = atoi(value);
+        if (opt->alpha_max < 0 || opt->alpha_max > 255) {
+          fprintf(stderr, "alpha-max out of range, 0 to 255, was %d\n", opt->alpha_max);
+          return 0;
+        }
+      } else if (!option.compare("--debug-color")) {
+        if (value[0] != '0' && value[1] != 'x') {
+          fprintf(stderr, "error: bad debug color: %s\n", value);
+          return 0;
+        }
+        char *p;
+        int color =(int)strtol(value + 2, &p, 16);
+        opt->debug_color[0] = (color >> 16) & 0xFF;
+        opt->debug_color[1] = (color >>  8) & 0xFF;
+        opt->debug_color[2] = (color >>  0) & 0xFF;
+      } else if (!option.compare("--range")) {
+        int start, end;
+        if (!parse_range(value, &start, &end)) {
+          fprintf(stderr, "error: bad range: %s\n", value);
+          return 0;
+        }
+        used->AddRange(start, end);
+      } else if (!option.compare("--exclude-range")) {
+        int start, end;
+        if (!parse_range(value, &start, &end)) {
+          fprintf(stderr, "error: bad range: %s\n", value);
+          return 0;
+        }
+        opt->excluded.AddRange(start, end);
+      } else if (!option.compare("--used-chars-file")) {
+        used_chars_files.push_back(value);
+      } else {
+        fprintf(stderr, "error: unknown option: %s\n", arg);
+        return 0;
+      }
+    }
+  }
+  // scanned after the other options so they can all use --threads
+  if (!used_chars_files.empty() &&
+      !addUsedCodepointsFromUTF8Files(used_chars_files, opt->threads, used, &opt->codepoint_counts)) {
+    return 0;
+  }
+  return 1;
+}
+
+int check_options(Options* opt, const CodepointSet& used) {
+  if (opt->font_filename.empty()) {
+    fprintf(stderr, "error: no font specified\n");
+    return 0;
+  }
+
+  if (opt->font_size <= 0.0) {
+    fprintf(stderr, "error: font size not specified\n");
+    return 0;
+  }
+
+  if (opt->out_name.empty()) {
+    fprintf(stderr, "error: outname not specified\n");
+    return 0;
+  }
+
+  if (opt->sdf && opt->msdf) {
+    fprintf(stderr, "error: use --sdf or --msdf, not both\n");
+    return 0;
+  }
+
+  if ((opt->sdf || opt->msdf) && opt->oversample != 1) {
+    fprintf(stderr, "error: --oversample can't be used with --sdf or --msdf\n");
+    return 0;
+  }
+
+  if (opt->msdf && opt->output_format == kOutputGray8) {
+    fprintf(stderr, "error: --msdf needs 4 channels, it can't be gray8\n");
+    return 0;
+  }
+
+  if (opt->sdf_spread < 1) {
+    fprintf(stderr, "error: bad sdf spread: %d\n", opt->sdf_spread);
+    return 0;
+  }
+
+  CodepointSet wanted = used;
+  wanted.Subtract(opt->excluded);
+  opt->ranges.clear();
+  wanted.GetRanges(&opt->ranges);
+
+  if (!opt->ranges.size()) {
+    fprintf(stderr, "error: no ranges specified\n");
+    return 0;
+  }
+
+  if (opt->verbose) {
+    printf("Ranges:\n");
+    for (auto range : opt->ranges) {
+      printf("  %d - %d\n", range.start, range.end);
+    }
+  }
+
+  return 1;
+}
+
+int parse_command_line(int argc, const char* argv[], Options* opt, CodepointSet* used) {
+  if (!parse_args(argc, argv, opt, used)) {
+    return 0;
+  }
+  // with a manifest every entry is checked once it's been merged with these options
+  if (!opt->manifest.empty()) {
+    return 1;
+  }
+  // the benchmarks pick their own ranges and output, and without --font
+  // use a synthetic font
+  if (!opt->benchmark_suite.empty() || opt->benchmark_packers) {
+    return 1;
+  }
+  return check_options(opt, *used);
+}
+
+const char* help = R"(
+font-atlas-generator [options]
+   --font <path to font>
+   --font-index <font index of font to use in font file. default: 0>
+   --font-size <size to generate, eg: 14>
+   --padding <padding between characters, default: 1>
+   --light <true> use FreeType's light rendering mode
+   --atlas-width <width of atlas to generate, default: 0 = automatic>
+   --atlas-height <height of atlas to generate, default: 0 = automatic>
+   --npot <true> with an automatic size, allow sizes that are not a power of 2
+   --max-page-size <size> split the atlas into pages no bigger than size x size,
+       written as outname_0.png, outname_1.png, ... ASCII, kana and the
+       characters used most in --used-chars-file go on the first page
+   --packer <skyline-bl, skyline-bf, maxrects-bssf or shelf, default: skyline-bl>
+       skyline-bl/bf are stb_rect_pack's bottom-left and best-fit heuristics,
+       maxrects-bssf is MaxRects with best short side fit, shelf packs glyphs
+       in codepoint order into rows, with --glyph-height that's a grid of
+       fixed height cells
+   --benchmark-packers <true> instead of making an atlas, pack the glyphs of
+       ASCII, kana and the first 2000 and 6000 CJK ideographs from a
+       generated font with every packer and print the atlas size, occupancy
+       and time of each. --font and --range aren't used so the results can
+       be compared between runs. --font-size defaults to 32
+   --output-format <rgba, gray8, raw or ktx> rgba is a png of debug-color
+       with the glyphs in alpha, gray8 a 1 channel png, raw just the bytes
+       and ktx an uncompressed KTX texture, both 1 byte per pixel.
+       --msdf is always 4 channels. default: rgba
+   --metrics-format <json or bin> with bin the glyph metrics are also written
+       to outname.bin, a table that can be mmapped and binary searched. See
+       MetricsBinHeader. default: json
+   --png-level <fast, default or max> how hard to compress the .png, it's
+       compressed in stripes on --threads threads. default: default
+   --benchmark-png <true> time writing the atlas with stb and each png level
+   --benchmark-suite <file> instead of making an atlas, make atlases of
+       ASCII, kana and the first 2000 and 6000 CJK ideographs from --font at
+       oversample 1 and 4, normal and light, with and without a fixed
+       glyph height, and write glyphs/sec, pack and encode time and peak
+       memory of each to file as JSON. Sets the font doesn't have, or all
+       of them without --font, use a generated font with a glyph for each
+       character so every case always runs. Failures are listed with their
+       error. --font-size defaults to 32
+   --benchmark-downsample <true> time turning the rendered glyphs into atlas
+       pixels with the old GetPixel loop and the SIMD one and print pixels/sec
+   --sdf <true> make a signed distance field atlas from the glyph outlines
+       so it can be drawn at other sizes. 128 is the edge, more is inside
+   --msdf <true> make a multi-channel distance field atlas, rgb is the msdf,
+       use the median of r, g and b, alpha is the same as --sdf
+   --sdf-spread <pixels> how far from the edge the distance field reaches 0
+       and 255, glyphs grow by this on each side. default: 4
+   --glyph-height <make all glyphs this size, 0 = varying size, default: 0>
+   --y-offset <offset to baseline, default: 0>
+   --outname <base name of output, eg: foo, generates foo.json and foo.png>
+   --oversample <amount to oversample, default: 1>
+   --threads <number of threads to render glyphs with, 0 = one per core, default: 1>
+   --alpha-min <alpha> min alpha, alpha is stretched between min and max. default = 0
+   --alpha-max <alpha> max alpha, alpha is stretched between min and max. default = 255
+   --range <range to generate eg 32-127> note you can specify this multiple times
+   --exclude-range <range not to generate eg 127-159> can also be given more than once
+   --used-chars-file <UTF-8 file or directory of them to scan for used characters>
+       can be given more than once, files are scanned on --threads threads
+   --verbose <true> show more stuff
+   --stats <true> print glyph load/render/pack timings
+   --shift-x <shift-x> fractional amount to shift
+   --shift-y <shift-y> fractional amount to shift
+   --show-grid <true> change colors of each character rect
+   --debug-color <hexcolor eg 0xFF0000> color to use for show-grid
+   --ignore-errors <true> used for debugging to generate output
+   --manifest <json file listing atlases to generate, see below>
+   --cache-dir <dir to cache atlases, rendered glyphs and the autofitter's
+       glyph styles in between runs>
+   --font-cache-dir <dir to remember font file hashes in, default: cache-dir>
+   --previous-atlas <.json from a previous run, glyphs in it keep their place>
+   --profile <file> write the wall and CPU time of each stage of each atlas,
+       glyph and pack attempt counts and bytes written to file as JSON
+   --profile-trace <file> write the same stages as Chrome trace events, open
+       it in chrome://tracing or https://ui.perfetto.dev
+
+With --manifest the file is a JSON array (or an object with a "fonts" array)
+of font configs as used by make-fonts.js, eg:
+
+  [
+    { "font": "foo.ttf", "fontSize": 14, "glyphHeight": 16, "outputName": "fnt_a" },
+    { "font": "foo.ttf", "fontSize": 28, "glyphHeight": 32, "outputName": "fnt_b" }
+  ]
+
+Each key is an option above in camelCase, "outputName" is the same as outname
+and "fontName" is ignored. Options given on the command line apply to every
+entry. Each font file is mapped once and its face is reused across sizes.
+--threads sets how many fonts are generated at once, use "threads" in an
+entry to render its glyphs with more than one thread. Like gen-font.js,
+"debugColor" is only used in entries with "showGrid": true.
+)";
+
+std::string json_string(const std::string& s) {
+  std::string d("\"");
+
+  for (const auto c : s) {
+    switch (c) {
+    case '"':
+    case '\\':
+    case '\b':
+    case '\f':
+    case '\n':
+    case '\r':
+    case '\t':
+      d.push_back('\\');
+      d.push_back(c);
+      break;
+    default:
+      d.push_back(c);
+      break;
+    }
+  }
+
+  d.push_back('\"');
+  return d;
+}
+
+// Just enough JSON to read a --manifest file
+struct JsonValue {
+  enum Type { kNull, kBool, kNumber, kString, kArray, kObject };
+  Type type = kNull;
+  bool boolean = false;
+  std::string string;  // for numbers this is the number as written
+  std::vector<JsonValue> array;
+  std::vector<std::pair<std::string, JsonValue>> object;  // in file order
+};
+
+void skip_json_space(const char** p, const char* end) {
+  while (*p < end && (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n')) {
+    ++*p;
+  }
+}
+
+void append_utf8(int c, std::string* s) {
+  if (c < 0x80) {
+    s->push_back((char)c);
+  } else if (c < 0x800) {
+    s->push_back((char)(0xC0 | (c >> 6)));
+    s->push_back((char)(0x80 | (c & 0x3F)));
+  } else if (c < 0x10000) {
+    s->push_back((char)(0xE0 | (c >> 12)));
+    s->push_back((char)(0x80 | ((c >> 6) & 0x3F)));
+    s->push_back((char)(0x80 | (c & 0x3F)));
+  } else {
+    s->push_back((char)(0xF0 | (c >> 18)));
+    s->push_back((char)(0x80 | ((c >> 12) & 0x3F)));
+    s->push_back((char)(0x80 | ((c >> 6) & 0x3F)));
+    s->push_back((char)(0x80 | (c & 0x3F)));
+  }
+}
+
+bool parse_json_string(const char** p, const char* end, std::string* s) {
+  ++*p;  // opening quote
+  while (*p < end && **p != '"') {
+    char c = *(*p)++;
+    if (c != '\\') {
+      s->push_back(c);
+      continue;
+    }
+    if (*p >= end) {
+      return false;
+    }
+    c = *(*p)++;
+    switch (c) {
+      case 'b': s->push_back('\b'); break;
+      case 'f': s->push_back('\f'); break;
+      case 'n': s->push_back('\n'); break;
+      case 'r': s->push_back('\r'); break;
+      case 't': s->push_back('\t'); break;
+      case 'u': {
+        if (end - *p < 4) {
+          return false;
+        }
+        char hex[5] = { (*p)[0], (*p)[1], (*p)[2], (*p)[3], 0 };
+        *p += 4;
+        int u = (int)strtol(hex, NULL, 16);
+        // surrogate pair
+        if (u >= 0xD800 && u <= 0xDBFF && end - *p >= 6 && (*p)[0] == '\\' && (*p)[1] == 'u') {
+          char lo[5] = { (*p)[2], (*p)[3], (*p)[4], (*p)[5], 0 };
+          *p += 6;
+          u = 0x10000 + ((u - 0xD800) << 10) + ((int)strtol(lo, NULL, 16) - 0xDC00);
+        }
+        append_utf8(u, s);
+        break;
+      }
+      default:
+        s->push_back(c);
+        break;
+    }
+  }
+  if (*p >= end) {
+    return false;
+  }
+  ++*p;  // closing quote
+  return true;
+}
+
+bool parse_json_value(const char** p, const char* end, JsonValue* v) {
+  skip_json_space(p, end);
+  if (*p >= end) {
+    return false;
+  }
+  const char c = **p;
+  if (c == '{') {
+    v->type = JsonValue::kObject;
+    ++*p;
+    skip_json_space(p, end);
+    if (*p < end && **p == '}') {
+      ++*p;
+      return true;
+    }
+    for (;;) {
+      skip_json_space(p, end);
+      std::string key;
+      if (*p >= end || **p != '"' || !parse_json_string(p, end, &key)) {
+        return false;
+      }
+      skip_json_space(p, end);
+      if (*p >= end || **p != ':') {
+        return false;
+      }
+      ++*p;
+      v->object.push_back(std::make_pair(key, JsonValue()));
+      if (!parse_json_value(p, end, &v->object.back().second)) {
+        return false;
+      }
+      skip_json_space(p, end);
+      if (*p < end && **p == ',') {
+        ++*p;
+      } else if (*p < end && **p == '}') {
+        ++*p;
+        return true;
+      } else {
+        return false;
+      }
+    }
+  } else if (c == '[') {
+    v->type = JsonValue::kArray;
+    ++*p;
+    skip_json_space(p, end);
+    if (*p < end && **p == ']') {
+      ++*p;
+      return true;
+    }
+    for (;;) {
+      v->array.push_back(JsonValue());
+      if (!parse_json_value(p, end, &v->array.back())) {
+        return false;
+      }
+      skip_json_space(p, end);
+      if (*p < end && **p == ',') {
+        ++*p;
+      } else if (*p < end && **p == ']') {
+        ++*p;
+        return true;
+      } else {
+        return false;
+      }
+    }
+  } else if (c == '"') {
+    v->type = JsonValue::kString;
+    return parse_json_string(p, end, &v->string);
+  } else if (end - *p >= 4 && !strncmp(*p, "true", 4)) {
+    v->type = JsonValue::kBool;
+    v->boolean = true;
+    *p += 4;
+    return true;
+  } else if (end - *p >= 5 && !strncmp(*p, "false", 5)) {
+    v->type = JsonValue::kBool;
+    *p += 5;
+    return true;
+  } else if (end - *p >= 4 && !strncmp(*p, "null", 4)) {
+    *p += 4;
+    return true;
+  } else if (c == '-' || (c >= '0' && c <= '9')) {
+    v->type = JsonValue::kNumber;
+    while (*p < end && strchr("+-.eE0123456789", **p)) {
+      v->string.push_back(*(*p)++);
+    }
+    return true;
+  }
+  return false;
+}
+
+const JsonValue* json_get(const JsonValue& v, const char* key) {
+  for (const auto& pair : v.object) {
+    if (pair.first == key) {
+      return &pair.second;
+    }
+  }
+  return NULL;
+}
+
+// returns default_value if the key is missing or not a number
+double json_number(const JsonValue& v, const char* key, double default_value) {
+  const JsonValue* value = json_get(v, key);
+  return value && value->type == JsonValue::kNumber ? atof(value->string.c_str()) : default_value;
+}
+
+bool parse_json(const std::vector<unsigned char>& data, JsonValue* v) {
+  const char* p = (const char*)data.data();
+  const char* end = p + data.size();
+  // skip BOM
+  if (data.size() >= 3 && data[0] == 0xEF && data[1] == 0xBB && data[2] == 0xBF) {
+    p += 3;
+  }
+  if (!parse_json_value(&p, end, v)) {
+    return false;
+  }
+  skip_json_space(&p, end);
+  return p == end;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// bitmap baking
+//
+// This is SUPER-AWESOME (tm Ryan Gordon) packing using stb_rect_pack.h. If
+// stb_rect_pack.h isn't available, it uses the BakeFontBitmap strategy.
+
+STBTT_DEF int PackBegin(stbtt_pack_context *spc, int pw, int ph, int stride_in_bytes, int padding, void *alloc_context)
+{
+   stbrp_context *context = (stbrp_context *) STBTT_malloc(sizeof(*context)            ,alloc_context);
+   int            num_nodes = pw - padding;
+   stbrp_node    *nodes   = (stbrp_node    *) STBTT_malloc(sizeof(*nodes  ) * num_nodes,alloc_context);
+
+   if (context == NULL || nodes == NULL) {
+      if (context != NULL) STBTT_free(context, alloc_context);
+      if (nodes   != NULL) STBTT_free(nodes  , alloc_context);
+      return 0;
+   }
+
+   spc->user_allocator_context = alloc_context;
+   spc->width = pw;
+   spc->height = ph;
+   spc->pack_info = context;
+   spc->nodes = nodes;
+   spc->padding = padding;
+   spc->stride_in_bytes = stride_in_bytes != 0 ? stride_in_bytes : pw;
+   spc->h_oversample = 1;
+   spc->v_oversample = 1;
+
+   stbrp_init_target(context, pw-padding, ph-padding, nodes, num_nodes);
+
+   return 1;
+}
+
+STBTT_DEF void PackEnd  (stbtt_pack_context *spc)
+{
+   STBTT_free(spc->nodes    , spc->user_allocator_context);
+   STBTT_free(spc->pack_info, spc->user_allocator_context);
+}
+
+STBTT_DEF void PackFontRangesPackRects(stbtt_pack_context *spc, stbrp_rect *rects, int num_rects)
+{
+   stbrp_pack_rects((stbrp_context *) spc->pack_info, rects, num_rects);
+}
+
+// A copy of FreeType's glyph bitmap. face->glyph->bitmap is overwritten by
+// the next FT_Load_Glyph so we keep our own copy with a positive pitch.
+struct GlyphBitmap {
+  int width = 0;
+  int rows = 0;
+  int pitch = 0;
+  unsigned char pixel_mode = FT_PIXEL_MODE_NONE;
+  std::vector<unsigned char> buffer;
+};
+
+// The outlines kept for DirectRender. Every glyph's points, tags and
+// contours go on the end of the same three arrays so keeping one doesn't
+// allocate. Shared between the glyphs in it and the glyph cache's copies.
+struct OutlinePool {
+  std::vector<FT_Vector> points;
+  std::vector<char> tags;
+  std::vector<short> contours;
+};
+
+// Everything we need from a glyph after it has been loaded, hinted and
+// rendered so we never have to go back to FreeType for it.
+struct RenderedGlyph {
+  int codepoint = 0;
+  FT_UInt glyph_index = 0;
+  bool loaded = false;
+  FT_Glyph_Metrics metrics = {};
+  FT_Vector advance = {};
+  int bitmap_left = 0;
+  int bitmap_top = 0;
+  GlyphBitmap bitmap;
+  // Set when the outline is kept to be rendered straight into the atlas
+  // (see DirectRender). bitmap then has its size but no buffer and the
+  // outline, in outline_pool, is already moved so its bitmap starts at 0, 0.
+  bool direct = false;
+  std::shared_ptr<OutlinePool> outline_pool;
+  int outline_first_point = 0;
+  int outline_points = 0;
+  int outline_first_contour = 0;
+  int outline_contours = 0;
+  int outline_flags = 0;
+};
+
+// FreeType's view of a glyph's kept outline, valid until more outlines are
+// added to its pool
+FT_Outline KeptOutline(const RenderedGlyph& glyph) {
+  FT_Outline outline = {};
+  if (glyph.outline_pool && glyph.outline_points) {
+    OutlinePool& pool = *glyph.outline_pool;
+    outline.n_points = (short)glyph.outline_points;
+    outline.n_contours = (short)glyph.outline_contours;
+    outline.points = pool.points.data() + glyph.outline_first_point;
+    outline.tags = pool.tags.data() + glyph.outline_first_point;
+    outline.contours = pool.contours.data() + glyph.outline_first_contour;
+    outline.flags = glyph.outline_flags;
+  }
+  return outline;
+}
+
+// One stage of making an atlas, for --profile. cpu_ms is the CPU time of
+// the thread that ran the stage, so it stays right with --manifest making
+// several atlases at once. "load+render" adds its worker threads' time,
+// each also has its own "load+render thread" stage. The .png stripes
+// compressed on other threads aren't counted in "write atlas".
+struct StageTime {
+  const char* name;
+  double start_ms;
+  double wall_ms;
+  double cpu_ms;
+  std::thread::id thread;
+};
+
+struct Stats {
+  int threads = 1;
+  int codepoints = 0;          // in the font and asked for
+  int codepoints_missing = 0;  // asked for but not in the font
+  int glyphs_rendered = 0;
+  int glyphs_cached = 0;        // glyph cache hits
+  int glyphs_cache_missed = 0;  // glyph cache misses, 0 without --cache-dir
+  double glyphs_ms = 0.0;   // wall time to load and render all glyphs
+  double load_ms = 0.0;     // FT_Load_Glyph, includes hinting
+  double render_ms = 0.0;   // FT_Render_Glyph
+  double pack_ms = 0.0;
+  int pack_attempts = 0;
+  int atlas_width = 0;
+  int atlas_height = 0;
+  double pack_efficiency = 0.0;  // glyph rect area / atlas area
+  int wasted_area = 0;
+  int pages = 1;
+  double blit_ms = 0.0;
+  int glyphs_shared = 0;           // drawn once, in another glyph's rect
+  int glyphs_shared_by_index = 0;  // of those, the same glyph index
+  int64_t shared_bytes_saved = 0;
+  int64_t bytes_written = 0;
+  std::vector<StageTime> stages;
+};
+
+// Adds a StageTime to stats covering from construction until Stop or the
+// end of its scope. stats can be NULL.
+struct StageTimer {
+  StageTimer(Stats* stats, const char* name)
+      : stats(stats), name(name), start_ms(NowMs()), start_cpu_ms(CpuMs(true)) {
+  }
+  ~StageTimer() {
+    Stop();
+  }
+  // returns the wall time in ms
+  double Stop() {
+    const double wall_ms = NowMs() - start_ms;
+    if (stats) {
+      stats->stages.push_back({ name, start_ms, wall_ms, CpuMs(true) - start_cpu_ms + other_cpu_ms, std::this_thread::get_id() });
+      stats = NULL;
+    }
+    return wall_ms;
+  }
+  // CPU time other threads spent on this stage
+  void AddCpuMs(double ms) {
+    other_cpu_ms += ms;
+  }
+
+  Stats* stats;
+  const char* name;
+  double start_ms;
+  double start_cpu_ms;
+  double other_cpu_ms = 0.0;
+};
+
+void AddStats(Stats* dst, const Stats& src) {
+  dst->glyphs_rendered += src.glyphs_rendered;
+  dst->glyphs_cached += src.glyphs_cached;
+  dst->glyphs_cache_missed += src.glyphs_cache_missed;
+  dst->load_ms += src.load_ms;
+  dst->render_ms += src.render_ms;
+  dst->pack_ms += src.pack_ms;
+  dst->pack_attempts += src.pack_attempts;
+  dst->blit_ms += src.blit_ms;
+  dst->stages.insert(dst->stages.end(), src.stages.begin(), src.stages.end());
+}
+
+struct PackRect {
+  int x = 0;
+  int y = 0;
+  int w = 0;
+  int h = 0;
+};
+
+// MaxRects packer. Free space is a list of maximal free rectangles, which
+// may overlap, so it can pack around rects that are already placed.
+struct MaxRectsPacker {
+  std::vector<PackRect> free_rects;
+
+  void Init(int width, int height) {
+    PackRect all;
+    all.w = width;
+    all.h = height;
+    free_rects.assign(1, all);
+  }
+
+  // Best Short Side Fit: use the free rect that leaves the smallest gap on
+  // its tighter side, ties go to the smallest gap on the other side.
+  bool Insert(int w, int h, int* x, int* y) {
+    int best = -1;
+    int best_short = INT_MAX;
+    int best_long = INT_MAX;
+    for (int i = 0; i < (int)free_rects.size(); ++i) {
+      const PackRect& fr = free_rects[i];
+      if (w <= fr.w && h <= fr.h) {
+        const int short_side = std::min(fr.w - w, fr.h - h);
+        const int long_side = std::max(fr.w - w, fr.h - h);
+        if (short_side < best_short || (short_side == best_short && long_side < best_long)) {
+          best = i;
+          best_short = short_side;
+          best_long = long_side;
+        }
+      }
+    }
+    if (best < 0) {
+      return false;
+    }
+    PackRect used;
+    used.x = free_rects[best].x;
+    used.y = free_rects[best].y;
+    used.w = w;
+    used.h = h;
+    Occupy(used);
+    *x = used.x;
+    *y = used.y;
+    return true;
+  }
+
+  // Removes used from the free space
+  void Occupy(const PackRect& used) {
+    if (used.w <= 0 || used.h <= 0) {
+      return;
+    }
+    std::vector<PackRect> split;
+    for (size_t i = 0; i < free_rects.size();) {
+      const PackRect fr = free_rects[i];
+      if (used.x >= fr.x + fr.w || used.x + used.w <= fr.x ||
+          used.y >= fr.y + fr.h || used.y + used.h <= fr.y) {
+        ++i;
+        continue;
+      }
+      if (used.x > fr.x) {
+        PackRect r = fr;
+        r.w = used.x - fr.x;
+        split.push_back(r);
+      }
+      if (used.x + used.w < fr.x + fr.w) {
+        PackRect r = fr;
+        r.x = used.x + used.w;
+        r.w = fr.x + fr.w - r.x;
+        split.push_back(r);
+      }
+      if (used.y > fr.y) {
+        PackRect r = fr;
+        r.h = used.y - fr.y;
+        split.push_back(r);
+      }
+      if (used.y + used.h < fr.y + fr.h) {
+        PackRect r = fr;
+        r.y = used.y + used.h;
+        r.h = fr.y + fr.h - r.y;
+        split.push_back(r);
+      }
+      free_rects[i] = free_rects.back();
+      free_rects.pop_back();
+    }
+
+    // The rects that were there before are still maximal so only the new
+    // ones can be inside another one.
+    for (size_t i = 0; i < split.size(); ++i) {
+      const PackRect& r = split[i];
+      bool contained = false;
+      for (size_t j = 0; j < free_rects.size() && !contained; ++j) {
+        contained = Contains(free_rects[j], r);
+      }
+      for (size_t j = i + 1; j < split.size() && !contained; ++j) {
+        contained = Contains(split[j], r);
+      }
+      if (!contained) {
+        free_rects.push_back(r);
+      }
+    }
+  }
+
+  static bool Contains(const PackRect& outer, const PackRect& inner) {
+    return inner.x >= outer.x && inner.y >= outer.y &&
+           inner.x + inner.w <= outer.x + outer.w &&
+           inner.y + inner.h <= outer.y + outer.h;
+  }
+};
+
+// Where each glyph went in an atlas from a previous run, see --previous-atlas
+struct PreviousAtlas {
+  int width = 0;
+  int height = 0;
+  std::map<int, PackRect> rects;  // by codepoint, in stbrp_rect coordinates
+};
+
+bool LoadPreviousAtlas(const Options& opt, uint64_t font_hash, uint64_t font_fingerprint, PreviousAtlas* previous) {
+  std::vector<unsigned char> data;
+  if (!readFile(opt.previous_atlas.c_str(), &data)) {
+    return false;
+  }
+  JsonValue atlas;
+  if (!parse_json(data, &atlas) || atlas.type != JsonValue::kObject) {
+    fprintf(stderr, "warn: could not parse previous atlas: %s\n", opt.previous_atlas.c_str());
+    return false;
+  }
+  // positions are only useful if the glyphs are the same, so everything
+  // GlyphCacheKey looks at has to match, plus what changes the rect sizes.
+  // The font is checked by its hash when both runs hashed it, otherwise by
+  // the fingerprint.
+  const JsonValue* previous_hash = json_get(atlas, "fontHash");
+  const bool by_hash = previous_hash && font_hash;
+  if (!by_hash) {
+    previous_hash = json_get(atlas, "fontFingerprint");
+  }
+  char hash[17];
+  snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)(by_hash ? font_hash : font_fingerprint));
+  const JsonValue* light = json_get(atlas, "light");
+  const JsonValue* distance_field = json_get(atlas, "distanceField");
+  const JsonValue* distance_field_type = distance_field ? json_get(*distance_field, "type") : NULL;
+  const char* expected_type = opt.msdf ? "msdf" : opt.sdf ? "sdf" : "";
+  if (!previous_hash || previous_hash->type != JsonValue::kString || previous_hash->string != hash ||
+      json_number(atlas, "fontSize", 0) != opt.font_size ||
+      json_number(atlas, "fontIndex", 0) != opt.font_index ||
+      json_number(atlas, "oversample", 0) != opt.oversample ||
+      json_number(atlas, "padding", 0) != opt.padding ||
+      json_number(atlas, "glyphHeight", 0) != opt.glyph_height ||
+      !light || light->type != JsonValue::kBool || light->boolean != opt.light ||
+      (distance_field_type ? distance_field_type->string : std::string()) != expected_type ||
+      ((opt.sdf || opt.msdf) && json_number(*distance_field, "spread", 0) != opt.sdf_spread)) {
+    fprintf(stderr, "warn: previous atlas %s was made with different settings, ignoring it\n", opt.previous_atlas.c_str());
+    return false;
+  }
+  const JsonValue* glyphs = json_get(atlas, "glyphs");
+  if (!glyphs || glyphs->type != JsonValue::kArray) {
+    fprintf(stderr, "warn: no glyphs in previous atlas: %s\n", opt.previous_atlas.c_str());
+    return false;
+  }
+  previous->width = (int)json_number(atlas, "atlasWidth", 0);
+  previous->height = (int)json_number(atlas, "atlasHeight", 0);
+  for (const auto& glyph : glyphs->array) {
+    const JsonValue* tex = json_get(glyph, "tex");
+    if (!tex) {
+      continue;
+    }
+    // undo the padding adjustments done when writing the .json
+    PackRect r;
+    r.x = (int)json_number(*tex, "x", 0) - opt.padding;
+    r.y = (int)json_number(*tex, "y", 0) - opt.padding;
+    r.w = (int)json_number(*tex, "w", 0) + opt.padding * 3 - 2;
+    r.h = (int)json_number(*tex, "h", 0) + opt.padding * 3 - 2;
+    if (r.x < 0 || r.y < 0 || r.w <= 0 || r.h <= 0) {
+      continue;
+    }
+    previous->rects[(int)json_number(glyph, "codePoint", 0)] = r;
+  }
+  return true;
+}
+
+// Packs the rects that aren't marked keep into the space the kept ones
+// leave free. Kept rects must already have their x and y set.
+void PackAroundKeptRects(stbtt_pack_context *spc, stbrp_rect *rects, const std::vector<char>& keep, int num_rects)
+{
+   MaxRectsPacker packer;
+   packer.Init(spc->width - spc->padding, spc->height - spc->padding);
+   for (int i = 0; i < num_rects; ++i) {
+     if (keep[i]) {
+       PackRect r;
+       r.x = rects[i].x;
+       r.y = rects[i].y;
+       r.w = rects[i].w;
+       r.h = rects[i].h;
+       rects[i].was_packed = r.x + r.w <= spc->width - spc->padding && r.y + r.h <= spc->height - spc->padding;
+       packer.Occupy(r);
+     }
+   }
+   for (int i = 0; i < num_rects; ++i) {
+     stbrp_rect* r = &rects[i];
+     if (keep[i]) {
+       continue;
+     }
+     if (r->w == 0 || r->h == 0) {
+       r->x = 0;
+       r->y = 0;
+       r->was_packed = 1;
+       continue;
+     }
+     int x;
+     int y;
+     r->was_packed = packer.Insert(r->w, r->h, &x, &y);
+     if (r->was_packed) {
+       r->x = (stbrp_coord)x;
+       r->y = (stbrp_coord)y;
+     }
+   }
+}
+
+// Packs all the rects with MaxRects, biggest first. The original order is
+// kept for ties so the result is deterministic.
+void MaxRectsPackRects(stbtt_pack_context *spc, stbrp_rect *rects, int num_rects)
+{
+   std::vector<int> order;
+   for (int i = 0; i < num_rects; ++i) {
+     if (rects[i].w == 0 || rects[i].h == 0) {
+       rects[i].x = 0;
+       rects[i].y = 0;
+       rects[i].was_packed = 1;
+     } else {
+       order.push_back(i);
+     }
+   }
+   std::stable_sort(order.begin(), order.end(), [rects](int a, int b) {
+     if (rects[a].h != rects[b].h) {
+       return rects[a].h > rects[b].h;
+     }
+     return rects[a].w > rects[b].w;
+   });
+
+   MaxRectsPacker packer;
+   packer.Init(spc->width - spc->padding, spc->height - spc->padding);
+   for (size_t i = 0; i < order.size(); ++i) {
+     stbrp_rect* r = &rects[order[i]];
+     int x;
+     int y;
+     if (!packer.Insert(r->w, r->h, &x, &y)) {
+       // it's going to fail so mark the rest as not packed and stop
+       for (; i < order.size(); ++i) {
+         rects[order[i]].was_packed = 0;
+       }
+       return;
+     }
+     r->x = (stbrp_coord)x;
+     r->y = (stbrp_coord)y;
+     r->was_packed = 1;
+   }
+}
+
+unsigned char GetPixel(const GlyphBitmap& bm, int x, int y) {
+  if (x < 0 || x >= bm.width || y < 0 || y >= bm.rows) {
+    return 0;
+  }
+
+  switch (bm.pixel_mode) {
+    case FT_PIXEL_MODE_MONO:
+      return (bm.buffer[y * bm.pitch + (x >> 3)] & (0x80 >> (x & 0x7)))
+        ? 255
+        : 0;
+    case FT_PIXEL_MODE_GRAY:
+      return bm.buffer[y * bm.pitch + x];
+    default:
+      fprintf(stderr, "unknown pixel mode!!!!\n");
+      return 0;
+  }
+}
+
+void DumpBitmap(const GlyphBitmap& bm) {
+  for (int y = 0; y < bm.rows; ++y) {
+    for (int x = 0; x < bm.width; ++x) {
+      printf("%s", GetPixel(bm, x, y) > 0 ? "*" : ".");
+    }
+    printf("\n");
+  }
+}
+
+void CopyBitmap(const FT_Bitmap& src, GlyphBitmap* dst) {
+  const int row_bytes = src.pitch < 0 ? -src.pitch : src.pitch;
+  dst->width = (int)src.width;
+  dst->rows = (int)src.rows;
+  dst->pitch = row_bytes;
+  dst->pixel_mode = src.pixel_mode;
+  dst->buffer.resize(row_bytes * src.rows);
+  for (int y = 0; y < (int)src.rows; ++y) {
+    // with a negative pitch FreeType's buffer points at the last row
+    const unsigned char* src_row = src.pitch < 0
+        ? src.buffer + ((int)src.rows - 1 - y) * row_bytes
+        : src.buffer + y * row_bytes;
+    memcpy(dst->buffer.data() + y * row_bytes, src_row, row_bytes);
+  }
+}
+
+// Downsampling
+//
+// Each atlas pixel is the average of oversample x oversample rendered
+// pixels, remapped by --alpha-min/--alpha-max. Rather than calling GetPixel
+// for every sample, each rendered row is unpacked to 1 byte per pixel,
+// oversample rows are summed into 16 bit columns with SIMD, oversample
+// columns are added up and one table lookup does the rounding and remap.
+
+// The atlas value for every possible sum of oversample x oversample pixels.
+// Must match what DownsampleReference does.
+void BuildAlphaTable(const Options& opt, std::vector<unsigned char>* table) {
+  const int scale_sq = opt.oversample * opt.oversample;
+  const int alpha_range = opt.alpha_max - opt.alpha_min;
+  table->resize(255 * scale_sq + 1);
+  for (int sum = 0; sum <= 255 * scale_sq; ++sum) {
+    int pixel = (sum + opt.oversample / 2) / scale_sq;
+    if (alpha_range > 1) {
+      pixel = std::min(255, std::max(0, pixel - opt.alpha_min) * 255 / alpha_range);
+    } else {
+      pixel = pixel > opt.alpha_min ? 255 : 0;
+    }
+    (*table)[sum] = (unsigned char)pixel;
+  }
+}
+
+// 8 bytes of 0 or 255 for each byte of a MONO bitmap
+const unsigned char* MonoUnpackTable() {
+  static unsigned char table[256 * 8];
+  static bool initialized = [] {
+    for (int b = 0; b < 256; ++b) {
+      for (int bit = 0; bit < 8; ++bit) {
+        table[b * 8 + bit] = (b & (0x80 >> bit)) ? 255 : 0;
+      }
+    }
+    return true;
+  }();
+  (void)initialized;
+  return table;
+}
+
+// Row y of bm as 1 byte per pixel. dst must have room for pitch * 8 bytes.
+void UnpackRow(const GlyphBitmap& bm, int y, unsigned char* dst) {
+  const unsigned char* src = bm.buffer.data() + y * bm.pitch;
+  if (bm.pixel_mode == FT_PIXEL_MODE_GRAY) {
+    memcpy(dst, src, bm.width);
+    return;
+  }
+  const unsigned char* table = MonoUnpackTable();
+  const int num_bytes = (bm.width + 7) / 8;
+  for (int i = 0; i < num_bytes; ++i) {
+    memcpy(dst + i * 8, table + src[i] * 8, 8);
+  }
+}
+
+// which of the SIMD code paths this was built with
+const char* SimdName() {
+#if HAVE_AVX2
+  return "avx2";
+#elif HAVE_SSE2
+  return "sse2";
+#elif HAVE_NEON
+  return "neon";
+#else
+  return "scalar";
+#endif
+}
+
+// sums[x] += src[x] for width pixels
+void AccumulateRow(const unsigned char* src, int width, uint16_t* sums) {
+  int x = 0;
+#if HAVE_AVX2
+  for (; x + 16 <= width; x += 16) {
+    const __m256i s = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + x)));
+    __m256i* dst = (__m256i*)(sums + x);
+    _mm256_storeu_si256(dst, _mm256_add_epi16(_mm256_loadu_si256(dst), s));
+  }
+#endif
+#if HAVE_SSE2
+  const __m128i zero = _mm_setzero_si128();
+  for (; x + 16 <= width; x += 16) {
+    const __m128i s = _mm_loadu_si128((const __m128i*)(src + x));
+    __m128i* lo = (__m128i*)(sums + x);
+    __m128i* hi = (__m128i*)(sums + x + 8);
+    _mm_storeu_si128(lo, _mm_add_epi16(_mm_loadu_si128(lo), _mm_unpacklo_epi8(s, zero)));
+    _mm_storeu_si128(hi, _mm_add_epi16(_mm_loadu_si128(hi), _mm_unpackhi_epi8(s, zero)));
+  }
+#elif HAVE_NEON
+  for (; x + 16 <= width; x += 16) {
+    const uint8x16_t s = vld1q_u8(src + x);
+    vst1q_u16(sums + x, vaddw_u8(vld1q_u16(sums + x), vget_low_u8(s)));
+    vst1q_u16(sums + x + 8, vaddw_u8(vld1q_u16(sums + x + 8), vget_high_u8(s)));
+  }
+#endif
+  for (; x < width; ++x) {
+    sums[x] += src[x];
+  }
+}
+
+// Scratch rows so DownsampleGlyph doesn't allocate per glyph
+struct DownsampleBuffers {
+  std::vector<unsigned char> row;
+  std::vector<uint16_t> sums;
+};
+
+// Writes num_rows rows of (bm.width + oversample - 1) / oversample atlas
+// pixels for a GRAY or MONO bitmap. alpha_table is from BuildAlphaTable.
+void DownsampleGlyph(const GlyphBitmap& bm, int num_rows, int oversample, const unsigned char* alpha_table, unsigned char* dst, int dst_stride, DownsampleBuffers* buffers) {
+  const int dst_width = (bm.width + oversample - 1) / oversample;
+  buffers->row.resize(std::max(bm.pitch * 8, bm.width));
+  buffers->sums.resize(dst_width * oversample);
+  uint16_t* sums = buffers->sums.data();
+  for (int y = 0; y < num_rows; ++y, dst += dst_stride) {
+    std::fill(buffers->sums.begin(), buffers->sums.end(), 0);
+    for (int yy = 0; yy < oversample; ++yy) {
+      const int src_y = y * oversample + yy;
+      if (src_y >= bm.rows) {
+        break;
+      }
+      UnpackRow(bm, src_y, buffers->row.data());
+      AccumulateRow(buffers->row.data(), bm.width, sums);
+    }
+    if (oversample == 1) {
+      for (int x = 0; x < dst_width; ++x) {
+        dst[x] = alpha_table[sums[x]];
+      }
+      continue;
+    }
+    const uint16_t* s = sums;
+    for (int x = 0; x < dst_width; ++x) {
+      int sum = 0;
+      for (int xx = 0; xx < oversample; ++xx) {
+        sum += *s++;
+      }
+      dst[x] = alpha_table[sum];
+    }
+  }
+}
+
+// The original per sample loop. Still used for pixel modes other than GRAY
+// and MONO and by --benchmark-downsample to compare against.
+void DownsampleReference(const GlyphBitmap& bm, int num_rows, const Options& opt, unsigned char* dst, int dst_stride) {
+  int alpha_range = opt.alpha_max - opt.alpha_min;
+  int scale_sq = opt.oversample * opt.oversample;
+  for (int y = 0; y < num_rows; ++y, dst += dst_stride) {
+    for (int x = 0; x < (bm.width + opt.oversample - 1) / opt.oversample; ++x) {
+      int pixel = 0;
+      for (int yy = 0; yy < opt.oversample; ++yy) {
+        for (int xx = 0; xx < opt.oversample; ++xx) {
+          pixel += GetPixel(bm, x * opt.oversample + xx, y * opt.oversample + yy);
+        }
+      }
+      pixel = (pixel + opt.oversample / 2) / scale_sq;
+
+      if (alpha_range > 1) {
+        pixel = std::min(255, std::max(0, pixel - opt.alpha_min) * 255 / alpha_range);
+      } else {
+        pixel = pixel > opt.alpha_min ? 255 : 0;
+      }
+      dst[x] = pixel;
+    }
+  }
+}
+
+// Distance fields
+//
+// --sdf and --msdf render each glyph's outline as a distance field instead
+// of coverage so one atlas can be scaled to many sizes. The outline is
+// flattened into line segments and, one row at a time, every segment near
+// the row updates the closest distance for every pixel in its x range.
+// SegmentDistances and SelectClosest do that 4 pixels at a time with SSE2
+// or NEON intrinsics, with a scalar loop for the rest of the row and for
+// builds with neither.
+//
+// Values are 128 on the edge, above inside and below outside, reaching
+// 0 and 255 at --sdf-spread pixels from the edge.
+//
+// --msdf is a multi-channel distance field. The outline's edges are
+// colored so the edges on either side of a corner never share more than one
+// channel, each channel is the signed distance to its own edges and the
+// median of the 3 channels keeps the corners sharp. Alpha is the true
+// distance, the same as --sdf.
+
+enum {
+  kEdgeRed = 1,
+  kEdgeGreen = 2,
+  kEdgeBlue = 4,
+  kEdgeYellow = kEdgeRed | kEdgeGreen,
+  kEdgeMagenta = kEdgeRed | kEdgeBlue,
+  kEdgeCyan = kEdgeGreen | kEdgeBlue,
+  kEdgeWhite = kEdgeRed | kEdgeGreen | kEdgeBlue,
+};
+
+// The flattened outline, one entry per line segment, in pixels.
+struct OutlineSegments {
+  std::vector<float> ax, ay;    // start
+  std::vector<float> dx, dy;    // end - start
+  std::vector<float> inv_len2;  // 1 / |d|^2
+  std::vector<float> inv_len;   // 1 / |d|
+  std::vector<unsigned char> colors;
+  // 1 if this segment starts/ends one of the outline's edges, past there
+  // the msdf uses the distance to the edge's extended line
+  std::vector<unsigned char> edge_start, edge_end;
+  size_t size() const { return ax.size(); }
+};
+
+// One line or curve of the outline as FT_Outline_Decompose gives it
+struct OutlineEdge {
+  int first_segment = 0;
+  int num_segments = 0;
+  float start_dir[2] = { 0, 0 };
+  float end_dir[2] = { 0, 0 };
+};
+
+struct OutlineFlattener {
+  OutlineSegments* segments;
+  std::vector<std::vector<OutlineEdge>> contours;
+  float x = 0;
+  float y = 0;
+
+  void AddSegment(float x0, float y0, float x1, float y1) {
+    const float dx = x1 - x0;
+    const float dy = y1 - y0;
+    const float len2 = dx * dx + dy * dy;
+    if (len2 < 1e-12f) {
+      return;
+    }
+    segments->ax.push_back(x0);
+    segments->ay.push_back(y0);
+    segments->dx.push_back(dx);
+    segments->dy.push_back(dy);
+    segments->inv_len2.push_back(1.0f / len2);
+    segments->inv_len.push_back(1.0f / sqrtf(len2));
+    segments->colors.push_back(kEdgeWhite);
+    segments->edge_start.push_back(0);
+    segments->edge_end.push_back(0);
+  }
+
+  // points are p0, then count more control/end points, a cubic has 4
+  void AddEdge(const float* px, const float* py, int count) {
+    OutlineEdge edge;
+    edge.first_segment = (int)segments->size();
+    // about 1 segment every 2 pixels of control polygon is plenty
+    float len = 0;
+    for (int i = 0; i < count - 1; ++i) {
+      len += hypotf(px[i + 1] - px[i], py[i + 1] - py[i]);
+    }
+    const int steps = count == 2 ? 1 : std::max(2, std::min(32, (int)ceilf(len * 0.5f)));
+    float last_x = px[0];
+    float last_y = py[0];
+    for (int s = 1; s <= steps; ++s) {
+      const float t = (float)s / steps;
+      const float u = 1.0f - t;
+      float nx, ny;
+      if (count == 2) {
+        nx = px[1];
+        ny = py[1];
+      } else if (count == 3) {
+        nx = u * u * px[0] + 2 * u * t * px[1] + t * t * px[2];
+        ny = u * u * py[0] + 2 * u * t * py[1] + t * t * py[2];
+      } else {
+        nx = u * u * u * px[0] + 3 * u * u * t * px[1] + 3 * u * t * t * px[2] + t * t * t * px[3];
+        ny = u * u * u * py[0] + 3 * u * u * t * py[1] + 3 * u * t * t * py[2] + t * t * t * py[3];
+      }
+      AddSegment(last_x, last_y, nx, ny);
+      last_x = nx;
+      last_y = ny;
+    }
+    edge.num_segments = (int)segments->size() - edge.first_segment;
+    if (!edge.num_segments) {
+      return;
+    }
+    // the tangents at each end, skipping control points on top of the ends
+    for (int i = 1; i < count; ++i) {
+      if (px[i] != px[0] || py[i] != py[0]) {
+        edge.start_dir[0] = px[i] - px[0];
+        edge.start_dir[1] = py[i] - py[0];
+        break;
+      }
+    }
+    for (int i = count - 2; i >= 0; --i) {
+      if (px[i] != px[count - 1] || py[i] != py[count - 1]) {
+        edge.end_dir[0] = px[count - 1] - px[i];
+        edge.end_dir[1] = py[count - 1] - py[i];
+        break;
+      }
+    }
+    segments->edge_start[edge.first_segment] = 1;
+    segments->edge_end[edge.first_segment + edge.num_segments - 1] = 1;
+    contours.back().push_back(edge);
+  }
+
+  static OutlineFlattener* Self(void* user) { return (OutlineFlattener*)user; }
+  static float ToPixels(FT_Pos v) { return v / 64.0f; }
+
+  static int MoveTo(const FT_Vector* to, void* user) {
+    OutlineFlattener* self = Self(user);
+    self->contours.emplace_back();
+    self->x = ToPixels(to->x);
+    self->y = ToPixels(to->y);
+    return 0;
+  }
+  static int LineTo(const FT_Vector* to, void* user) {
+    OutlineFlattener* self = Self(user);
+    const float px[2] = { self->x, ToPixels(to->x) };
+    const float py[2] = { self->y, ToPixels(to->y) };
+    self->AddEdge(px, py, 2);
+    self->x = px[1];
+    self->y = py[1];
+    return 0;
+  }
+  static int ConicTo(const FT_Vector* control, const FT_Vector* to, void* user) {
+    OutlineFlattener* self = Self(user);
+    const float px[3] = { self->x, ToPixels(control->x), ToPixels(to->x) };
+    const float py[3] = { self->y, ToPixels(control->y), ToPixels(to->y) };
+    self->AddEdge(px, py, 3);
+    self->x = px[2];
+    self->y = py[2];
+    return 0;
+  }
+  static int CubicTo(const FT_Vector* control1, const FT_Vector* control2, const FT_Vector* to, void* user) {
+    OutlineFlattener* self = Self(user);
+    const float px[4] = { self->x, ToPixels(control1->x), ToPixels(control2->x), ToPixels(to->x) };
+    const float py[4] = { self->y, ToPixels(control1->y), ToPixels(control2->y), ToPixels(to->y) };
+    self->AddEdge(px, py, 4);
+    self->x = px[3];
+    self->y = py[3];
+    return 0;
+  }
+};
+
+bool IsCorner(const float* a, const float* b) {
+  const float len_a = hypotf(a[0], a[1]);
+  const float len_b = hypotf(b[0], b[1]);
+  if (len_a == 0 || len_b == 0) {
+    return false;
+  }
+  const float dot = (a[0] * b[0] + a[1] * b[1]) / (len_a * len_b);
+  const float cross = (a[0] * b[1] - a[1] * b[0]) / (len_a * len_b);
+  // sin(3 radians), same as msdfgen's default angle threshold
+  return dot <= 0 || fabsf(cross) > 0.1411f;
+}
+
+void SwitchColor(int* color) {
+  static const int next[8] = { 0, 0, 0, kEdgeMagenta, 0, kEdgeCyan, kEdgeYellow, kEdgeCyan };
+  *color = next[*color];
+}
+
+// Colors edges so the ones meeting at a corner share only one channel,
+// msdfgen's "simple" edge coloring.
+void ColorEdges(const std::vector<std::vector<OutlineEdge>>& contours, OutlineSegments* segments) {
+  auto set_color = [&](const OutlineEdge& edge, int color) {
+    for (int i = 0; i < edge.num_segments; ++i) {
+      segments->colors[edge.first_segment + i] = (unsigned char)color;
+    }
+  };
+  for (const auto& edges : contours) {
+    std::vector<int> corners;
+    const int num_edges = (int)edges.size();
+    for (int i = 0; i < num_edges; ++i) {
+      const OutlineEdge& prev = edges[(i + num_edges - 1) % num_edges];
+      if (IsCorner(prev.end_dir, edges[i].start_dir)) {
+        corners.push_back(i);
+      }
+    }
+    if (corners.empty()) {
+      // smooth, every channel can use every edge
+      continue;
+    }
+    if (corners.size() == 1) {
+      // a teardrop, split it in 3 starting at the corner
+      const int colors[3] = { kEdgeMagenta, kEdgeWhite, kEdgeYellow };
+      int num_segments = 0;
+      for (const auto& edge : edges) {
+        num_segments += edge.num_segments;
+      }
+      int n = 0;
+      for (int i = 0; i < num_edges; ++i) {
+        const OutlineEdge& edge = edges[(corners[0] + i) % num_edges];
+        for (int s = 0; s < edge.num_segments; ++s, ++n) {
+          segments->colors[edge.first_segment + s] = (unsigned char)colors[n * 3 / num_segments];
+        }
+      }
+      continue;
+    }
+    int color = kEdgeCyan;
+    const int num_corners = (int)corners.size();
+    for (int c = 0; c < num_corners; ++c) {
+      SwitchColor(&color);
+      // the last run must not match the first
+      if (c == num_corners - 1 && color == kEdgeYellow) {
+        SwitchColor(&color);
+      }
+      const int start = corners[c];
+      const int end = corners[(c + 1) % num_corners];
+      for (int i = start; i != end; i = (i + 1) % num_edges) {
+        set_color(edges[i], color);
+      }
+    }
+  }
+}
+
+// For pixels x0 to x1 of a row at xs[x], qy = the row's y - ay, puts the
+// squared distance to the segment from (ax, ay) to (ax + dx, ay + dy) in
+// d2[x] and keeps the smallest in best[x]. This is where --sdf spends its
+// time so it does 4 pixels at a time.
+void SegmentDistances(const float* xs, int x0, int x1, float ax, float qy, float dx, float dy, float inv_len2, float* d2, float* best) {
+  int x = x0;
+#if HAVE_SSE2
+  const __m128 v_ax = _mm_set1_ps(ax);
+  const __m128 v_dx = _mm_set1_ps(dx);
+  const __m128 v_dy = _mm_set1_ps(dy);
+  const __m128 v_qy = _mm_set1_ps(qy);
+  const __m128 v_qy_dy = _mm_set1_ps(qy * dy);
+  const __m128 v_inv_len2 = _mm_set1_ps(inv_len2);
+  const __m128 v_zero = _mm_setzero_ps();
+  const __m128 v_one = _mm_set1_ps(1.0f);
+  for (; x + 4 <= x1; x += 4) {
+    const __m128 qx = _mm_sub_ps(_mm_loadu_ps(xs + x), v_ax);
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(qx, v_dx), v_qy_dy), v_inv_len2);
+    t = _mm_min_ps(_mm_max_ps(t, v_zero), v_one);
+    const __m128 ex = _mm_sub_ps(qx, _mm_mul_ps(t, v_dx));
+    const __m128 ey = _mm_sub_ps(v_qy, _mm_mul_ps(t, v_dy));
+    const __m128 d = _mm_add_ps(_mm_mul_ps(ex, ex), _mm_mul_ps(ey, ey));
+    _mm_storeu_ps(d2 + x, d);
+    _mm_storeu_ps(best + x, _mm_min_ps(d, _mm_loadu_ps(best + x)));
+  }
+#elif HAVE_NEON
+  const float32x4_t v_ax = vdupq_n_f32(ax);
+  const float32x4_t v_dx = vdupq_n_f32(dx);
+  const float32x4_t v_dy = vdupq_n_f32(dy);
+  const float32x4_t v_qy = vdupq_n_f32(qy);
+  const float32x4_t v_qy_dy = vdupq_n_f32(qy * dy);
+  const float32x4_t v_inv_len2 = vdupq_n_f32(inv_len2);
+  const float32x4_t v_zero = vdupq_n_f32(0.0f);
+  const float32x4_t v_one = vdupq_n_f32(1.0f);
+  for (; x + 4 <= x1; x += 4) {
+    const float32x4_t qx = vsubq_f32(vld1q_f32(xs + x), v_ax);
+    float32x4_t t = vmulq_f32(vmlaq_f32(v_qy_dy, qx, v_dx), v_inv_len2);
+    t = vminq_f32(vmaxq_f32(t, v_zero), v_one);
+    const float32x4_t ex = vmlsq_f32(qx, t, v_dx);
+    const float32x4_t ey = vmlsq_f32(v_qy, t, v_dy);
+    const float32x4_t d = vmlaq_f32(vmulq_f32(ex, ex), ey, ey);
+    vst1q_f32(d2 + x, d);
+    vst1q_f32(best + x, vminq_f32(d, vld1q_f32(best + x)));
+  }
+#endif
+  for (; x < x1; ++x) {
+    const float qx = xs[x] - ax;
+    float t = (qx * dx + qy * dy) * inv_len2;
+    t = std::min(std::max(t, 0.0f), 1.0f);
+    const float ex = qx - t * dx;
+    const float ey = qy - t * dy;
+    const float d = ex * ex + ey * ey;
+    d2[x] = d;
+    best[x] = std::min(d, best[x]);
+  }
+}
+
+// Where d2[x] is closer than best[x] takes it and value[x] for best_value[x]
+void SelectClosest(const float* d2, const float* value, int x0, int x1, float* best, float* best_value) {
+  int x = x0;
+#if HAVE_SSE2
+  for (; x + 4 <= x1; x += 4) {
+    const __m128 d = _mm_loadu_ps(d2 + x);
+    const __m128 b = _mm_loadu_ps(best + x);
+    const __m128 closer = _mm_cmplt_ps(d, b);
+    _mm_storeu_ps(best + x, _mm_min_ps(d, b));
+    _mm_storeu_ps(best_value + x, _mm_or_ps(_mm_and_ps(closer, _mm_loadu_ps(value + x)),
+                                            _mm_andnot_ps(closer, _mm_loadu_ps(best_value + x))));
+  }
+#elif HAVE_NEON
+  for (; x + 4 <= x1; x += 4) {
+    const float32x4_t d = vld1q_f32(d2 + x);
+    const float32x4_t b = vld1q_f32(best + x);
+    const uint32x4_t closer = vcltq_f32(d, b);
+    vst1q_f32(best + x, vminq_f32(d, b));
+    vst1q_f32(best_value + x, vbslq_f32(closer, vld1q_f32(value + x), vld1q_f32(best_value + x)));
+  }
+#endif
+  for (; x < x1; ++x) {
+    if (d2[x] < best[x]) {
+      best[x] = d2[x];
+      best_value[x] = value[x];
+    }
+  }
+}
+
+unsigned char DistanceToByte(float distance, float spread) {
+  const float v = 128.0f + distance * 127.0f / spread;
+  return (unsigned char)std::max(0.0f, std::min(255.0f, v + 0.5f));
+}
+
+int Median(int a, int b, int c) {
+  return std::max(std::min(a, b), std::min(std::max(a, b), c));
+}
+
+// True if a and b are far enough apart in 2 channels that filtering
+// between them can put the median on the wrong side of the edge, and a is
+// the one further from the edge. From msdfgen's error correction.
+bool MsdfClash(const unsigned char* a, const unsigned char* b, int threshold) {
+  int a0 = a[0], a1 = a[1], a2 = a[2];
+  int b0 = b[0], b1 = b[1], b2 = b[2];
+  // sort so channel 0 differs the most and channel 2 the least
+  if (abs(b0 - a0) < abs(b1 - a1)) {
+    std::swap(a0, a1);
+    std::swap(b0, b1);
+  }
+  if (abs(b1 - a1) < abs(b2 - a2)) {
+    std::swap(a1, a2);
+    std::swap(b1, b2);
+    if (abs(b0 - a0) < abs(b1 - a1)) {
+      std::swap(a0, a1);
+      std::swap(b0, b1);
+    }
+  }
+  return abs(b1 - a1) >= threshold &&
+         !(b0 == b1 && b0 == b2) &&  // b has already been fixed
+         abs(a2 - 128) >= abs(b2 - 128);
+}
+
+// Where the edges of different channels meet, bilinear filtering between 2
+// texels can give a median on the wrong side of the edge which shows up as
+// notches. Those texels get the median in every channel.
+void FixMsdfClashes(GlyphBitmap* bm, int spread) {
+  // about 1 pixel of distance
+  const int threshold = 128 / spread + 1;
+  const int diagonal_threshold = threshold * 3 / 2;
+  std::vector<char> clash(bm->width * bm->rows, 0);
+  auto texel = [&](int x, int y) { return &bm->buffer[y * bm->pitch + x * 4]; };
+  for (int y = 0; y < bm->rows; ++y) {
+    for (int x = 0; x < bm->width; ++x) {
+      const unsigned char* t = texel(x, y);
+      clash[y * bm->width + x] =
+          (x > 0 && MsdfClash(t, texel(x - 1, y), threshold)) ||
+          (x < bm->width - 1 && MsdfClash(t, texel(x + 1, y), threshold)) ||
+          (y > 0 && MsdfClash(t, texel(x, y - 1), threshold)) ||
+          (y < bm->rows - 1 && MsdfClash(t, texel(x, y + 1), threshold)) ||
+          (x > 0 && y > 0 && MsdfClash(t, texel(x - 1, y - 1), diagonal_threshold)) ||
+          (x < bm->width - 1 && y > 0 && MsdfClash(t, texel(x + 1, y - 1), diagonal_threshold)) ||
+          (x > 0 && y < bm->rows - 1 && MsdfClash(t, texel(x - 1, y + 1), diagonal_threshold)) ||
+          (x < bm->width - 1 && y < bm->rows - 1 && MsdfClash(t, texel(x + 1, y + 1), diagonal_threshold));
+    }
+  }
+  for (int y = 0; y < bm->rows; ++y) {
+    for (int x = 0; x < bm->width; ++x) {
+      if (clash[y * bm->width + x]) {
+        unsigned char* t = texel(x, y);
+        t[0] = t[1] = t[2] = (unsigned char)Median(t[0], t[1], t[2]);
+      }
+    }
+  }
+}
+
+// Renders slot's outline as a --sdf or --msdf distance field into glyph,
+// growing the bitmap and metrics by --sdf-spread on every side.
+bool RenderDistanceField(FT_GlyphSlot slot, const Options& opt, RenderedGlyph* glyph) {
+  if (slot->format != FT_GLYPH_FORMAT_OUTLINE) {
+    return false;
+  }
+  const FT_Outline& outline = slot->outline;
+  const bool msdf = opt.msdf;
+  const int spread = opt.sdf_spread;
+
+  OutlineSegments segs;
+  OutlineFlattener flattener;
+  flattener.segments = &segs;
+  FT_Outline_Funcs funcs = {};
+  funcs.move_to = OutlineFlattener::MoveTo;
+  funcs.line_to = OutlineFlattener::LineTo;
+  funcs.conic_to = OutlineFlattener::ConicTo;
+  funcs.cubic_to = OutlineFlattener::CubicTo;
+  if (FT_Outline_Decompose(const_cast<FT_Outline*>(&outline), &funcs, &flattener)) {
+    return false;
+  }
+  if (msdf) {
+    ColorEdges(flattener.contours, &segs);
+  }
+
+  FT_BBox bbox;
+  FT_Outline_Get_CBox(&outline, &bbox);
+  const int left = (int)floor(bbox.xMin / 64.0) - spread;
+  const int top = (int)ceil(bbox.yMax / 64.0) + spread;
+  const int width = segs.size() ? (int)ceil(bbox.xMax / 64.0) + spread - left : 0;
+  const int rows = segs.size() ? top - ((int)floor(bbox.yMin / 64.0) - spread) : 0;
+
+  // TrueType outlines go clockwise, PostScript counter-clockwise
+  const float inside_sign = FT_Outline_Get_Orientation(const_cast<FT_Outline*>(&outline)) == FT_ORIENTATION_POSTSCRIPT ? 1.0f : -1.0f;
+  const bool even_odd = (outline.flags & FT_OUTLINE_EVEN_ODD_FILL) != 0;
+
+  GlyphBitmap& bm = glyph->bitmap;
+  bm.width = width;
+  bm.rows = rows;
+  bm.pixel_mode = msdf ? FT_PIXEL_MODE_BGRA : FT_PIXEL_MODE_GRAY;
+  bm.pitch = width * (msdf ? 4 : 1);
+  bm.buffer.assign(bm.pitch * rows, 0);
+
+  const int num_segs = (int)segs.size();
+  const float max_d2 = (float)spread * spread;
+  // per pixel of the current row: the closest squared distance over all
+  // segments and, for the msdf, per channel the closest squared distance
+  // and the signed distance to use for it
+  std::vector<float> px(width);
+  std::vector<float> best(width);
+  std::vector<float> channel_best[3];
+  std::vector<float> channel_value[3];
+  for (int c = 0; c < 3; ++c) {
+    channel_best[c].resize(width);
+    channel_value[c].resize(width);
+  }
+  std::vector<float> seg_d2(width);
+  std::vector<float> seg_value(width);
+  std::vector<std::pair<float, int>> crossings;
+
+  for (int x = 0; x < width; ++x) {
+    px[x] = left + x + 0.5f;
+  }
+
+  for (int y = 0; y < rows; ++y) {
+    const float py = top - y - 0.5f;
+    std::fill(best.begin(), best.end(), max_d2);
+    for (int c = 0; c < 3; ++c) {
+      std::fill(channel_best[c].begin(), channel_best[c].end(), msdf ? max_d2 * 4 : 0.0f);
+      std::fill(channel_value[c].begin(), channel_value[c].end(), -(float)spread);
+    }
+    crossings.clear();
+
+    for (int s = 0; s < num_segs; ++s) {
+      const float ax = segs.ax[s];
+      const float ay = segs.ay[s];
+      const float dx = segs.dx[s];
+      const float dy = segs.dy[s];
+
+      // where the segment crosses this row, for inside/outside
+      const float by = ay + dy;
+      if ((ay <= py && by > py) || (by <= py && ay > py)) {
+        crossings.push_back(std::make_pair(ax + (py - ay) * dx / dy, by > ay ? 1 : -1));
+      }
+
+      // only pixels within the spread of the segment can be changed by it
+      const float min_y = std::min(ay, by) - spread;
+      const float max_y = std::max(ay, by) + spread;
+      if (py < min_y || py > max_y) {
+        continue;
+      }
+      const float min_x = std::min(ax, ax + dx) - spread;
+      const float max_x = std::max(ax, ax + dx) + spread;
+      const int x0 = std::max(0, (int)floorf(min_x - left));
+      const int x1 = std::min(width, (int)ceilf(max_x - left) + 1);
+      const float inv_len2 = segs.inv_len2[s];
+      const float inv_len = segs.inv_len[s];
+      const float qy = py - ay;
+
+      float* d2_out = seg_d2.data();
+      const float* xs = px.data();
+      SegmentDistances(xs, x0, x1, ax, qy, dx, dy, inv_len2, d2_out, best.data());
+
+      if (!msdf) {
+        continue;
+      }
+
+      // the signed distance each channel uses if this is its closest
+      // segment. Past the ends of an edge that's the distance to the edge's
+      // extended line which keeps the corners sharp.
+      const float start_pseudo = segs.edge_start[s] ? 1.0f : 0.0f;
+      const float end_pseudo = segs.edge_end[s] ? 1.0f : 0.0f;
+      float* value_out = seg_value.data();
+      for (int x = x0; x < x1; ++x) {
+        const float qx = xs[x] - ax;
+        const float along = (qx * dx + qy * dy) * inv_len2;
+        const float perpendicular = (dx * qy - dy * qx) * inv_len * inside_sign;
+        const float distance = sqrtf(d2_out[x]);
+        const float use_pseudo = along < 0.0f ? start_pseudo : (along > 1.0f ? end_pseudo : 0.0f);
+        value_out[x] = use_pseudo > 0.0f ? perpendicular : (perpendicular < 0.0f ? -distance : distance);
+      }
+      const int color = segs.colors[s];
+      for (int c = 0; c < 3; ++c) {
+        if (color & (1 << c)) {
+          SelectClosest(d2_out, value_out, x0, x1, channel_best[c].data(), channel_value[c].data());
+        }
+      }
+    }
+
+    // walk the crossings left to right to find which pixels are inside
+    std::sort(crossings.begin(), crossings.end());
+    unsigned char* row = bm.buffer.data() + y * bm.pitch;
+    size_t next = 0;
+    int winding = 0;
+    for (int x = 0; x < width; ++x) {
+      while (next < crossings.size() && crossings[next].first < px[x]) {
+        winding += crossings[next].second;
+        ++next;
+      }
+      const bool inside = even_odd ? (winding & 1) != 0 : winding != 0;
+      const float distance = sqrtf(best[x]) * (inside ? 1.0f : -1.0f);
+      if (!msdf) {
+        row[x] = DistanceToByte(distance, (float)spread);
+        continue;
+      }
+      float r = channel_value[0][x];
+      float g = channel_value[1][x];
+      float b = channel_value[2][x];
+      const float median = std::max(std::min(r, g), std::min(std::max(r, g), b));
+      if ((median > 0.0f) != inside) {
+        // the channels disagree with the outline here, which would show up
+        // as a hole or a bump, so fall back to the plain distance
+        r = g = b = distance;
+      }
+      unsigned char* dst = row + x * 4;
+      dst[0] = DistanceToByte(b, (float)spread);
+      dst[1] = DistanceToByte(g, (float)spread);
+      dst[2] = DistanceToByte(r, (float)spread);
+      dst[3] = DistanceToByte(distance, (float)spread);
+    }
+  }
+
+  if (msdf) {
+    FixMsdfClashes(&bm, spread);
+  }
+
+  glyph->bitmap_left = left;
+  glyph->bitmap_top = top;
+  glyph->metrics.width = width * 64;
+  glyph->metrics.height = rows * 64;
+  glyph->metrics.horiBearingX = left * 64;
+  glyph->metrics.horiBearingY = top * 64;
+  return true;
+}
+
+// Keeps the outline instead of rendering it. FT_Load_Glyph already set
+// bitmap_left/top and the bitmap size to what FT_Render_Glyph will use.
+void KeepOutline(const FT_GlyphSlot slot, const std::shared_ptr<OutlinePool>& pool, RenderedGlyph* glyph) {
+  const FT_Outline& outline = slot->outline;
+  const FT_Pos x_min = (FT_Pos)slot->bitmap_left * 64;
+  const FT_Pos y_min = (FT_Pos)(slot->bitmap_top - (int)slot->bitmap.rows) * 64;
+
+  glyph->direct = true;
+  glyph->bitmap_left = slot->bitmap_left;
+  glyph->bitmap_top = slot->bitmap_top;
+  glyph->bitmap.width = slot->bitmap.width;
+  glyph->bitmap.rows = slot->bitmap.rows;
+  glyph->bitmap.pitch = slot->bitmap.width;
+  glyph->bitmap.pixel_mode = FT_PIXEL_MODE_GRAY;
+  glyph->outline_pool = pool;
+  glyph->outline_first_point = (int)pool->points.size();
+  glyph->outline_points = outline.n_points;
+  glyph->outline_first_contour = (int)pool->contours.size();
+  glyph->outline_contours = outline.n_contours;
+  glyph->outline_flags = outline.flags;
+  for (int i = 0; i < outline.n_points; ++i) {
+    FT_Vector point = { outline.points[i].x - x_min, outline.points[i].y - y_min };
+    pool->points.push_back(point);
+  }
+  pool->tags.insert(pool->tags.end(), outline.tags, outline.tags + outline.n_points);
+  pool->contours.insert(pool->contours.end(), outline.contours, outline.contours + outline.n_contours);
+}
+
+// FreeType renders to bitmaps itself which we then copy into the atlas.
+// Without oversampling there's nothing to downsample so instead we keep
+// the outline and have the rasterizer write spans straight into the atlas,
+// skipping a copy and an allocation per glyph. Not with more than one
+// thread since that rendering happens during the blit, on one thread.
+bool DirectRender(const Options& opt) {
+  return opt.oversample == 1 && !opt.sdf && !opt.msdf && opt.threads <= 1 && !opt.benchmark_downsample;
+}
+
+struct SpanTarget {
+  unsigned char* dst;
+  int stride;
+  int rows;       // bitmap rows, spans come bottom up
+  int num_rows;   // rows that fit in the rect
+  const unsigned char* alpha_table;
+};
+
+void WriteSpans(int y, int count, const FT_Span* spans, void* user) {
+  const SpanTarget& target = *(const SpanTarget*)user;
+  const int row = target.rows - 1 - y;
+  if (row < 0 || row >= target.num_rows) {
+    return;
+  }
+  unsigned char* dst = target.dst + row * target.stride;
+  for (int i = 0; i < count; ++i) {
+    memset(dst + spans[i].x, target.alpha_table[spans[i].coverage], spans[i].len);
+  }
+}
+
+// Renders a glyph kept by KeepOutline straight into the atlas.
+bool RenderOutlineDirect(FT_Library library, const RenderedGlyph& glyph, int num_rows, const unsigned char* alpha_table, unsigned char* dst, int dst_stride) {
+  FT_Outline outline = KeptOutline(glyph);
+  if (!outline.n_points) {
+    return true;
+  }
+  SpanTarget target = { dst, dst_stride, glyph.bitmap.rows, num_rows, alpha_table };
+  FT_Raster_Params params = {};
+  params.flags = FT_RASTER_FLAG_AA | FT_RASTER_FLAG_DIRECT;
+  params.gray_spans = WriteSpans;
+  params.user = &target;
+  return FT_Outline_Render(library, &outline, &params) == 0;
+}
+
+// Loads, hints and renders one glyph. This is the expensive part so it
+// should happen exactly once per codepoint. glyph_index comes from
+// MapCodepoints so it's never 0. With outlines, outline glyphs are kept
+// there for RenderOutlineDirect instead of rendered.
+void RenderGlyph(FT_Face face, int codepoint, FT_UInt glyph_index, const Options& opt, const std::shared_ptr<OutlinePool>& outlines, RenderedGlyph* glyph, Stats* stats) {
+  const bool distance_field = opt.sdf || opt.msdf;
+  // distance fields get scaled so hinting to this size would only hurt
+  const int load_flags = distance_field ? FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP
+                       : opt.light ? FT_LOAD_TARGET_LIGHT : FT_LOAD_TARGET_NORMAL;
+  const FT_Render_Mode render_flags = opt.light ? FT_RENDER_MODE_LIGHT : FT_RENDER_MODE_NORMAL;
+
+  glyph->codepoint = codepoint;
+  glyph->glyph_index = glyph_index;
+
+  double start = NowMs();
+  int error = FT_Load_Glyph(
+      face,                /* handle to face object */
+      glyph->glyph_index,  /* glyph index           */
+      load_flags);         /* load flags, see below */
+  double loaded = NowMs();
+  stats->load_ms += loaded - start;
+  if (error) {
+    fprintf(stderr, "warn: could not load glyph for codepoint: 0x%x\n", codepoint);
+    return;
+  }
+
+  const auto& slot = face->glyph;
+  if (distance_field) {
+    glyph->metrics = slot->metrics;
+    if (!RenderDistanceField(slot, opt, glyph)) {
+      fprintf(stderr, "warn: no outline for codepoint: 0x%x\n", codepoint);
+      return;
+    }
+    stats->render_ms += NowMs() - loaded;
+    ++stats->glyphs_rendered;
+    glyph->loaded = true;
+    glyph->advance = slot->advance;
+    return;
+  }
+
+  glyph->loaded = true;
+  glyph->metrics = slot->metrics;
+  glyph->advance = slot->advance;
+  if (outlines && slot->format == FT_GLYPH_FORMAT_OUTLINE) {
+    KeepOutline(slot, outlines, glyph);
+    return;
+  }
+
+  FT_Render_Glyph(
+    face->glyph,
+    render_flags);
+  stats->render_ms += NowMs() - loaded;
+  ++stats->glyphs_rendered;
+
+  glyph->bitmap_left = slot->bitmap_left;
+  glyph->bitmap_top = slot->bitmap_top;
+  CopyBitmap(slot->bitmap, &glyph->bitmap);
+}
+
+void SetFaceSize(FT_Face face, const Options& opt) {
+  FT_Set_Char_Size(
+      face,                /* handle to face object           */
+      0,                   /* char_width in 1/64th of points  */
+      (FT_F26Dot6)(opt.font_size * 64),  /* char_height in 1/64th of points */
+      72 * opt.oversample,      /* horizontal device resolution    */
+      72 * opt.oversample);     /* vertical device resolution      */
+}
+
+// Maps each font file once per process. Every face opened on it, by any
+// thread, for any size or atlas in a manifest, uses the same mapping.
+// Mappings live until exit since faces may still point into them.
+std::shared_ptr<MappedFile> MapFontFile(const std::string& filename) {
+  static std::mutex mutex;
+  static std::map<std::string, std::shared_ptr<MappedFile>> files;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = files.find(filename);
+  if (it != files.end()) {
+    return it->second;
+  }
+  std::shared_ptr<MappedFile> file(new MappedFile);
+  if (!map_file(filename.c_str(), file.get())) {
+    fprintf(stderr, "error: could not map: %s\n", filename.c_str());
+    return nullptr;
+  }
+  files[filename] = file;
+  return file;
+}
+
+FT_Error OpenFace(FT_Library library, const Options& opt, FT_Face* face, Stats* stats = NULL) {
+  StageTimer open_timer(stats, "open face");
+  std::shared_ptr<MappedFile> file = MapFontFile(opt.font_filename);
+  if (!file) {
+    return FT_Err_Cannot_Open_Resource;
+  }
+  FT_Error error = FT_New_Memory_Face(library, file->data, (FT_Long)file->size, opt.font_index, face);
+  open_timer.Stop();
+  if (error) {
+    return error;
+  }
+  StageTimer size_timer(stats, "set size");
+  SetFaceSize(*face, opt);
+  return 0;
+}
+
+// The autofitter's style for each glyph, which it works out the first time
+// it hints one of face's glyphs by going through the cmap and hinting each
+// script's standard characters. That's the slowest part of opening a big CJK
+// font and the same at every size, so it's handed to the thread faces and
+// kept in the --cache-dir. Setting it needs the vendored FreeType, whose
+// glyph-to-script-map property is settable.
+typedef std::vector<FT_UShort> AutofitMap;
+
+// Only true once the autofitter has made its globals for face, so getting
+// the map never makes it do that work for a face it doesn't hint.
+bool GetAutofitMap(FT_Face face, AutofitMap* map) {
+  if (!face->autohint.data) {
+    return false;
+  }
+  FT_Prop_GlyphToScriptMap prop;
+  prop.face = face;
+  prop.map = NULL;
+  if (FT_Property_Get(face->glyph->library, "autofitter", "glyph-to-script-map", &prop) || !prop.map) {
+    return false;
+  }
+  map->assign(prop.map, prop.map + face->num_glyphs);
+  return true;
+}
+
+bool SetAutofitMap(FT_Face face, AutofitMap& map) {
+  if ((FT_Long)map.size() != face->num_glyphs) {
+    return false;
+  }
+  FT_Prop_GlyphToScriptMap prop;
+  prop.face = face;
+  prop.map = map.data();
+  return !FT_Property_Set(face->glyph->library, "autofitter", "glyph-to-script-map", &prop);
+}
+
+// FNV-1a. Used to key the --cache-dir files, not for anything secure.
+struct Hash {
+  uint64_t value = 14695981039346656037ULL;
+
+  void Add(const void* data, size_t size) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i) {
+      value = (value ^ p[i]) * 1099511628211ULL;
+    }
+  }
+  void AddInt(int v) { Add(&v, sizeof(v)); }
+  void AddFloat(float v) { Add(&v, sizeof(v)); }
+  void AddString(const std::string& s) {
+    AddInt((int)s.size());
+    Add(s.data(), s.size());
+  }
+  std::string Hex() const {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)value);
+    return buf;
+  }
+};
+
+// Everything that changes what a glyph looks like once rendered
+std::string GlyphCacheKey(uint64_t font_hash, const Options& opt) {
+  Hash hash;
+  hash.Add(&font_hash, sizeof(font_hash));
+  hash.AddInt(opt.font_index);
+  hash.AddFloat(opt.font_size);
+  hash.AddInt(opt.oversample);
+  hash.AddInt(opt.light);
+  if (opt.sdf || opt.msdf) {
+    hash.AddInt(opt.sdf);
+    hash.AddInt(opt.msdf);
+    hash.AddInt(opt.sdf_spread);
+  }
+  return hash.Hex();
+}
+
+// Bump whenever a change gives different output for the same font and
+// options, so atlases cached by older builds aren't used.
+const int atlas_cache_version = 4;
+
+// Everything that changes the .png or .json, which is all of Options except
+// the ones that only change how we get there.
+std::string AtlasCacheKey(uint64_t font_hash, const Options& opt) {
+  Hash hash;
+  hash.AddInt(atlas_cache_version);
+  hash.Add(&font_hash, sizeof(font_hash));
+  hash.AddString(opt.font_filename);
+  hash.AddInt(opt.light);
+  hash.AddFloat(opt.font_size);
+  hash.AddInt(opt.font_index);
+  hash.AddInt(opt.oversample);
+  hash.AddInt(opt.alpha_min);
+  hash.AddInt(opt.alpha_max);
+  hash.AddInt(opt.padding);
+  hash.AddInt(opt.atlas_width);
+  hash.AddInt(opt.atlas_height);
+  hash.AddInt(opt.glyph_height);
+  hash.AddInt(opt.y_offset);
+  hash.AddFloat(opt.shift_x);
+  hash.AddFloat(opt.shift_y);
+  hash.Add(opt.debug_color, sizeof(opt.debug_color));
+  hash.AddInt(opt.show_grid);
+  hash.AddInt(opt.ignore_errors);
+  hash.AddInt(opt.error_on_crop);
+  hash.AddInt(opt.npot);
+  hash.AddInt(opt.packer);
+  hash.AddInt(opt.max_page_size);
+  hash.AddInt(opt.png_level);
+  hash.AddInt(opt.output_format);
+  hash.AddInt(opt.metrics_bin);
+  hash.AddInt(opt.sdf);
+  hash.AddInt(opt.msdf);
+  hash.AddInt(opt.sdf_spread);
+  if (opt.max_page_size) {
+    // which page a glyph goes on depends on how often it's used
+    for (const auto& pair : opt.codepoint_counts) {
+      hash.AddInt(pair.first);
+      hash.AddInt(pair.second);
+    }
+  }
+  hash.AddString(opt.out_name);
+  // Not the --previous-atlas bytes: gen-font passes the last output back in,
+  // so they'd change every run. RestoreAtlasFromCache compares them with the
+  // cached .json instead.
+  hash.AddInt(!opt.previous_atlas.empty());
+  // the ranges are the sorted codepoint set
+  hash.AddInt((int)opt.ranges.size());
+  for (const auto& range : opt.ranges) {
+    hash.AddInt(range.start);
+    hash.AddInt(range.end);
+  }
+  return hash.Hex();
+}
+
+// Loaded and hinted glyphs from previous runs with the same GlyphCacheKey
+// so adding a few codepoints, or changing options that only affect packing
+// and output, never runs the hinter again. Glyphs are by glyph index so
+// codepoints sharing a glyph share an entry. Each has its rendered bitmap
+// or, for glyphs rendered straight into the atlas, its hinted outline.
+struct GlyphCache {
+  std::string filename;
+  std::map<FT_UInt, RenderedGlyph> glyphs;  // by glyph index
+  bool dirty = false;
+};
+
+const char glyph_cache_magic[4] = { 'F', 'A', 'G', 'C' };
+const int glyph_cache_version = 2;
+
+bool read_ints(FILE* fp, int* values, int count) {
+  return fread(values, sizeof(int), count, fp) == (size_t)count;
+}
+
+// True if a cached bitmap's size is something we could have written: rows
+// of at least width pixels that fit in bytes_left, what's left of the file
+// for bitmaps that are in it. A corrupt entry must not make us allocate
+// gigabytes or read past a row.
+bool valid_cached_bitmap(const GlyphBitmap& bm, int64_t bytes_left) {
+  if (bm.width < 0 || bm.rows < 0 || bm.pitch < 0) {
+    return false;
+  }
+  const int64_t min_pitch = bm.pixel_mode == FT_PIXEL_MODE_MONO ? (bm.width + 7) / 8
+                          : bm.pixel_mode == FT_PIXEL_MODE_BGRA ? (int64_t)bm.width * 4
+                          : bm.width;
+  return bm.pitch >= min_pitch && (int64_t)bm.pitch * bm.rows <= bytes_left;
+}
+
+// The same for a cached outline's point and contour counts, which FT_Outline
+// keeps in shorts. Each point is 2 ints and a tag, each contour a short.
+bool valid_cached_outline(int n_points, int n_contours, int64_t bytes_left) {
+  if (n_points < 0 || n_points > SHRT_MAX || n_contours < 0 || n_contours > n_points) {
+    return false;
+  }
+  return (int64_t)n_points * (int64_t)(2 * sizeof(int) + 1) + (int64_t)n_contours * (int64_t)sizeof(short) <= bytes_left;
+}
+
+// And that its contours end on its points, in order, so FreeType never
+// reads past them
+bool valid_cached_contours(const short* contours, int n_contours, int n_points) {
+  int last = -1;
+  for (int c = 0; c < n_contours; ++c) {
+    if (contours[c] <= last || contours[c] >= n_points) {
+      return false;
+    }
+    last = contours[c];
+  }
+  return true;
+}
+
+void LoadGlyphCache(const std::string& filename, GlyphCache* cache) {
+  cache->filename = filename;
+  FILE* fp = fopen(filename.c_str(), "rb");
+  if (!fp) {
+    return;
+  }
+  fseek(fp, 0, SEEK_END);
+  const int64_t file_size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char magic[4];
+  int header[2];
+  if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, glyph_cache_magic, 4) ||
+      !read_ints(fp, header, 2) || header[0] != glyph_cache_version) {
+    fprintf(stderr, "warn: ignoring bad glyph cache: %s\n", filename.c_str());
+    fclose(fp);
+    return;
+  }
+  // every cached outline goes in one pool
+  std::shared_ptr<OutlinePool> outlines = std::make_shared<OutlinePool>();
+  for (int i = 0; i < header[1]; ++i) {
+    int v[17];
+    if (!read_ints(fp, v, 17)) {
+      break;
+    }
+    RenderedGlyph glyph;
+    glyph.codepoint = v[0];
+    glyph.glyph_index = v[1];
+    glyph.loaded = v[2] != 0;
+    glyph.metrics.width = v[3];
+    glyph.metrics.height = v[4];
+    glyph.metrics.horiBearingX = v[5];
+    glyph.metrics.horiBearingY = v[6];
+    glyph.metrics.horiAdvance = v[7];
+    glyph.metrics.vertBearingX = v[8];
+    glyph.metrics.vertBearingY = v[9];
+    glyph.metrics.vertAdvance = v[10];
+    glyph.advance.x = v[11];
+    glyph.advance.y = v[12];
+    glyph.bitmap_left = v[13];
+    glyph.bitmap_top = v[14];
+    glyph.bitmap.width = v[15];
+    glyph.bitmap.rows = v[16];
+    int bm[2];
+    if (!read_ints(fp, bm, 2)) {
+      break;
+    }
+    glyph.bitmap.pitch = bm[0];
+    glyph.bitmap.pixel_mode = (unsigned char)bm[1];
+    int outline[4];
+    if (!read_ints(fp, outline, 4)) {
+      break;
+    }
+    glyph.direct = outline[0] != 0;
+    glyph.outline_flags = outline[3];
+    if (!valid_cached_bitmap(glyph.bitmap, glyph.direct ? INT64_MAX : file_size - ftell(fp))) {
+      fprintf(stderr, "warn: bad glyph in glyph cache, ignoring the rest: %s\n", filename.c_str());
+      break;
+    }
+    if (!glyph.direct) {
+      glyph.bitmap.buffer.resize(glyph.bitmap.pitch * glyph.bitmap.rows);
+    }
+    if (fread(glyph.bitmap.buffer.data(), 1, glyph.bitmap.buffer.size(), fp) != glyph.bitmap.buffer.size()) {
+      break;
+    }
+    if (!valid_cached_outline(outline[1], outline[2], file_size - ftell(fp))) {
+      fprintf(stderr, "warn: bad glyph in glyph cache, ignoring the rest: %s\n", filename.c_str());
+      break;
+    }
+    OutlinePool& pool = *outlines;
+    std::vector<int> points(outline[1] * 2);
+    const size_t first_point = pool.points.size();
+    const size_t first_contour = pool.contours.size();
+    pool.tags.resize(first_point + outline[1]);
+    pool.contours.resize(first_contour + outline[2]);
+    if (!read_ints(fp, points.data(), (int)points.size()) ||
+        fread(pool.tags.data() + first_point, 1, outline[1], fp) != (size_t)outline[1] ||
+        fread(pool.contours.data() + first_contour, sizeof(short), outline[2], fp) != (size_t)outline[2]) {
+      break;
+    }
+    if (!valid_cached_contours(pool.contours.data() + first_contour, outline[2], outline[1])) {
+      fprintf(stderr, "warn: bad glyph in glyph cache, ignoring the rest: %s\n", filename.c_str());
+      break;
+    }
+    for (int p = 0; p < outline[1]; ++p) {
+      FT_Vector point = { points[p * 2], points[p * 2 + 1] };
+      pool.points.push_back(point);
+    }
+    if (outline[1]) {
+      glyph.outline_pool = outlines;
+      glyph.outline_first_point = (int)first_point;
+      glyph.outline_points = outline[1];
+      glyph.outline_first_contour = (int)first_contour;
+      glyph.outline_contours = outline[2];
+    }
+    cache->glyphs[glyph.glyph_index] = glyph;
+  }
+  fclose(fp);
+}
+
+bool SaveGlyphCache(const GlyphCache& cache) {
+  FILE* fp = fopen(cache.filename.c_str(), "wb");
+  if (!fp) {
+    fprintf(stderr, "warn: couldn't write %s\n", cache.filename.c_str());
+    return false;
+  }
+  int header[2] = { glyph_cache_version, (int)cache.glyphs.size() };
+  fwrite(glyph_cache_magic, 1, 4, fp);
+  fwrite(header, sizeof(int), 2, fp);
+  for (const auto& pair : cache.glyphs) {
+    const RenderedGlyph& glyph = pair.second;
+    const int v[19] = {
+      glyph.codepoint,
+      (int)glyph.glyph_index,
+      glyph.loaded,
+      (int)glyph.metrics.width,
+      (int)glyph.metrics.height,
+      (int)glyph.metrics.horiBearingX,
+      (int)glyph.metrics.horiBearingY,
+      (int)glyph.metrics.horiAdvance,
+      (int)glyph.metrics.vertBearingX,
+      (int)glyph.metrics.vertBearingY,
+      (int)glyph.metrics.vertAdvance,
+      (int)glyph.advance.x,
+      (int)glyph.advance.y,
+      glyph.bitmap_left,
+      glyph.bitmap_top,
+      glyph.bitmap.width,
+      glyph.bitmap.rows,
+      glyph.bitmap.pitch,
+      glyph.bitmap.pixel_mode,
+    };
+    const FT_Outline kept = KeptOutline(glyph);
+    const int outline[4] = {
+      glyph.direct,
+      kept.n_points,
+      kept.n_contours,
+      glyph.outline_flags,
+    };
+    fwrite(v, sizeof(int), 19, fp);
+    fwrite(outline, sizeof(int), 4, fp);
+    fwrite(glyph.bitmap.buffer.data(), 1, glyph.bitmap.buffer.size(), fp);
+    std::vector<int> points;
+    for (int p = 0; p < kept.n_points; ++p) {
+      points.push_back((int)kept.points[p].x);
+      points.push_back((int)kept.points[p].y);
+    }
+    fwrite(points.data(), sizeof(int), points.size(), fp);
+    fwrite(kept.tags, 1, kept.n_points, fp);
+    fwrite(kept.contours, sizeof(short), kept.n_contours, fp);
+  }
+  fclose(fp);
+  return true;
+}
+
+// Renders every codepoint into glyphs, one slot per codepoint.
+// glyph_indices are the codepoints' glyphs from MapCodepoints.
+//
+// With --threads each extra worker gets its own FT_Library and FT_Face since
+// FreeType faces are not thread safe. Workers grab small chunks of glyphs off
+// a shared counter so a thread that gets easy glyphs just takes more chunks.
+// Each glyph only ever lands in its own slot so the result is the same no
+// matter which thread rendered it.
+//
+// Glyphs found in cache are copied from there and only the rest are
+// loaded and rendered, then added to the cache. Codepoints that map to the
+// same glyph are rendered once and copied.
+void RenderGlyphs(FT_Face face, const std::vector<int>& codepoints, const std::vector<FT_UInt>& glyph_indices, const Options& opt, std::vector<RenderedGlyph>* glyphs, GlyphCache* cache, Stats* stats) {
+  glyphs->resize(codepoints.size());
+
+  // indices of the glyphs that need rendering
+  std::vector<int> todo;
+  // first index rendering each glyph and the later ones copying it
+  std::map<FT_UInt, int> rendering;
+  std::vector<std::pair<int, int>> copies;
+  for (int i = 0; i < (int)codepoints.size(); ++i) {
+    if (cache) {
+      auto it = cache->glyphs.find(glyph_indices[i]);
+      // --benchmark-downsample needs the bitmap
+      if (it != cache->glyphs.end() && !(it->second.direct && opt.benchmark_downsample)) {
+        (*glyphs)[i] = it->second;
+        (*glyphs)[i].codepoint = codepoints[i];
+        ++stats->glyphs_cached;
+        continue;
+      }
+    }
+    auto inserted = rendering.insert(std::make_pair(glyph_indices[i], i));
+    if (!inserted.second) {
+      copies.push_back(std::make_pair(i, inserted.first->second));
+      continue;
+    }
+    if (cache) {
+      ++stats->glyphs_cache_missed;
+    }
+    todo.push_back(i);
+  }
+
+  const int chunk_size = 16;
+  const int num_glyphs = (int)todo.size();
+  const int num_chunks = (num_glyphs + chunk_size - 1) / chunk_size;
+  const int num_workers = std::max(1, std::min(opt.threads, num_chunks));
+
+  // only one thread renders when outlines are kept, see DirectRender
+  std::shared_ptr<OutlinePool> outlines;
+  if (DirectRender(opt)) {
+    outlines = std::make_shared<OutlinePool>();
+  }
+  std::atomic<int> next_chunk(0);
+  auto work = [&](FT_Face work_face, Stats* work_stats) {
+    StageTimer timer(work_stats, "load+render thread");
+    for (;;) {
+      const int start = next_chunk.fetch_add(1) * chunk_size;
+      if (start >= num_glyphs) {
+        break;
+      }
+      const int end = std::min(start + chunk_size, num_glyphs);
+      for (int i = start; i < end; ++i) {
+        const int ndx = todo[i];
+        RenderGlyph(work_face, codepoints[ndx], glyph_indices[ndx], opt, outlines, &(*glyphs)[ndx], work_stats);
+      }
+    }
+  };
+
+  // what the calling thread's face already knows, the thread faces don't
+  // have to work out again
+  AutofitMap autofit_map;
+  const bool has_autofit_map = num_workers > 1 && GetAutofitMap(face, &autofit_map);
+
+  StageTimer timer(stats, "load+render");
+  std::vector<Stats> worker_stats(num_workers);
+  std::vector<std::thread> threads;
+  for (int t = 1; t < num_workers; ++t) {
+    threads.emplace_back([&, t]() {
+      FT_Library library;
+      if (FT_Init_FreeType(&library)) {
+        fprintf(stderr, "warn: could not init freetype for thread %d\n", t);
+        return;
+      }
+      FT_Face thread_face;
+      if (OpenFace(library, opt, &thread_face, &worker_stats[t])) {
+        fprintf(stderr, "warn: could not open %s for thread %d\n", opt.font_filename.c_str(), t);
+      } else {
+        if (has_autofit_map) {
+          AutofitMap map = autofit_map;
+          SetAutofitMap(thread_face, map);
+        }
+        work(thread_face, &worker_stats[t]);
+        FT_Done_Face(thread_face);
+      }
+      FT_Done_FreeType(library);
+    });
+  }
+  // the calling thread works too, with the face it already has
+  work(face, &worker_stats[0]);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (int t = 0; t < num_workers; ++t) {
+    // the calling thread's own time is already in timer
+    for (const StageTime& stage : worker_stats[t].stages) {
+      if (t && !strcmp(stage.name, "load+render thread")) {
+        timer.AddCpuMs(stage.cpu_ms);
+      }
+    }
+    AddStats(stats, worker_stats[t]);
+  }
+  stats->threads = num_workers;
+  for (const auto& copy : copies) {
+    (*glyphs)[copy.first] = (*glyphs)[copy.second];
+    (*glyphs)[copy.first].codepoint = codepoints[copy.first];
+  }
+  stats->glyphs_ms += timer.Stop();
+
+  if (cache && !todo.empty()) {
+    for (const int ndx : todo) {
+      cache->glyphs[glyph_indices[ndx]] = (*glyphs)[ndx];
+    }
+    cache->dirty = true;
+  }
+}
+
+// stbrp_coord is 16 bits
+const int max_atlas_size = 32768;
+
+int MaxAtlasSize(const Options& opt) {
+  return opt.max_page_size ? std::min(opt.max_page_size, max_atlas_size) : max_atlas_size;
+}
+
+struct AtlasPage {
+  int width = 0;
+  int height = 0;
+  int channels = 1;  // 4 for --msdf, BGRA
+  std::vector<unsigned char> pixels;
+};
+
+// Packs rects in order into rows as tall as the tallest rect in them. With
+// --glyph-height every rect is the same height so this is a grid of fixed
+// height cells. Rects that go past height are not packed. Returns the
+// height used.
+int ShelfLayout(stbrp_rect* rects, int num_rects, int width, int height) {
+  int x = 0;
+  int y = 0;
+  int row_height = 0;
+  for (int i = 0; i < num_rects; ++i) {
+    stbrp_rect* r = &rects[i];
+    if (r->w == 0 || r->h == 0) {
+      r->x = 0;
+      r->y = 0;
+      r->was_packed = 1;
+      continue;
+    }
+    if (x + r->w > width && x > 0) {
+      x = 0;
+      y += row_height;
+      row_height = 0;
+    }
+    r->x = (stbrp_coord)x;
+    r->y = (stbrp_coord)y;
+    r->was_packed = r->w <= width && y + r->h <= height;
+    x += r->w;
+    row_height = std::max(row_height, (int)r->h);
+  }
+  return y + row_height;
+}
+
+int NextPowerOf2(int v) {
+  int p = 8;
+  while (p < v) {
+    p *= 2;
+  }
+  return p;
+}
+
+// Tries every usable atlas width with ShelfLayout and picks the one with the
+// smallest area, ties go to the squarer one.
+bool ChooseShelfAtlasSize(stbrp_rect* rects, int num_rects, const Options& opt, int* width, int* height) {
+  int max_w = 0;
+  double total_area = 0;
+  for (int i = 0; i < num_rects; ++i) {
+    max_w = std::max(max_w, (int)rects[i].w);
+    total_area += (double)rects[i].w * rects[i].h;
+  }
+  const int min_width = max_w + opt.padding;
+  const int max_size = MaxAtlasSize(opt);
+  const int max_width = std::min(max_size, std::max(min_width, (int)ceil(sqrt(total_area)) * 2));
+  std::vector<int> widths;
+  if (opt.npot) {
+    for (int w = (min_width + 3) & ~3; w <= max_width; w += 4) {
+      widths.push_back(w);
+    }
+  } else {
+    for (int w = NextPowerOf2(min_width); w <= max_size; w *= 2) {
+      widths.push_back(w);
+      if (w >= max_width) {
+        break;
+      }
+    }
+  }
+
+  double best_area = 0;
+  for (const int w : widths) {
+    int h = ShelfLayout(rects, num_rects, w - opt.padding, INT_MAX) + opt.padding;
+    if (!opt.npot) {
+      h = NextPowerOf2(h);
+    }
+    if (h > max_size) {
+      continue;
+    }
+    const double area = (double)w * h;
+    if (!best_area || area < best_area ||
+        (area == best_area && std::abs(w - h) < std::abs(*width - *height))) {
+      best_area = area;
+      *width = w;
+      *height = h;
+    }
+  }
+  return best_area > 0;
+}
+
+// Packs every rect into a width x height atlas. If they all fit spc is left
+// set up for that size, otherwise it's cleaned up and false is returned.
+bool PackAtSize(stbtt_pack_context *spc, stbrp_rect *rects, const std::vector<char>& keep, int num_chars, int width, int height, const Options& opt, Stats* stats)
+{
+     if (!PackBegin(spc, width, height, width, opt.padding, NULL)) {
+       fprintf(stderr, "error: PackBegin\n");
+       return false;
+     }
+     ++stats->pack_attempts;
+
+     if (!keep.empty()) {
+       PackAroundKeptRects(spc, rects, keep, num_chars);
+     } else if (opt.packer == kPackerShelf) {
+       ShelfLayout(rects, num_chars, spc->width - spc->padding, spc->height - spc->padding);
+     } else if (opt.packer == kPackerMaxRects) {
+       MaxRectsPackRects(spc, rects, num_chars);
+     } else {
+       if (opt.packer == kPackerSkylineBF) {
+         stbrp_setup_heuristic((stbrp_context *) spc->pack_info, STBRP_HEURISTIC_Skyline_BF_sortHeight);
+       }
+       PackFontRangesPackRects(spc, rects, num_chars);
+     }
+
+     for (int i = 0; i < num_chars; ++i) {
+       stbrp_rect* r = &rects[i];
+       if (!r->was_packed) {
+         PackEnd(spc);
+         return false;
+       }
+     }
+     return true;
+}
+
+// Packs the rects at the given size or, with auto_size, finds the smallest
+// size they fit starting from the given one.
+bool PackRects(stbtt_pack_context *spc, stbrp_rect *rects, const std::vector<char>& keep, int num_chars, bool auto_size, int atlas_width, int atlas_height, const Options& opt, Stats* stats)
+{
+   const int max_size = MaxAtlasSize(opt);
+   bool packed = false;
+   if (!auto_size) {
+     packed = PackAtSize(spc, rects, keep, num_chars, atlas_width, atlas_height, opt, stats);
+   } else {
+     // Nothing can fit until the atlas is at least as big as the biggest
+     // glyph and has as much area as all of them so start there.
+     int max_w = 0;
+     int max_h = 0;
+     double total_area = 0;
+     for (int i = 0; i < num_chars; ++i) {
+       if (rects[i].w && rects[i].h) {
+         max_w = std::max(max_w, (int)rects[i].w);
+         max_h = std::max(max_h, (int)rects[i].h);
+         total_area += (double)rects[i].w * rects[i].h;
+       }
+     }
+     auto too_small = [&](int w, int h) {
+       return w - opt.padding < max_w || h - opt.padding < max_h ||
+              (double)(w - opt.padding) * (h - opt.padding) < total_area;
+     };
+
+     if (opt.packer == kPackerShelf && keep.empty()) {
+       // the shelf layout only depends on the width so there's no need to
+       // search, just pick the width that wastes the least
+       if (ChooseShelfAtlasSize(rects, num_chars, opt, &atlas_width, &atlas_height)) {
+         packed = PackAtSize(spc, rects, keep, num_chars, atlas_width, atlas_height, opt, stats);
+       }
+     } else if (!opt.npot) {
+       // same sizes the doubling search always tried, minus the ones that
+       // can't possibly fit
+       for (;;) {
+         if (!too_small(atlas_width, atlas_height)) {
+           packed = PackAtSize(spc, rects, keep, num_chars, atlas_width, atlas_height, opt, stats);
+           if (packed) {
+             break;
+           }
+         }
+         if (atlas_width > atlas_height) {
+           atlas_height *= 2;
+         } else {
+           atlas_width *= 2;
+         }
+         if (atlas_width > max_size || atlas_height > max_size) {
+           break;
+         }
+         if (opt.verbose) {
+           printf("trying: %d x %d\n", atlas_width, atlas_height);
+         }
+       }
+     } else {
+       // Pick a width near square, rounded up to a multiple of 4, then find
+       // the shortest height that fits: grow by bigger and bigger steps until
+       // something fits, then binary search between the last height that
+       // didn't and the one that did. If nothing fits by max_size the atlas
+       // is made wider and the search starts over. skyline-bl puts every
+       // glyph in the same place given more height so that finds the
+       // shortest, skyline-bf and maxrects-bssf pick between more free spots
+       // and can fail above a height that fit, so theirs may be a few rows
+       // taller than needed.
+       atlas_width = std::max(atlas_width, std::max(max_w, (int)ceil(sqrt(total_area))) + opt.padding);
+       atlas_width = (atlas_width + 3) & ~3;
+       while (!packed && atlas_width <= max_size) {
+         const int low = std::max(atlas_height, std::max(max_h, (int)ceil(total_area / (atlas_width - opt.padding))) + opt.padding);
+         int failed = low - 1;  // tallest height known not to fit
+         int fits = 0;          // shortest height known to fit
+         int step = std::max(4, low / 16);
+         for (int try_height = low; !fits && failed < max_size; ) {
+           try_height = std::min(try_height, max_size);
+           if (opt.verbose) {
+             printf("trying: %d x %d\n", atlas_width, try_height);
+           }
+           if (PackAtSize(spc, rects, keep, num_chars, atlas_width, try_height, opt, stats)) {
+             fits = try_height;
+           } else {
+             failed = try_height;
+             try_height += step;
+             step *= 2;
+           }
+         }
+         bool at_fits = fits != 0;  // spc is packed at fits
+         while (fits && fits - failed > 1) {
+           if (at_fits) {
+             PackEnd(spc);
+           }
+           const int try_height = failed + (fits - failed) / 2;
+           if (opt.verbose) {
+             printf("trying: %d x %d\n", atlas_width, try_height);
+           }
+           at_fits = PackAtSize(spc, rects, keep, num_chars, atlas_width, try_height, opt, stats);
+           if (at_fits) {
+             fits = try_height;
+           } else {
+             failed = try_height;
+           }
+         }
+         if (fits && !at_fits) {
+           // the last pack wasn't at the best size so do that one again
+           at_fits = PackAtSize(spc, rects, keep, num_chars, atlas_width, fits, opt, stats);
+         }
+         packed = at_fits;
+         if (!packed) {
+           if (atlas_width == max_size) {
+             break;
+           }
+           atlas_width = std::min(max_size, (atlas_width + atlas_width / 4 + 3) & ~3);
+         }
+       }
+     }
+   }
+   return packed;
+}
+
+// Packs the same rects with every packer, with and without --npot, and
+// prints how big the atlas ends up and how long it took.
+void BenchmarkPackers(const stbrp_rect *rects, int num_chars, const Options& opt)
+{
+   double glyph_area = 0;
+   int num_glyphs = 0;
+   for (int i = 0; i < num_chars; ++i) {
+     if (rects[i].w && rects[i].h) {
+       glyph_area += (double)rects[i].w * rects[i].h;
+       ++num_glyphs;
+     }
+   }
+   printf("packer benchmark: %d glyphs, %.0f pixels of glyph rects\n", num_glyphs, glyph_area);
+   printf("  %-14s %-5s %-13s %6s %10s %8s\n", "packer", "npot", "atlas", "used", "time ms", "attempts");
+   for (int npot = 0; npot < 2; ++npot) {
+     for (int p = 0; p < kNumPackers; ++p) {
+       Options o = opt;
+       o.packer = (Packer)p;
+       o.npot = npot != 0;
+       std::vector<stbrp_rect> copy(rects, rects + num_chars);
+       stbtt_pack_context spc = {};
+       Stats stats;
+       const bool auto_size = !opt.atlas_width;
+       double start = NowMs();
+       bool packed = PackRects(&spc, copy.data(), std::vector<char>(), num_chars, auto_size,
+                               auto_size ? 8 : opt.atlas_width, auto_size ? 8 : opt.atlas_height, o, &stats);
+       double elapsed = NowMs() - start;
+       if (!packed) {
+         printf("  %-14s %-5s %-13s\n", packer_names[p], npot ? "yes" : "no", "did not fit");
+         continue;
+       }
+       char size[32];
+       snprintf(size, sizeof(size), "%d x %d", spc.width, spc.height);
+       printf("  %-14s %-5s %-13s %5.1f%% %10.2f %8d\n", packer_names[p], npot ? "yes" : "no", size,
+              glyph_area * 100.0 / ((double)spc.width * spc.height), elapsed, stats.pack_attempts);
+       PackEnd(&spc);
+     }
+   }
+}
+
+// Runs every rendered glyph through DownsampleReference and DownsampleGlyph
+// until each has taken a while and prints atlas pixels per second.
+void BenchmarkDownsample(const std::vector<RenderedGlyph>& glyphs, const Options& opt)
+{
+   std::vector<const GlyphBitmap*> bitmaps;
+   int dst_pixels = 0;
+   int max_width = 0;
+   int max_rows = 0;
+   for (const auto& glyph : glyphs) {
+     const GlyphBitmap& bm = glyph.bitmap;
+     if (glyph.loaded && bm.width && bm.rows &&
+         (bm.pixel_mode == FT_PIXEL_MODE_GRAY || bm.pixel_mode == FT_PIXEL_MODE_MONO)) {
+       bitmaps.push_back(&bm);
+       const int w = (bm.width + opt.oversample - 1) / opt.oversample;
+       const int h = (bm.rows + opt.oversample - 1) / opt.oversample;
+       dst_pixels += w * h;
+       max_width = std::max(max_width, w);
+       max_rows = std::max(max_rows, h);
+     }
+   }
+   if (bitmaps.empty()) {
+     printf("downsample benchmark: no GRAY or MONO glyphs\n");
+     return;
+   }
+   std::vector<unsigned char> alpha_table;
+   BuildAlphaTable(opt, &alpha_table);
+   DownsampleBuffers buffers;
+   std::vector<unsigned char> reference(max_width * max_rows);
+   std::vector<unsigned char> simd(max_width * max_rows);
+
+   int mismatches = 0;
+   for (const GlyphBitmap* bm : bitmaps) {
+     const int rows = (bm->rows + opt.oversample - 1) / opt.oversample;
+     std::fill(reference.begin(), reference.end(), 0);
+     std::fill(simd.begin(), simd.end(), 0);
+     DownsampleReference(*bm, rows, opt, reference.data(), max_width);
+     DownsampleGlyph(*bm, rows, opt.oversample, alpha_table.data(), simd.data(), max_width, &buffers);
+     mismatches += reference != simd;
+   }
+
+   auto time = [&](bool use_simd) {
+     int iterations = 0;
+     double start = NowMs();
+     double elapsed = 0;
+     do {
+       for (const GlyphBitmap* bm : bitmaps) {
+         const int rows = (bm->rows + opt.oversample - 1) / opt.oversample;
+         if (use_simd) {
+           DownsampleGlyph(*bm, rows, opt.oversample, alpha_table.data(), simd.data(), max_width, &buffers);
+         } else {
+           DownsampleReference(*bm, rows, opt, reference.data(), max_width);
+         }
+       }
+       ++iterations;
+       elapsed = NowMs() - start;
+     } while (elapsed < 250.0);
+     return (double)dst_pixels * iterations / (elapsed / 1000.0);
+   };
+   const char* simd_name = SimdName();
+   const double reference_rate = time(false);
+   const double simd_rate = time(true);
+   printf("downsample benchmark: %d glyphs, %d atlas pixels, oversample %d\n", (int)bitmaps.size(), dst_pixels, opt.oversample);
+   printf("  GetPixel loop: %8.1f Mpixels/s\n", reference_rate / 1e6);
+   printf("  %-6s kernel: %8.1f Mpixels/s (%.1fx)\n", simd_name, simd_rate / 1e6, simd_rate / reference_rate);
+   if (mismatches) {
+     printf("  error: %d glyphs differ between the two\n", mismatches);
+   }
+}
+
+// ASCII, CJK punctuation, kana and fullwidth forms are on nearly every
+// screen so they always go first
+int CodepointPriorityClass(int codepoint) {
+  if (codepoint < 0x80 ||
+      (codepoint >= 0x3000 && codepoint <= 0x30FF) ||
+      (codepoint >= 0xFF00 && codepoint <= 0xFFEF)) {
+    return 0;
+  }
+  return 1;
+}
+
+// Splits the rects into pages no bigger than --max-page-size. Glyphs are
+// taken in order of how likely they are to be used, see
+// CodepointPriorityClass and --used-chars-file counts, and each page gets
+// as many of them as fit so text mostly needs just the first page.
+bool PackPages(stbrp_rect *rects, int num_chars, const std::vector<RenderedGlyph>& glyphs, const Options& opt, std::vector<int>* glyph_pages, std::vector<AtlasPage>* pages, Stats* stats)
+{
+   glyph_pages->assign(num_chars, 0);
+   std::vector<int> order;
+   for (int i = 0; i < num_chars; ++i) {
+     if (rects[i].w == 0 || rects[i].h == 0) {
+       rects[i].x = 0;
+       rects[i].y = 0;
+     } else {
+       order.push_back(i);
+     }
+   }
+   auto count_of = [&](int codepoint) {
+     auto it = opt.codepoint_counts.find(codepoint);
+     return it == opt.codepoint_counts.end() ? 0 : it->second;
+   };
+   std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+     const int class_a = CodepointPriorityClass(glyphs[a].codepoint);
+     const int class_b = CodepointPriorityClass(glyphs[b].codepoint);
+     if (class_a != class_b) {
+       return class_a < class_b;
+     }
+     return count_of(glyphs[a].codepoint) > count_of(glyphs[b].codepoint);
+   });
+
+   const bool auto_size = !opt.atlas_width;
+   const int page_width = auto_size ? MaxAtlasSize(opt) : opt.atlas_width;
+   const int page_height = auto_size ? MaxAtlasSize(opt) : opt.atlas_height;
+   auto pack_subset = [&](int start, int count, bool find_size, std::vector<stbrp_rect>* subset, stbtt_pack_context* spc) {
+     subset->clear();
+     for (int i = 0; i < count; ++i) {
+       subset->push_back(rects[order[start + i]]);
+     }
+     return find_size
+         ? PackRects(spc, subset->data(), std::vector<char>(), count, auto_size, 8, 8, opt, stats)
+         : PackRects(spc, subset->data(), std::vector<char>(), count, false, page_width, page_height, opt, stats);
+   };
+
+   std::vector<stbrp_rect> subset;
+   int start = 0;
+   while (start < (int)order.size()) {
+     // find the most glyphs, in order, that fit on a full size page
+     stbtt_pack_context spc = {};
+     const int remaining = (int)order.size() - start;
+     int fits = 0;
+     if (pack_subset(start, remaining, false, &subset, &spc)) {
+       PackEnd(&spc);
+       fits = remaining;
+     } else {
+       int low = 1;
+       int high = remaining - 1;
+       while (low <= high) {
+         const int count = low + (high - low) / 2;
+         if (pack_subset(start, count, false, &subset, &spc)) {
+           PackEnd(&spc);
+           fits = count;
+           low = count + 1;
+         } else {
+           high = count - 1;
+         }
+       }
+     }
+     if (!fits) {
+       fprintf(stderr, "error: codepoint 0x%x doesn't fit in a %d x %d page\n", glyphs[order[start]].codepoint, page_width, page_height);
+       return false;
+     }
+
+     // now pack just those at the smallest size they fit
+     if (!pack_subset(start, fits, true, &subset, &spc)) {
+       return false;
+     }
+     const int page = (int)pages->size();
+     for (int i = 0; i < fits; ++i) {
+       const int ndx = order[start + i];
+       rects[ndx].x = subset[i].x;
+       rects[ndx].y = subset[i].y;
+       (*glyph_pages)[ndx] = page;
+     }
+     AtlasPage atlas_page;
+     atlas_page.width = spc.width;
+     atlas_page.height = spc.height;
+     pages->push_back(atlas_page);
+     PackEnd(&spc);
+     start += fits;
+   }
+   if (pages->empty()) {
+     AtlasPage atlas_page;
+     atlas_page.width = 8;
+     atlas_page.height = 8;
+     pages->push_back(atlas_page);
+   }
+   return true;
+}
+
+bool SameOutline(const FT_Outline& a, const FT_Outline& b) {
+  if (a.n_points != b.n_points || a.n_contours != b.n_contours || a.flags != b.flags) {
+    return false;
+  }
+  for (int p = 0; p < a.n_points; ++p) {
+    if (a.points[p].x != b.points[p].x || a.points[p].y != b.points[p].y || a.tags[p] != b.tags[p]) {
+      return false;
+    }
+  }
+  return std::equal(a.contours, a.contours + a.n_contours, b.contours);
+}
+
+// True if a and b put the same pixels in their rects. With --glyph-height
+// where a glyph goes in its rect depends on bitmap_top.
+bool SameGlyphPixels(const RenderedGlyph& a, const RenderedGlyph& b, const Options& opt) {
+  return a.bitmap.width == b.bitmap.width &&
+         a.bitmap.rows == b.bitmap.rows &&
+         a.bitmap.pitch == b.bitmap.pitch &&
+         a.bitmap.pixel_mode == b.bitmap.pixel_mode &&
+         (!opt.glyph_height || a.bitmap_top == b.bitmap_top) &&
+         a.bitmap.buffer == b.bitmap.buffer &&
+         a.direct == b.direct &&
+         SameOutline(KeptOutline(a), KeptOutline(b));
+}
+
+uint64_t GlyphPixelsHash(const RenderedGlyph& glyph, const Options& opt) {
+  Hash hash;
+  hash.AddInt(glyph.bitmap.width);
+  hash.AddInt(glyph.bitmap.rows);
+  hash.AddInt(opt.glyph_height ? glyph.bitmap_top : 0);
+  hash.Add(glyph.bitmap.buffer.data(), glyph.bitmap.buffer.size());
+  const FT_Outline outline = KeptOutline(glyph);
+  for (int p = 0; p < outline.n_points; ++p) {
+    hash.AddInt((int)outline.points[p].x);
+    hash.AddInt((int)outline.points[p].y);
+  }
+  return hash.value;
+}
+
+// Finds glyphs that would draw the same pixels into the same sized rect as
+// an earlier one, first codepoints mapped to the same glyph index, then
+// different glyphs with identical bitmaps like the blank ones. Those get
+// an empty rect so they take no space and shared_with[k] says whose rect
+// they use. A glyph kept from --previous-atlas only shares with a kept
+// glyph that was in the same spot, otherwise it keeps its own rect.
+void ShareGlyphRects(const std::vector<RenderedGlyph>& glyphs, stbrp_rect* rects, std::vector<char>* keep, const Options& opt, std::vector<int>* shared_with, Stats* stats) {
+  const int num_chars = (int)glyphs.size();
+  shared_with->assign(num_chars, -1);
+  std::map<FT_UInt, int> by_index;
+  std::map<uint64_t, std::vector<int>> by_pixels;
+  for (int k = 0; k < num_chars; ++k) {
+    const RenderedGlyph& glyph = glyphs[k];
+    if (!glyph.loaded || rects[k].w == 0 || rects[k].h == 0) {
+      continue;
+    }
+    const bool kept = !keep->empty() && (*keep)[k];
+    int original = -1;
+    auto it = by_index.find(glyph.glyph_index);
+    if (it != by_index.end()) {
+      original = it->second;
+    }
+    const bool same_index = original >= 0;
+    std::vector<int>& candidates = by_pixels[GlyphPixelsHash(glyph, opt)];
+    for (size_t c = 0; original < 0 && c < candidates.size(); ++c) {
+      const int other = candidates[c];
+      if (rects[other].w == rects[k].w && rects[other].h == rects[k].h && SameGlyphPixels(glyphs[other], glyph, opt)) {
+        original = other;
+      }
+    }
+    if (original >= 0 && kept &&
+        (!(*keep)[original] || rects[original].x != rects[k].x || rects[original].y != rects[k].y)) {
+      original = -1;
+    }
+    if (original < 0) {
+      by_index.insert(std::make_pair(glyph.glyph_index, k));
+      candidates.push_back(k);
+      continue;
+    }
+    (*shared_with)[k] = original;
+    ++stats->glyphs_shared;
+    if (same_index) {
+      ++stats->glyphs_shared_by_index;
+    }
+    stats->shared_bytes_saved += (int64_t)rects[k].w * rects[k].h * (opt.msdf ? 4 : 1);
+    rects[k].w = 0;
+    rects[k].h = 0;
+    if (kept) {
+      (*keep)[k] = 0;
+    }
+  }
+  if (opt.verbose && stats->glyphs_shared) {
+    printf("sharing rects: %d glyphs (%d same glyph, %d same pixels), %lld bytes saved\n",
+           stats->glyphs_shared, stats->glyphs_shared_by_index, stats->glyphs_shared - stats->glyphs_shared_by_index,
+           (long long)stats->shared_bytes_saved);
+  }
+}
+
+int PackFontRanges(stbtt_pack_context *spc, FT_Face face, stbtt_pack_range *ranges, int num_ranges, const std::vector<FT_UInt>& glyph_indices, const Options& opt, uint64_t font_hash, uint64_t font_fingerprint, std::vector<AtlasPage>* pages, std::vector<int>* glyph_pages, GlyphCache* cache, Stats* stats)
+{
+  stbrp_rect    *rects;
+
+  //int baseline = opt.font_size * opt.oversample * ((float)face->ascender / (float)face->units_per_EM + 0.5f);
+  //printf("  font size: %f\n", opt.font_size);
+  //printf(" face height: %d\n", face->size->metrics.height >> 6);
+  //printf(" face ascender: %d\n", face->size->metrics.ascender >> 6);
+  //printf("  ascender: %d\n", face->ascender);
+  //printf("  units_per_EM: %d\n", face->units_per_EM);
+  //printf("  baseline: %d\n", baseline);
+  int baseline = ((face->size->metrics.ascender + 63) >> 6) / opt.oversample + opt.y_offset;
+
+  // flag all characters as NOT packed
+  for (int i = 0; i < num_ranges; ++i) {
+    for (int j = 0; j < ranges[i].num_chars; ++j) {
+      ranges[i].chardata_for_range[j].x0 = 0;
+      ranges[i].chardata_for_range[j].y0 = 0;
+      ranges[i].chardata_for_range[j].x1 = 0;
+      ranges[i].chardata_for_range[j].y1 = 0;
+     }
+   }
+
+  int num_chars = 0;
+  for (int i = 0; i < num_ranges; ++i) {
+    num_chars += ranges[i].num_chars;
+  }
+
+   rects = (stbrp_rect *) STBTT_malloc(sizeof(*rects) * num_chars, spc->user_allocator_context);
+   if (rects == NULL)
+      return 0;
+
+   std::vector<int> codepoints;
+   codepoints.reserve(num_chars);
+   for (int i = 0; i < num_ranges; ++i) {
+     const stbtt_pack_range& range = ranges[i];
+     for (int j = 0; j < range.num_chars; ++j) {
+       codepoints.push_back(range.array_of_unicode_codepoints
+          ? range.array_of_unicode_codepoints[j]
+          : range.first_unicode_codepoint_in_range + j);
+     }
+   }
+
+   std::vector<RenderedGlyph> glyphs;
+   RenderGlyphs(face, codepoints, glyph_indices, opt, &glyphs, cache, stats);
+
+   for (int k = 0; k < num_chars; ++k) {
+     stbrp_rect* rect = &rects[k];
+     const RenderedGlyph& glyph = glyphs[k];
+     // should probably pad each side separate?
+     if (glyph.loaded) {
+       rect->w = (stbrp_coord)(((glyph.metrics.width + 63) >> 6) / opt.oversample + opt.padding * 2);
+       rect->h = (stbrp_coord)(((glyph.metrics.height + 63) >> 6) / opt.oversample + opt.padding * 2);
+       if (opt.verbose) {
+         printf("   codepoint: 0x%x - %d x %d\n", glyph.codepoint, rect->w, rect->h);
+       }
+     } else {
+       rect->w = 0;
+       rect->h = 0;
+     }
+   }
+
+   if (opt.glyph_height) {
+     for (int i = 0; i < num_chars; ++i) {
+       stbrp_rect* r = &rects[i];
+       r->h = opt.glyph_height;
+     }
+   }
+
+   bool auto_size = !opt.atlas_width;
+   int atlas_width = auto_size ? 8 : opt.atlas_width;
+   int atlas_height = auto_size ? 8 : opt.atlas_height;
+
+   // glyphs that were in the previous atlas stay where they were as long as
+   // they still fit in their old spot, everything else goes around them.
+   // They keep their own size so the .json is the same as a fresh build's.
+   PreviousAtlas previous;
+   std::vector<char> keep;
+   if (!opt.previous_atlas.empty() && opt.max_page_size) {
+     fprintf(stderr, "warn: --previous-atlas is not supported with --max-page-size, ignoring it\n");
+   } else if (!opt.previous_atlas.empty() && LoadPreviousAtlas(opt, font_hash, font_fingerprint, &previous)) {
+     keep.resize(num_chars, 0);
+     int num_kept = 0;
+     for (int i = 0; i < num_chars; ++i) {
+       auto it = previous.rects.find(glyphs[i].codepoint);
+       if (it == previous.rects.end() || rects[i].w == 0 || rects[i].h == 0) {
+         continue;
+       }
+       const PackRect& old = it->second;
+       if (rects[i].w > old.w || rects[i].h > old.h) {
+         fprintf(stderr, "warn: codepoint 0x%x no longer fits in its previous spot, moving it\n", glyphs[i].codepoint);
+         continue;
+       }
+       rects[i].x = (stbrp_coord)old.x;
+       rects[i].y = (stbrp_coord)old.y;
+       keep[i] = 1;
+       ++num_kept;
+     }
+     if (auto_size) {
+       atlas_width = std::max(atlas_width, previous.width);
+       atlas_height = std::max(atlas_height, previous.height);
+     }
+     if (opt.verbose) {
+       printf("keeping %d of %d glyphs from %s\n", num_kept, num_chars, opt.previous_atlas.c_str());
+     }
+   }
+
+   std::vector<int> shared_with;
+   ShareGlyphRects(glyphs, rects, &keep, opt, &shared_with, stats);
+
+   if (opt.benchmark_downsample) {
+     BenchmarkDownsample(glyphs, opt);
+   }
+
+   int return_value = 1;
+   StageTimer pack_timer(stats, "pack");
+   bool packed = false;
+   pages->clear();
+   if (opt.max_page_size) {
+     if (PackPages(rects, num_chars, glyphs, opt, glyph_pages, pages, stats)) {
+       // PackPages cleans up its own contexts
+       return_value = 1;
+     } else {
+       return_value = 0;
+     }
+   } else {
+     packed = PackRects(spc, rects, keep, num_chars, auto_size, atlas_width, atlas_height, opt, stats);
+     if (packed) {
+       AtlasPage page;
+       page.width = spc->width;
+       page.height = spc->height;
+       pages->push_back(page);
+       glyph_pages->assign(num_chars, 0);
+     } else {
+       if (auto_size) {
+         fprintf(stderr, "error: could not fit glyphs in a %d x %d atlas\n", max_atlas_size, max_atlas_size);
+       }
+       return_value = 0;
+     }
+   }
+   stats->pack_ms += pack_timer.Stop();
+
+   if (return_value) {
+     // PackPages put shared glyphs' empty rects anywhere, they go on the
+     // page their pixels are on
+     for (int k = 0; k < num_chars; ++k) {
+       if (shared_with[k] >= 0) {
+         (*glyph_pages)[k] = (*glyph_pages)[shared_with[k]];
+       }
+     }
+     std::vector<double> used_area(pages->size(), 0.0);
+     for (int i = 0; i < num_chars; ++i) {
+       used_area[(*glyph_pages)[i]] += (double)rects[i].w * rects[i].h;
+     }
+     double total_used = 0;
+     double total_area = 0;
+     for (size_t p = 0; p < pages->size(); ++p) {
+       const AtlasPage& page = (*pages)[p];
+       const double area = (double)page.width * page.height;
+       total_used += used_area[p];
+       total_area += area;
+       if (opt.verbose) {
+         if (opt.max_page_size) {
+           printf("page %d: ", (int)p);
+         }
+         printf("atlas: %d x %d, %.1f%% used, %d pixels wasted\n", page.width, page.height, used_area[p] * 100.0 / area, (int)(area - used_area[p]));
+       }
+     }
+     stats->atlas_width = (*pages)[0].width;
+     stats->atlas_height = (*pages)[0].height;
+     stats->pages = (int)pages->size();
+     stats->pack_efficiency = total_used / total_area;
+     stats->wasted_area = (int)(total_area - total_used);
+   }
+
+   if (return_value) {
+     for (auto& page : *pages) {
+       page.channels = opt.msdf ? 4 : 1;
+       page.pixels.resize(page.width * page.height * page.channels);
+     }
+
+     StageTimer blit_timer(stats, "blit");
+     bool crop_error = false;
+     std::vector<unsigned char> alpha_table;
+     BuildAlphaTable(opt, &alpha_table);
+     DownsampleBuffers downsample_buffers;
+     {
+       int k = 0;
+       for (int i = 0; i < num_ranges; ++i) { 
+         const stbtt_pack_range& range = ranges[i];
+         for (int j = 0; j < range.num_chars; ++j) {
+           stbtt_packedchar* packed_char = &range.chardata_for_range[j];
+           const RenderedGlyph& glyph = glyphs[k];
+           const int codepoint = glyph.codepoint;
+           if (glyph.glyph_index) {
+             if (!glyph.loaded) {
+               packed_char->x0 = 0;
+               packed_char->y0 = 0;
+               packed_char->x1 = 0;
+               packed_char->y1 = 0;
+               packed_char->xadvance = 0;
+               packed_char->xoff = 0;
+               packed_char->yoff = 0;
+               packed_char->xoff2 = 0;
+               packed_char->yoff2 = 0;
+             } else {
+               // shared glyphs were drawn by the one they share with
+               const int owner = shared_with[k] >= 0 ? shared_with[k] : k;
+               const bool draw = owner == k;
+               const stbrp_rect rect = rects[owner];
+               const auto& bm = glyph.bitmap;
+               //DumpBitmap(bm);
+
+               int src_y_start = 0;
+               int dst_y_start = opt.glyph_height ? baseline - ((glyph.bitmap_top + opt.oversample - 1) / opt.oversample) : 0;
+               int dst_y_end = dst_y_start + ((bm.rows + opt.oversample - 1) / opt.oversample);
+               if (dst_y_start < 0) {
+                 dst_y_end += dst_y_start;
+                 src_y_start -= dst_y_start;
+                 fprintf(stderr, "codepoint 0x%x truncated at top by %d pixels\n", codepoint, -dst_y_start);
+                 dst_y_start = 0;
+                 crop_error = true;
+               }
+               int max_height = rect.h;
+               if (dst_y_end > max_height) {
+                 fprintf(stderr, "codepoint 0x%x truncated at bottom by %d pixels\n", codepoint, dst_y_end - max_height);
+                 dst_y_end = max_height;
+                 crop_error = true;
+               }
+               static unsigned char masks[] = { 0x66, 0x44, 0x88 };
+
+               int num_rows = dst_y_end - dst_y_start;
+               AtlasPage& page = (*pages)[(*glyph_pages)[owner]];
+               unsigned char* dst = page.pixels.data() + ((rect.y + dst_y_start + opt.padding) * page.width + rect.x + opt.padding) * page.channels;
+               const int dst_stride = page.width * page.channels;
+               if (draw && (opt.sdf || opt.msdf)) {
+                 // already 1 byte per channel at the right size, and
+                 // remapping alpha would move the edge
+                 for (int y = 0; y < num_rows; ++y) {
+                   memcpy(dst + y * dst_stride, bm.buffer.data() + y * bm.pitch, bm.width * page.channels);
+                 }
+               } else if (draw) {
+                 if (glyph.direct) {
+                   if (!RenderOutlineDirect(face->glyph->library, glyph, num_rows, alpha_table.data(), dst, dst_stride)) {
+                     fprintf(stderr, "warn: could not render codepoint: 0x%x\n", codepoint);
+                   }
+                   ++stats->glyphs_rendered;
+                 } else if (bm.pixel_mode == FT_PIXEL_MODE_GRAY || bm.pixel_mode == FT_PIXEL_MODE_MONO) {
+                   DownsampleGlyph(bm, num_rows, opt.oversample, alpha_table.data(), dst, dst_stride, &downsample_buffers);
+                 } else {
+                   DownsampleReference(bm, num_rows, opt, dst, dst_stride);
+                 }
+                 if (opt.show_grid) {
+                   const int dst_width = (bm.width + opt.oversample - 1) / opt.oversample;
+                   for (int y = 0; y < num_rows; ++y) {
+                     for (int x = 0; x < dst_width; ++x) {
+                       dst[y * dst_stride + x] |= masks[k % sizeof(masks)];
+                     }
+                   }
+                 }
+               }
+
+               packed_char->x0 = rect.x + opt.padding;
+               packed_char->y0 = rect.y + opt.padding;
+               packed_char->x1 = rect.x + rect.w - opt.padding * 2 + 1;
+               packed_char->y1 = rect.y + rect.h - opt.padding * 2 + 1;
+               packed_char->xadvance = (float)(glyph.advance.x) / 64.0f / opt.oversample;
+               packed_char->xoff = (float)(glyph.metrics.horiBearingX) / 64.0f / (float)opt.oversample;
+               packed_char->yoff = opt.glyph_height > 0
+                 ? (float)(glyph.metrics.horiBearingY) / 64.0f / (float)opt.oversample
+                 : 0;
+               packed_char->xoff2 = -123456; // not implemented
+               packed_char->yoff2 = -123456; // not implemented
+             }
+           }
+           ++k;
+         }
+       }
+     }
+     stats->blit_ms += blit_timer.Stop();
+
+     if (opt.error_on_crop && crop_error) {
+       return_value = 0;
+     }
+   }
+
+   STBTT_free(rects, spc->user_allocator_context);
+   if (packed) {
+     stbtt_PackEnd(spc);
+   }
+   return return_value;
+}
+
+void PrintStats(const Stats& stats) {
+  printf("stats:\n");
+  printf("  glyphs rendered: %d (each loaded, hinted and rendered once)\n", stats.glyphs_rendered);
+  printf("  glyph cache: %d hits, %d misses\n", stats.glyphs_cached, stats.glyphs_cache_missed);
+  printf("  load+render: %.2f ms on %d thread(s)\n", stats.glyphs_ms, stats.threads);
+  printf("  load+hint: %.2f ms\n", stats.load_ms);
+  printf("  render: %.2f ms\n", stats.render_ms);
+  printf("  pack: %.2f ms (%d attempts)\n", stats.pack_ms, stats.pack_attempts);
+  printf("  atlas: %d x %d, %d page(s), %.1f%% used, %d pixels wasted\n", stats.atlas_width, stats.atlas_height, stats.pages, stats.pack_efficiency * 100.0, stats.wasted_area);
+  printf("  blit: %.2f ms\n", stats.blit_ms);
+  printf("  shared: %d glyphs (%d same glyph, %d same pixels), %lld bytes saved\n",
+         stats.glyphs_shared, stats.glyphs_shared_by_index, stats.glyphs_shared - stats.glyphs_shared_by_index,
+         (long long)stats.shared_bytes_saved);
+  // before the glyph cache every glyph was loaded and hinted once to size
+  // its rect and again to render it, so the second pass is what we saved.
+  printf("  saved: ~%.2f ms of load+hint by not loading every glyph twice\n", stats.load_ms);
+}
+
+uint64_t HashFontData(const MappedFile& file) {
+  Hash hash;
+  hash.Add(file.data, file.size);
+  return hash.value;
+}
+
+// A cheap stand in for HashFontData that only reads a few pages: the size,
+// the first and last 4k and the face's table directory, which has every
+// table's checksum. Written to every .json so --previous-atlas can check
+// the font without hashing all of it.
+uint64_t FontFingerprint(const Options& opt) {
+  std::shared_ptr<MappedFile> file = MapFontFile(opt.font_filename);
+  if (!file) {
+    return 0;
+  }
+  const unsigned char* data = file->data;
+  const size_t size = file->size;
+  auto u16 = [&](size_t at) { return at + 2 <= size ? (uint32_t)data[at] << 8 | data[at + 1] : 0; };
+  auto u32 = [&](size_t at) { return u16(at) << 16 | u16(at + 2); };
+  Hash hash;
+  hash.Add(&size, sizeof(size));
+  const size_t edge = std::min<size_t>(size, 4096);
+  hash.Add(data, edge);
+  hash.Add(data + size - edge, edge);
+  size_t offset = 0;
+  if (u32(0) == 0x74746366 && opt.font_index >= 0 && (uint32_t)opt.font_index < u32(8)) {  // 'ttcf'
+    offset = u32(12 + 4 * (size_t)opt.font_index);
+  }
+  const size_t directory_end = offset + 12 + 16 * (size_t)u16(offset + 4);
+  if (directory_end <= size) {
+    hash.Add(data + offset, directory_end - offset);
+  }
+  return hash.value;
+}
+
+// What --font-cache-dir remembers about a font file. The hash is only
+// trusted while the file's size and modification time still match, so a
+// run whose atlases all come from the cache never reads the font at all.
+struct FontIndexEntry {
+  char magic[4];  // "FAFI"
+  uint32_t version;
+  uint64_t size;
+  int64_t mtime;
+  uint64_t hash;
+};
+
+const uint32_t kFontIndexVersion = 1;
+
+// Hashing reads the whole font so it's only done for the options that use
+// it, the rest of a run only touches the pages FreeType reads.
+bool NeedsFontHash(const Options& opt) {
+  return !opt.cache_dir.empty() || !opt.font_cache_dir.empty() || !opt.previous_atlas.empty();
+}
+
+// hash of the font's contents for keying the --cache-dir files and checking
+// a --previous-atlas was made from the same font
+uint64_t FontHash(const Options& opt, const std::string& filename, const MappedFile& file) {
+  const std::string& dir = opt.font_cache_dir.empty() ? opt.cache_dir : opt.font_cache_dir;
+  std::error_code ec;
+  const std::experimental::filesystem::path font_path = std::experimental::filesystem::absolute(filename);
+  const auto mtime = std::experimental::filesystem::last_write_time(font_path, ec);
+  if (dir.empty() || ec) {
+    return HashFontData(file);
+  }
+
+  Hash path_hash;
+  path_hash.AddString(font_path.string());
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.fafi", (unsigned long long)path_hash.value);
+  const std::string index_filename = (std::experimental::filesystem::path(dir) / name).string();
+
+  FontIndexEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  memcpy(entry.magic, "FAFI", 4);
+  entry.version = kFontIndexVersion;
+  entry.size = file.size;
+  entry.mtime = (int64_t)mtime.time_since_epoch().count();
+
+  FontIndexEntry cached;
+  FILE* fp = fopen(index_filename.c_str(), "rb");
+  if (fp) {
+    const bool read = fread(&cached, sizeof(cached), 1, fp) == 1;
+    fclose(fp);
+    if (read && !memcmp(cached.magic, entry.magic, 4) && cached.version == entry.version &&
+        cached.size == entry.size && cached.mtime == entry.mtime) {
+      return cached.hash;
+    }
+  }
+
+  entry.hash = HashFontData(file);
+  std::experimental::filesystem::create_directories(dir, ec);
+  fp = fopen(index_filename.c_str(), "wb");
+  if (fp) {
+    fwrite(&entry, sizeof(entry), 1, fp);
+    fclose(fp);
+  }
+  return entry.hash;
+}
+
+std::string CachePath(const Options& opt, const std::string& key, const char* suffix) {
+  return (std::experimental::filesystem::path(opt.cache_dir) / (key + suffix)).string();
+}
+
+const char autofit_map_magic[4] = { 'F', 'A', 'A', 'M' };
+const int autofit_map_version = 1;
+
+// The AutofitMap only depends on the font and the FreeType that made it
+std::string AutofitMapCacheKey(uint64_t font_hash, const Options& opt) {
+  Hash hash;
+  hash.Add(&font_hash, sizeof(font_hash));
+  hash.AddInt(opt.font_index);
+  hash.AddInt(FREETYPE_MAJOR);
+  hash.AddInt(FREETYPE_MINOR);
+  hash.AddInt(FREETYPE_PATCH);
+  return hash.Hex();
+}
+
+// Gives a just opened face the AutofitMap from the --cache-dir, if there is
+// one, so the autofitter doesn't work it out again
+void LoadAutofitMap(FT_Face face, const Options& opt, uint64_t font_hash, Stats* stats) {
+  if (opt.cache_dir.empty() || opt.sdf || opt.msdf) {
+    return;
+  }
+  const std::string filename = CachePath(opt, AutofitMapCacheKey(font_hash, opt), ".afmap");
+  FILE* fp = fopen(filename.c_str(), "rb");
+  if (!fp) {
+    return;
+  }
+  StageTimer timer(stats, "load autofit map");
+  char magic[4];
+  int header[2];
+  AutofitMap map;
+  bool ok = fread(magic, 1, 4, fp) == 4 && !memcmp(magic, autofit_map_magic, 4) &&
+            read_ints(fp, header, 2) && header[0] == autofit_map_version && header[1] == face->num_glyphs;
+  if (ok) {
+    map.resize(header[1]);
+    ok = fread(map.data(), sizeof(FT_UShort), map.size(), fp) == map.size();
+  }
+  fclose(fp);
+  if (!ok || !SetAutofitMap(face, map)) {
+    // SaveAutofitMap writes a good one after this run
+    fprintf(stderr, "warn: ignoring bad autofit map: %s\n", filename.c_str());
+    std::error_code ec;
+    std::experimental::filesystem::remove(filename, ec);
+  }
+}
+
+// Saves face's AutofitMap to the --cache-dir if the autofitter made one and
+// it's not there yet
+void SaveAutofitMap(FT_Face face, const Options& opt, uint64_t font_hash, Stats* stats) {
+  if (opt.cache_dir.empty()) {
+    return;
+  }
+  const std::string filename = CachePath(opt, AutofitMapCacheKey(font_hash, opt), ".afmap");
+  std::error_code ec;
+  AutofitMap map;
+  if (std::experimental::filesystem::exists(filename, ec) || !GetAutofitMap(face, &map)) {
+    return;
+  }
+  StageTimer timer(stats, "save autofit map");
+  FILE* fp = fopen(filename.c_str(), "wb");
+  if (!fp) {
+    fprintf(stderr, "warn: couldn't write %s\n", filename.c_str());
+    return;
+  }
+  const int header[2] = { autofit_map_version, (int)map.size() };
+  fwrite(autofit_map_magic, 1, 4, fp);
+  fwrite(header, sizeof(int), 2, fp);
+  fwrite(map.data(), sizeof(FT_UShort), map.size(), fp);
+  fclose(fp);
+}
+
+// name.png, or name_0.png, name_1.png, ... with --max-page-size, the
+// extension depends on --output-format
+std::string PageSuffix(const Options& opt, int page) {
+  const std::string extension = output_format_extensions[opt.output_format];
+  return opt.max_page_size ? "_" + std::to_string(page) + extension : extension;
+}
+
+std::string PageFilename(const Options& opt, int page) {
+  return opt.out_name + PageSuffix(opt, page);
+}
+
+// If an atlas with the same font, options and codepoints has been built
+// before just copy it from the --cache-dir
+bool RestoreAtlasFromCache(const Options& opt, uint64_t font_hash) {
+  namespace fs = std::experimental::filesystem;
+  const std::string key = AtlasCacheKey(font_hash, opt);
+  const std::string json_filename = CachePath(opt, key, ".json");
+  std::error_code ec;
+  if (!fs::exists(CachePath(opt, key, PageSuffix(opt, 0).c_str()), ec) || !fs::exists(json_filename, ec)) {
+    return false;
+  }
+  if (!opt.previous_atlas.empty()) {
+    // Packing against the atlas we cached gives that atlas again, packing
+    // against anything else might not.
+    std::vector<unsigned char> previous, cached;
+    if (!readFile(opt.previous_atlas.c_str(), &previous) || !readFile(json_filename.c_str(), &cached) ||
+        previous != cached) {
+      return false;
+    }
+  }
+  for (int page = 0; !ec; ++page) {
+    const std::string atlas_filename = CachePath(opt, key, PageSuffix(opt, page).c_str());
+    if (page > 0 && (!opt.max_page_size || !fs::exists(atlas_filename, ec))) {
+      break;
+    }
+    fs::copy_file(atlas_filename, PageFilename(opt, page), fs::copy_options::overwrite_existing, ec);
+  }
+  if (!ec) {
+    fs::copy_file(json_filename, opt.out_name + ".json", fs::copy_options::overwrite_existing, ec);
+  }
+  if (!ec && opt.metrics_bin) {
+    fs::copy_file(CachePath(opt, key, ".bin"), opt.out_name + ".bin", fs::copy_options::overwrite_existing, ec);
+  }
+  if (ec) {
+    fprintf(stderr, "warn: couldn't copy %s from cache: %s\n", opt.out_name.c_str(), ec.message().c_str());
+    return false;
+  }
+  printf("up to date: %s (cache %s)\n", opt.out_name.c_str(), key.c_str());
+  return true;
+}
+
+void SaveAtlasToCache(const Options& opt, uint64_t font_hash, int num_pages) {
+  namespace fs = std::experimental::filesystem;
+  const std::string key = AtlasCacheKey(font_hash, opt);
+  std::error_code ec;
+  for (int page = 0; page < num_pages && !ec; ++page) {
+    fs::copy_file(PageFilename(opt, page), CachePath(opt, key, PageSuffix(opt, page).c_str()), fs::copy_options::overwrite_existing, ec);
+  }
+  if (!ec) {
+    fs::copy_file(opt.out_name + ".json", CachePath(opt, key, ".json"), fs::copy_options::overwrite_existing, ec);
+  }
+  if (!ec && opt.metrics_bin) {
+    fs::copy_file(opt.out_name + ".bin", CachePath(opt, key, ".bin"), fs::copy_options::overwrite_existing, ec);
+  }
+  if (ec) {
+    fprintf(stderr, "warn: couldn't cache %s: %s\n", opt.out_name.c_str(), ec.message().c_str());
+  }
+}
+
+// PNG writing
+//
+// stbi_write_png filters and deflates the whole image on one thread. Here
+// the image is split into stripes of rows that are filtered and deflated on
+// --threads threads. Each stripe is its own fixed Huffman block with no
+// matches reaching into the previous stripe. Stripes are joined with an
+// empty stored block, the same boundary zlib's Z_FULL_FLUSH makes, so the
+// result is still one ordinary zlib stream.
+//
+// --png-level fast only uses the Sub filter and short match searches,
+// default picks a filter per row like stb and does lazy matching, max
+// searches much further for matches.
+
+struct BitWriter {
+  std::vector<unsigned char>* out;
+  uint64_t bits = 0;
+  int count = 0;
+
+  explicit BitWriter(std::vector<unsigned char>* o) : out(o) { }
+  void Write(uint32_t value, int num_bits) {
+    bits |= (uint64_t)value << count;
+    count += num_bits;
+    while (count >= 8) {
+      out->push_back((unsigned char)bits);
+      bits >>= 8;
+      count -= 8;
+    }
+  }
+  void AlignToByte() {
+    if (count) {
+      Write(0, 8 - count);
+    }
+  }
+};
+
+// Deflate's fixed Huffman codes, bit reversed so they can be written LSB
+// first, and the length and distance code for every length and distance.
+struct DeflateTables {
+  uint16_t lit_code[288];
+  unsigned char lit_bits[288];
+  unsigned char length_code[259];    // minus 257
+  unsigned char dist_code[32769];
+
+  DeflateTables() {
+    for (int v = 0; v < 288; ++v) {
+      int code;
+      int bits;
+      if (v < 144) {
+        code = 0x30 + v;
+        bits = 8;
+      } else if (v < 256) {
+        code = 0x190 + v - 144;
+        bits = 9;
+      } else if (v < 280) {
+        code = v - 256;
+        bits = 7;
+      } else {
+        code = 0xC0 + v - 280;
+        bits = 8;
+      }
+      lit_code[v] = (uint16_t)Reverse(code, bits);
+      lit_bits[v] = (unsigned char)bits;
+    }
+    for (int c = 0; c < 29; ++c) {
+      const int end = c == 28 ? 259 : length_base[c + 1];
+      for (int len = length_base[c]; len < end; ++len) {
+        length_code[len] = (unsigned char)c;
+      }
+    }
+    length_code[258] = 28;
+    for (int c = 0; c < 30; ++c) {
+      const int end = c == 29 ? 32769 : dist_base[c + 1];
+      for (int d = dist_base[c]; d < end; ++d) {
+        dist_code[d] = (unsigned char)c;
+      }
+    }
+  }
+
+  static int Reverse(int code, int bits) {
+    int r = 0;
+    for (int i = 0; i < bits; ++i) {
+      r = (r << 1) | ((code >> i) & 1);
+    }
+    return r;
+  }
+
+  static const uint16_t length_base[29];
+  static const unsigned char length_extra[29];
+  static const uint16_t dist_base[30];
+  static const unsigned char dist_extra[30];
+};
+
+const uint16_t DeflateTables::length_base[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+const unsigned char DeflateTables::length_extra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+const uint16_t DeflateTables::dist_base[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+const unsigned char DeflateTables::dist_extra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+const DeflateTables& GetDeflateTables() {
+  static DeflateTables tables;
+  return tables;
+}
+
+uint32_t Adler32(const unsigned char* data, size_t len) {
+  uint32_t a = 1;
+  uint32_t b = 0;
+  while (len) {
+    // 5552 is the most bytes before b can overflow
+    const size_t n = std::min(len, (size_t)5552);
+    for (size_t i = 0; i < n; ++i) {
+      a += data[i];
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+    data += n;
+    len -= n;
+  }
+  return (b << 16) | a;
+}
+
+// The adler32 of 2 buffers joined from the adler32 of each, zlib's
+// adler32_combine
+uint32_t Adler32Combine(uint32_t adler1, uint32_t adler2, size_t len2) {
+  const uint32_t base = 65521;
+  const uint32_t rem = (uint32_t)(len2 % base);
+  uint32_t sum1 = adler1 & 0xFFFF;
+  uint32_t sum2 = (uint32_t)(((uint64_t)rem * sum1) % base);
+  sum1 += (adler2 & 0xFFFF) + base - 1;
+  sum2 += (adler1 >> 16) + (adler2 >> 16) + base - rem;
+  if (sum1 >= base) sum1 -= base;
+  if (sum1 >= base) sum1 -= base;
+  if (sum2 >= (base << 1)) sum2 -= (base << 1);
+  if (sum2 >= base) sum2 -= base;
+  return sum1 | (sum2 << 16);
+}
+
+uint32_t Crc32(uint32_t crc, const unsigned char* data, size_t len) {
+  static uint32_t table[256];
+  static bool initialized = [] {
+    for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      }
+      table[n] = c;
+    }
+    return true;
+  }();
+  (void)initialized;
+  crc = ~crc;
+  for (size_t i = 0; i < len; ++i) {
+    crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+// Deflates data as one fixed Huffman block. Unless it's the last stripe the
+// block is followed by an empty stored block which leaves the stream byte
+// aligned for the next stripe.
+void DeflateStripe(const unsigned char* data, int len, PngLevel level, bool last, std::vector<unsigned char>* out) {
+  const DeflateTables& t = GetDeflateTables();
+  const int hash_bits = 15;
+  const int window = 32768;
+  const int max_chain = level == kPngFast ? 4 : level == kPngDefault ? 32 : 256;
+  const int nice_length = level == kPngFast ? 32 : level == kPngDefault ? 128 : 258;
+  const bool lazy = level != kPngFast;
+
+  std::vector<int> head(1 << hash_bits, -1);
+  std::vector<int> prev(len);
+  auto hash = [&](int p) {
+    const uint32_t v = data[p] | (data[p + 1] << 8) | (data[p + 2] << 16);
+    return (v * 2654435761u) >> (32 - hash_bits);
+  };
+  auto insert = [&](int p) {
+    if (p + 2 < len) {
+      const uint32_t h = hash(p);
+      prev[p] = head[h];
+      head[h] = p;
+    }
+  };
+  auto find_match = [&](int p, int* dist) {
+    int best = 0;
+    if (p + 2 >= len) {
+      return 0;
+    }
+    const int max_len = std::min(258, len - p);
+    int chain = max_chain;
+    for (int c = head[hash(p)]; c >= 0 && p - c <= window && chain--; c = prev[c]) {
+      if (data[c + best] != data[p + best]) {
+        continue;
+      }
+      int l = 0;
+      while (l < max_len && data[c + l] == data[p + l]) {
+        ++l;
+      }
+      if (l > best) {
+        best = l;
+        *dist = p - c;
+        if (l >= nice_length || l == max_len) {
+          break;
+        }
+      }
+    }
+    return best >= 3 ? best : 0;
+  };
+
+  BitWriter bw(out);
+  bw.Write(last ? 1 : 0, 1);  // BFINAL
+  bw.Write(1, 2);             // fixed Huffman
+  auto literal = [&](int v) {
+    bw.Write(t.lit_code[v], t.lit_bits[v]);
+  };
+
+  int i = 0;
+  while (i < len) {
+    int dist = 0;
+    const int match = find_match(i, &dist);
+    if (match && lazy && match < nice_length) {
+      // a longer match starting at the next byte is worth a literal
+      int next_dist = 0;
+      insert(i);
+      if (find_match(i + 1, &next_dist) > match) {
+        literal(data[i]);
+        ++i;
+        continue;
+      }
+    } else {
+      insert(i);
+    }
+    if (!match) {
+      literal(data[i]);
+      ++i;
+      continue;
+    }
+    const int lc = t.length_code[match];
+    literal(257 + lc);
+    bw.Write(match - DeflateTables::length_base[lc], DeflateTables::length_extra[lc]);
+    const int dc = t.dist_code[dist];
+    bw.Write(DeflateTables::Reverse(dc, 5), 5);
+    bw.Write(dist - DeflateTables::dist_base[dc], DeflateTables::dist_extra[dc]);
+    for (int j = 1; j < match; ++j) {
+      insert(i + j);
+    }
+    i += match;
+  }
+  literal(256);
+  if (!last) {
+    bw.Write(0, 3);  // BFINAL 0, stored
+    bw.AlignToByte();
+    bw.Write(0x0000, 16);
+    bw.Write(0xFFFF, 16);
+  }
+  bw.AlignToByte();
+}
+
+int Paeth(int a, int b, int c) {
+  const int p = a + b - c;
+  const int pa = abs(p - a);
+  const int pb = abs(p - b);
+  const int pc = abs(p - c);
+  return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// PNG filter type on cur into out, prev is the row above, all zero for the
+// first row.
+void FilterRow(int type, const unsigned char* cur, const unsigned char* prev, int row_bytes, int bpp, unsigned char* out) {
+  switch (type) {
+    case 0:
+      memcpy(out, cur, row_bytes);
+      break;
+    case 1:
+      memcpy(out, cur, bpp);
+      for (int i = bpp; i < row_bytes; ++i) {
+        out[i] = (unsigned char)(cur[i] - cur[i - bpp]);
+      }
+      break;
+    case 2:
+      for (int i = 0; i < row_bytes; ++i) {
+        out[i] = (unsigned char)(cur[i] - prev[i]);
+      }
+      break;
+    case 3:
+      for (int i = 0; i < bpp; ++i) {
+        out[i] = (unsigned char)(cur[i] - (prev[i] >> 1));
+      }
+      for (int i = bpp; i < row_bytes; ++i) {
+        out[i] = (unsigned char)(cur[i] - ((cur[i - bpp] + prev[i]) >> 1));
+      }
+      break;
+    case 4:
+      for (int i = 0; i < bpp; ++i) {
+        out[i] = (unsigned char)(cur[i] - prev[i]);
+      }
+      for (int i = bpp; i < row_bytes; ++i) {
+        out[i] = (unsigned char)(cur[i] - Paeth(cur[i - bpp], prev[i], prev[i - bpp]));
+      }
+      break;
+  }
+}
+
+typedef std::function<void(int y, unsigned char* row)> PngRowFunc;
+
+// Encodes a width x height PNG with channels bytes per pixel. get_row fills
+// in row y and gets called from several threads at once.
+void EncodePng(int width, int height, int channels, const PngRowFunc& get_row, PngLevel level, int threads, std::vector<unsigned char>* png) {
+  const int row_bytes = width * channels;
+  // stripes of about 64k so even small atlases use a few threads but each
+  // stripe still has plenty to find matches in. The stripes don't depend on
+  // threads so the .png is the same no matter how many there are.
+  const int stripe_rows = std::max(1, (64 * 1024) / (row_bytes + 1));
+  const int num_stripes = std::max(1, (height + stripe_rows - 1) / stripe_rows);
+
+  struct Stripe {
+    std::vector<unsigned char> deflated;
+    uint32_t adler = 1;
+    size_t raw_len = 0;
+  };
+  std::vector<Stripe> stripes(num_stripes);
+  std::atomic<int> next_stripe(0);
+  auto work = [&]() {
+    std::vector<unsigned char> prev(row_bytes);
+    std::vector<unsigned char> cur(row_bytes);
+    std::vector<unsigned char> candidate(row_bytes);
+    std::vector<unsigned char> raw;
+    for (;;) {
+      const int s = next_stripe.fetch_add(1);
+      if (s >= num_stripes) {
+        break;
+      }
+      const int y0 = s * stripe_rows;
+      const int y1 = std::min(height, y0 + stripe_rows);
+      raw.resize((size_t)(y1 - y0) * (row_bytes + 1));
+      if (y0 > 0) {
+        get_row(y0 - 1, prev.data());
+      } else {
+        std::fill(prev.begin(), prev.end(), 0);
+      }
+      unsigned char* dst = raw.data();
+      for (int y = y0; y < y1; ++y) {
+        get_row(y, cur.data());
+        int best_type = 1;
+        if (level != kPngFast) {
+          // the filter with the smallest sum of signed bytes, like stb
+          int best_sum = INT_MAX;
+          for (int type = 0; type < 5; ++type) {
+            FilterRow(type, cur.data(), prev.data(), row_bytes, channels, candidate.data());
+            int sum = 0;
+            for (int i = 0; i < row_bytes; ++i) {
+              sum += abs((signed char)candidate[i]);
+            }
+            if (sum < best_sum) {
+              best_sum = sum;
+              best_type = type;
+            }
+          }
+        }
+        dst[0] = (unsigned char)best_type;
+        FilterRow(best_type, cur.data(), prev.data(), row_bytes, channels, dst + 1);
+        dst += row_bytes + 1;
+        std::swap(prev, cur);
+      }
+      Stripe& stripe = stripes[s];
+      stripe.raw_len = raw.size();
+      stripe.adler = Adler32(raw.data(), raw.size());
+      DeflateStripe(raw.data(), (int)raw.size(), level, s == num_stripes - 1, &stripe.deflated);
+    }
+  };
+  const int num_workers = std::max(1, std::min(threads, num_stripes));
+  std::vector<std::thread> workers;
+  for (int t = 1; t < num_workers; ++t) {
+    workers.emplace_back(work);
+  }
+  work();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  std::vector<unsigned char> idat;
+  static const unsigned char zlib_header[kNumPngLevels][2] = { { 0x78, 0x01 }, { 0x78, 0x9C }, { 0x78, 0xDA } };
+  idat.push_back(zlib_header[level][0]);
+  idat.push_back(zlib_header[level][1]);
+  uint32_t adler = 1;
+  for (const Stripe& stripe : stripes) {
+    idat.insert(idat.end(), stripe.deflated.begin(), stripe.deflated.end());
+    adler = Adler32Combine(adler, stripe.adler, stripe.raw_len);
+  }
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    idat.push_back((unsigned char)(adler >> shift));
+  }
+
+  auto put32 = [&](uint32_t v) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      png->push_back((unsigned char)(v >> shift));
+    }
+  };
+  auto chunk = [&](const char* type, const unsigned char* data, size_t len) {
+    put32((uint32_t)len);
+    const size_t start = png->size();
+    png->insert(png->end(), type, type + 4);
+    png->insert(png->end(), data, data + len);
+    put32(Crc32(0, png->data() + start, len + 4));
+  };
+  static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+  static const unsigned char color_types[5] = { 0, 0, 4, 2, 6 };
+  png->clear();
+  png->insert(png->end(), signature, signature + 8);
+  const unsigned char ihdr[13] = {
+    (unsigned char)(width >> 24), (unsigned char)(width >> 16), (unsigned char)(width >> 8), (unsigned char)width,
+    (unsigned char)(height >> 24), (unsigned char)(height >> 16), (unsigned char)(height >> 8), (unsigned char)height,
+    8, color_types[channels], 0, 0, 0,
+  };
+  chunk("IHDR", ihdr, sizeof(ihdr));
+  chunk("IDAT", idat.data(), idat.size());
+  chunk("IEND", NULL, 0);
+}
+
+bool WritePng(const std::string& filename, int width, int height, int channels, const PngRowFunc& get_row, const Options& opt) {
+  std::vector<unsigned char> png;
+  EncodePng(width, height, channels, get_row, opt.png_level, opt.threads, &png);
+  FILE* fp = fopen(filename.c_str(), "wb");
+  if (!fp) {
+    return false;
+  }
+  const bool ok = fwrite(png.data(), 1, png.size(), fp) == png.size();
+  return fclose(fp) == 0 && ok;
+}
+
+bool WriteRaw(const std::string& filename, int width, int height, int channels, const PngRowFunc& get_row) {
+  FILE* fp = fopen(filename.c_str(), "wb");
+  if (!fp) {
+    return false;
+  }
+  std::vector<unsigned char> row(width * channels);
+  bool ok = true;
+  for (int y = 0; y < height && ok; ++y) {
+    get_row(y, row.data());
+    ok = fwrite(row.data(), 1, row.size(), fp) == row.size();
+  }
+  return fclose(fp) == 0 && ok;
+}
+
+// An uncompressed KTX 1 texture, GL_R8 or GL_RGBA8, one mip level. KTX rows
+// are padded to 4 bytes.
+bool WriteKtx(const std::string& filename, int width, int height, int channels, const PngRowFunc& get_row) {
+  FILE* fp = fopen(filename.c_str(), "wb");
+  if (!fp) {
+    return false;
+  }
+  static const unsigned char identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+  const uint32_t gl_unsigned_byte = 0x1401;
+  const uint32_t gl_red = 0x1903;
+  const uint32_t gl_rgba = 0x1908;
+  const uint32_t gl_r8 = 0x8229;
+  const uint32_t gl_rgba8 = 0x8058;
+  const int row_bytes = width * channels;
+  const int padded_row_bytes = (row_bytes + 3) & ~3;
+  const uint32_t header[14] = {
+    0x04030201,  // endianness
+    gl_unsigned_byte,
+    1,           // glTypeSize
+    channels == 4 ? gl_rgba : gl_red,
+    channels == 4 ? gl_rgba8 : gl_r8,
+    channels == 4 ? gl_rgba : gl_red,
+    (uint32_t)width,
+    (uint32_t)height,
+    0,           // pixelDepth
+    0,           // numberOfArrayElements
+    1,           // numberOfFaces
+    1,           // numberOfMipmapLevels
+    0,           // bytesOfKeyValueData
+    (uint32_t)(padded_row_bytes * height),  // imageSize of mip 0
+  };
+  bool ok = fwrite(identifier, 1, sizeof(identifier), fp) == sizeof(identifier) &&
+            fwrite(header, sizeof(header[0]), 14, fp) == 14;
+  std::vector<unsigned char> row(padded_row_bytes, 0);
+  for (int y = 0; y < height && ok; ++y) {
+    get_row(y, row.data());
+    ok = fwrite(row.data(), 1, row.size(), fp) == row.size();
+  }
+  return fclose(fp) == 0 && ok;
+}
+
+void CountBytes(void* context, void* data, int size) {
+  (void)data;
+  *(size_t*)context += size;
+}
+
+// Encodes an image with stb and with each --png-level on 1 and --threads
+// threads and prints the time and size of each.
+void BenchmarkPng(int width, int height, int channels, const std::vector<unsigned char>& pixels, const Options& opt) {
+  printf("png benchmark: %d x %d, %d channel(s)\n", width, height, channels);
+  printf("  %-14s %7s %10s %10s\n", "encoder", "threads", "time ms", "bytes");
+  auto time = [&](const std::function<size_t()>& encode) {
+    int iterations = 0;
+    size_t bytes = 0;
+    const double start = NowMs();
+    double elapsed = 0;
+    do {
+      bytes = encode();
+      ++iterations;
+      elapsed = NowMs() - start;
+    } while (elapsed < 250.0);
+    return std::make_pair(elapsed / iterations, bytes);
+  };
+  auto stb = time([&]() {
+    size_t bytes = 0;
+    stbi_write_png_to_func(CountBytes, &bytes, width, height, channels, pixels.data(), width * channels);
+    return bytes;
+  });
+  printf("  %-14s %7d %10.2f %10d\n", "stb", 1, stb.first, (int)stb.second);
+  const PngRowFunc get_row = [&](int y, unsigned char* row) {
+    memcpy(row, pixels.data() + (size_t)y * width * channels, width * channels);
+  };
+  for (int level = 0; level < kNumPngLevels; ++level) {
+    std::set<int> thread_counts = { 1, opt.threads };
+    for (int threads : thread_counts) {
+      auto result = time([&]() {
+        std::vector<unsigned char> png;
+        EncodePng(width, height, channels, get_row, (PngLevel)level, threads, &png);
+        return png.size();
+      });
+      char name[32];
+      snprintf(name, sizeof(name), "png %s", png_level_names[level]);
+      printf("  %-14s %7d %10.2f %10d\n", name, threads, result.first, (int)result.second);
+    }
+  }
+}
+
+// One glyph of the atlas as it goes in the .json and .bin
+struct GlyphMetrics {
+  int codepoint = 0;
+  int page = 0;
+  int x = 0;
+  int y = 0;
+  int w = 0;
+  int h = 0;
+  float x_off = 0;
+  float y_off = 0;
+  float x_advance = 0;
+  float x_off2 = 0;
+  float y_off2 = 0;
+};
+
+// --metrics-format bin
+//
+// Little endian. A MetricsBinHeader then, at the offsets it gives, arrays of
+// num_glyphs entries each. codepoints is sorted so a glyph can be found with
+// a binary search directly on the mapped file, its index is then the index
+// into every other array. Every array starts on a 4 byte boundary.
+//
+//   uint32_t codepoints[]  sorted
+//   uint16_t pages[]       which atlas page
+//   uint16_t tex_x[], tex_y[], tex_w[], tex_h[]
+//   float    x_off[], y_off[], x_advance[]
+//   uint32_t page_width[num_pages], page_height[num_pages]
+//
+// version changes whenever the layout does.
+const char metrics_bin_magic[4] = { 'F', 'A', 'G', 'M' };
+const uint32_t metrics_bin_version = 1;
+
+struct MetricsBinHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t header_size;    // sizeof(MetricsBinHeader), for adding fields later
+  uint32_t num_glyphs;
+  uint32_t num_pages;
+  float font_size;
+  int32_t baseline;
+  int32_t y_offset;
+  int32_t oversample;
+  int32_t padding;
+  uint32_t distance_field;  // 0 = none, 1 = sdf, 2 = msdf
+  int32_t sdf_spread;
+  uint32_t codepoints;      // byte offsets of the arrays from the start of the file
+  uint32_t pages;
+  uint32_t tex_x;
+  uint32_t tex_y;
+  uint32_t tex_w;
+  uint32_t tex_h;
+  uint32_t x_off;
+  uint32_t y_off;
+  uint32_t x_advance;
+  uint32_t page_width;
+  uint32_t page_height;
+};
+
+bool WriteMetricsBin(const std::string& filename, const std::vector<GlyphMetrics>& metrics, const std::vector<AtlasPage>& pages, int baseline, const Options& opt) {
+  MetricsBinHeader header = {};
+  memcpy(header.magic, metrics_bin_magic, 4);
+  header.version = metrics_bin_version;
+  header.header_size = sizeof(header);
+  header.num_glyphs = (uint32_t)metrics.size();
+  header.num_pages = (uint32_t)pages.size();
+  header.font_size = opt.font_size;
+  header.baseline = baseline;
+  header.y_offset = opt.y_offset;
+  header.oversample = opt.oversample;
+  header.padding = opt.padding;
+  header.distance_field = opt.msdf ? 2 : opt.sdf ? 1 : 0;
+  header.sdf_spread = opt.sdf_spread;
+
+  std::vector<unsigned char> data(sizeof(header));
+  auto add_array = [&](const void* src, size_t size) {
+    data.resize((data.size() + 3) & ~3);
+    const uint32_t offset = (uint32_t)data.size();
+    data.insert(data.end(), (const unsigned char*)src, (const unsigned char*)src + size);
+    return offset;
+  };
+  const size_t n = metrics.size();
+  std::vector<uint32_t> u32(n);
+  std::vector<uint16_t> u16(n);
+  std::vector<float> f32(n);
+  auto add_u16 = [&](int GlyphMetrics::*field) {
+    for (size_t i = 0; i < n; ++i) {
+      u16[i] = (uint16_t)(metrics[i].*field);
+    }
+    return add_array(u16.data(), n * sizeof(uint16_t));
+  };
+  auto add_float = [&](float GlyphMetrics::*field) {
+    for (size_t i = 0; i < n; ++i) {
+      f32[i] = metrics[i].*field;
+    }
+    return add_array(f32.data(), n * sizeof(float));
+  };
+  for (size_t i = 0; i < n; ++i) {
+    u32[i] = (uint32_t)metrics[i].codepoint;
+  }
+  header.codepoints = add_array(u32.data(), n * sizeof(uint32_t));
+  header.pages = add_u16(&GlyphMetrics::page);
+  header.tex_x = add_u16(&GlyphMetrics::x);
+  header.tex_y = add_u16(&GlyphMetrics::y);
+  header.tex_w = add_u16(&GlyphMetrics::w);
+  header.tex_h = add_u16(&GlyphMetrics::h);
+  header.x_off = add_float(&GlyphMetrics::x_off);
+  header.y_off = add_float(&GlyphMetrics::y_off);
+  header.x_advance = add_float(&GlyphMetrics::x_advance);
+  std::vector<uint32_t> widths;
+  std::vector<uint32_t> heights;
+  for (const auto& page : pages) {
+    widths.push_back(page.width);
+    heights.push_back(page.height);
+  }
+  header.page_width = add_array(widths.data(), widths.size() * sizeof(uint32_t));
+  header.page_height = add_array(heights.data(), heights.size() * sizeof(uint32_t));
+  memcpy(data.data(), &header, sizeof(header));
+
+  FILE* fp = fopen(filename.c_str(), "wb");
+  if (!fp) {
+    return false;
+  }
+  const bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+  return fclose(fp) == 0 && ok;
+}
+
+// Row y of page with channels bytes per pixel. 1 channel pages are
+// expanded to debug_color with the coverage in alpha when channels is 4,
+// --msdf pages are BGRA and come out RGBA.
+void GetAtlasRow(const AtlasPage& page, const Options& opt, int channels, int y, unsigned char* row) {
+  const unsigned char* src = page.pixels.data() + (size_t)y * page.width * page.channels;
+  if (page.channels == 4) {
+    for (int x = 0; x < page.width; ++x, src += 4, row += 4) {
+      row[0] = src[2];
+      row[1] = src[1];
+      row[2] = src[0];
+      row[3] = src[3];
+    }
+  } else if (channels == 1) {
+    memcpy(row, src, page.width);
+  } else {
+    for (int x = 0; x < page.width; ++x, row += 4) {
+      const int alpha = src[x];
+      row[0] = alpha ? opt.debug_color[0] : 0;
+      row[1] = alpha ? opt.debug_color[1] : 0;
+      row[2] = alpha ? opt.debug_color[2] : 0;
+      row[3] = alpha;
+    }
+  }
+}
+
+int64_t FileBytes(const std::string& filename) {
+  std::error_code ec;
+  const uintmax_t size = std::experimental::filesystem::file_size(filename, ec);
+  return ec ? 0 : (int64_t)size;
+}
+
+// What --profile reports, each atlas adds itself once it's done
+struct ProfiledAtlas {
+  std::string out_name;
+  std::string font_filename;
+  float font_size;
+  bool succeeded;
+  Stats stats;
+};
+
+std::mutex profile_mutex;
+std::vector<ProfiledAtlas> profiled_atlases;
+
+void AddToProfile(const Options& opt, const Stats& stats, bool succeeded) {
+  if (opt.profile.empty() && opt.profile_trace.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(profile_mutex);
+  profiled_atlases.push_back({ opt.out_name, opt.font_filename, opt.font_size, succeeded, stats });
+  // worker threads' stages were appended after the stage that ran them
+  std::vector<StageTime>& stages = profiled_atlases.back().stats.stages;
+  std::stable_sort(stages.begin(), stages.end(), [](const StageTime& a, const StageTime& b) {
+    return a.start_ms < b.start_ms;
+  });
+}
+
+// Writes the --profile report and --profile-trace trace of every atlas
+// added with AddToProfile. start_ms and start_cpu_ms are from when the
+// process started working.
+bool WriteProfile(const Options& opt, double start_ms, double start_cpu_ms) {
+  const double total_wall_ms = NowMs() - start_ms;
+  const double total_cpu_ms = CpuMs(false) - start_cpu_ms;
+  std::lock_guard<std::mutex> lock(profile_mutex);
+
+  if (!opt.profile.empty()) {
+    printf("write profile: %s\n", opt.profile.c_str());
+    FILE* fp = fopen(opt.profile.c_str(), "wb");
+    if (!fp) {
+      fprintf(stderr, "error: couldn't write %s\n", opt.profile.c_str());
+      return false;
+    }
+    fprintf(fp, "{\n  \"version\": 1,\n  \"wallMs\": %.3f,\n  \"cpuMs\": %.3f,\n  \"atlases\": [\n", total_wall_ms, total_cpu_ms);
+    for (size_t a = 0; a < profiled_atlases.size(); ++a) {
+      const ProfiledAtlas& atlas = profiled_atlases[a];
+      const Stats& stats = atlas.stats;
+      fprintf(fp, "    {\n      \"outputName\": %s,\n      \"font\": %s,\n      \"fontSize\": %g,\n      \"succeeded\": %s,\n",
+              json_string(atlas.out_name).c_str(), json_string(atlas.font_filename).c_str(), atlas.font_size,
+              atlas.succeeded ? "true" : "false");
+      fprintf(fp, "      \"stages\": [\n");
+      for (size_t i = 0; i < stats.stages.size(); ++i) {
+        const StageTime& stage = stats.stages[i];
+        fprintf(fp, "        { \"name\": %s, \"startMs\": %.3f, \"wallMs\": %.3f, \"cpuMs\": %.3f }%s\n",
+                json_string(stage.name).c_str(), stage.start_ms - start_ms, stage.wall_ms, stage.cpu_ms,
+                i == stats.stages.size() - 1 ? "" : ",");
+      }
+      fprintf(fp, "      ],\n");
+      fprintf(fp, R"(      "counters": {
+        "codepoints": %d,
+        "codepointsMissing": %d,
+        "glyphsRendered": %d,
+        "glyphsCached": %d,
+        "glyphsCacheMissed": %d,
+        "threads": %d,
+        "loadHintMs": %.3f,
+        "renderMs": %.3f,
+        "packAttempts": %d,
+        "pages": %d,
+        "atlasWidth": %d,
+        "atlasHeight": %d,
+        "bytesWritten": %lld
+      }
+    }%s
+)",
+              stats.codepoints,
+              stats.codepoints_missing,
+              stats.glyphs_rendered,
+              stats.glyphs_cached,
+              stats.glyphs_cache_missed,
+              stats.threads,
+              stats.load_ms,
+              stats.render_ms,
+              stats.pack_attempts,
+              stats.pages,
+              stats.atlas_width,
+              stats.atlas_height,
+              (long long)stats.bytes_written,
+              a == profiled_atlases.size() - 1 ? "" : ",");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+  }
+
+  if (!opt.profile_trace.empty()) {
+    printf("write profile trace: %s\n", opt.profile_trace.c_str());
+    FILE* fp = fopen(opt.profile_trace.c_str(), "wb");
+    if (!fp) {
+      fprintf(stderr, "error: couldn't write %s\n", opt.profile_trace.c_str());
+      return false;
+    }
+    // small thread numbers in the order threads were first seen
+    std::map<std::thread::id, int> thread_numbers;
+    fprintf(fp, "{\"traceEvents\":[\n");
+    bool first = true;
+    for (const auto& atlas : profiled_atlases) {
+      for (const auto& stage : atlas.stats.stages) {
+        auto it = thread_numbers.insert(std::make_pair(stage.thread, (int)thread_numbers.size())).first;
+        fprintf(fp, "%s{\"name\":%s,\"cat\":%s,\"ph\":\"X\",\"ts\":%.1f,\"dur\":%.1f,\"pid\":1,\"tid\":%d,\"args\":{\"cpuMs\":%.3f}}",
+                first ? "" : ",\n", json_string(stage.name).c_str(), json_string(atlas.out_name).c_str(),
+                (stage.start_ms - start_ms) * 1000.0, stage.wall_ms * 1000.0, it->second, stage.cpu_ms);
+        first = false;
+      }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+  }
+  return true;
+}
+
+// Walks the font's charmap once and keeps the codepoints in opt.ranges the
+// font has a glyph for. ranges gets the kept codepoints and glyph_indices
+// their glyphs, in codepoint order. The codepoints the font doesn't have
+// are reported in one warning. Returns false if none are left.
+bool MapCodepoints(FT_Face face, const Options& opt, std::vector<Range>* ranges, std::vector<FT_UInt>* glyph_indices, Stats* stats) {
+  StageTimer timer(stats, "cmap");
+  CodepointSet wanted;
+  for (const auto& range : opt.ranges) {
+    wanted.AddRange(range.start, range.end);
+  }
+
+  CodepointSet found;
+  std::vector<std::pair<int, FT_UInt>> mapping;
+  FT_UInt glyph_index;
+  FT_ULong charcode = FT_Get_First_Char(face, &glyph_index);
+  while (glyph_index) {
+    if (charcode < (FT_ULong)CodepointSet::kNumCodepoints && wanted.Contains((int)charcode)) {
+      found.Add((int)charcode);
+      mapping.push_back(std::make_pair((int)charcode, glyph_index));
+    }
+    charcode = FT_Get_Next_Char(face, charcode, &glyph_index);
+  }
+  // unicode cmaps iterate in order but nothing promises it
+  if (!std::is_sorted(mapping.begin(), mapping.end())) {
+    std::sort(mapping.begin(), mapping.end());
+  }
+
+  CodepointSet missing = wanted;
+  missing.Subtract(found);
+  std::vector<Range> missing_ranges;
+  missing.GetRanges(&missing_ranges);
+  if (!missing_ranges.empty()) {
+    int num_missing = 0;
+    for (const auto& range : missing_ranges) {
+      num_missing += range.end - range.start + 1;
+    }
+    const size_t max_listed = opt.verbose ? missing_ranges.size() : 16;
+    std::string list;
+    for (size_t i = 0; i < missing_ranges.size() && i < max_listed; ++i) {
+      char buf[32];
+      const Range& range = missing_ranges[i];
+      if (range.start == range.end) {
+        snprintf(buf, sizeof(buf), "%s0x%x", i ? ", " : "", range.start);
+      } else {
+        snprintf(buf, sizeof(buf), "%s0x%x-0x%x", i ? ", " : "", range.start, range.end);
+      }
+      list += buf;
+    }
+    if (missing_ranges.size() > max_listed) {
+      list += ", ... (--verbose lists them all)";
+    }
+    fprintf(stderr, "warn: no glyph for %d of %d codepoints: %s\n",
+            num_missing, num_missing + (int)mapping.size(), list.c_str());
+    stats->codepoints_missing = num_missing;
+  }
+  stats->codepoints = (int)mapping.size();
+
+  if (mapping.empty()) {
+    fprintf(stderr, "error: %s has none of the codepoints asked for\n", opt.font_filename.c_str());
+    return false;
+  }
+  found.GetRanges(ranges);
+  glyph_indices->clear();
+  glyph_indices->reserve(mapping.size());
+  for (const auto& pair : mapping) {
+    glyph_indices->push_back(pair.second);
+  }
+  return true;
+}
+
+// The bitmap strike made for opt's size, or -1. Dot fonts have these and
+// they're exact where rendering the outline, oversampled or not, blurs.
+// Matches the way FreeType picks a strike in FT_Set_Char_Size, to the
+// nearest pixel, so once the size is set without oversampling
+// FT_Load_Glyph loads the strike's bitmaps instead of the outlines.
+int FindStrike(FT_Face face, const Options& opt) {
+  if (opt.sdf || opt.msdf || !FT_HAS_FIXED_SIZES(face)) {
+    return -1;
+  }
+  // at 72 dpi points are pixels
+  const FT_Pos ppem = (FT_Pos)(opt.font_size * 64.0f + 0.5f);
+  const FT_Pos pixels = (ppem + 32) & ~63;
+  for (int i = 0; i < face->num_fixed_sizes; ++i) {
+    const FT_Bitmap_Size& size = face->available_sizes[i];
+    if (((size.y_ppem + 32) & ~63) == pixels && ((size.x_ppem + 32) & ~63) == pixels) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Generates the .png and .json for one atlas. face must already be set to
+// the size in opt. font_hash is 0 unless --cache-dir, --font-cache-dir or
+// --previous-atlas needed it, see NeedsFontHash. stats may
+// already have stages from opening the face.
+bool GenerateAtlas(FT_Face face, const Options& requested, uint64_t font_hash, Stats* stats) {
+  printf("font: %s\n", requested.font_filename.c_str());
+  const int strike = FindStrike(face, requested);
+  if (requested.verbose) {
+    printf("  num glyphs: %d\n", face->num_glyphs);
+    printf("  num fixed sizes: %d\n", face->num_fixed_sizes);
+    for (int i = 0; i < face->num_fixed_sizes; ++i) {
+      const FT_Bitmap_Size& size = face->available_sizes[i];
+      printf("    %d: %d x %d%s\n", i, size.width, size.height, i == strike ? " (used)" : "");
+    }
+  }
+
+  // With a matching strike there's nothing to oversample. Its MONO bitmaps
+  // go through DownsampleGlyph's unpack table at 1:1.
+  Options opt = requested;
+  if (strike >= 0 && opt.oversample != 1) {
+    if (opt.verbose) {
+      printf("  using the %d px bitmap strike, ignoring --oversample %d\n", (int)((face->available_sizes[strike].y_ppem + 32) >> 6), opt.oversample);
+    }
+    opt.oversample = 1;
+    SetFaceSize(face, opt);
+  }
+
+  // only codepoints the font has from here on
+  std::vector<Range> font_ranges;
+  std::vector<FT_UInt> glyph_indices;
+  if (!MapCodepoints(face, opt, &font_ranges, &glyph_indices, stats)) {
+    return false;
+  }
+
+  const int total_chars = (int)glyph_indices.size();
+  std::vector<stbtt_packedchar> chardata_for_range(total_chars);
+  std::vector<stbtt_pack_range> ranges(font_ranges.size());
+  int dst_ndx = 0;
+  for (size_t i = 0; i < font_ranges.size(); ++i) {
+    const auto& range = font_ranges[i];
+    auto& pack_range = ranges[i];
+
+    pack_range.font_size = opt.font_size;
+    pack_range.first_unicode_codepoint_in_range = range.start;
+    pack_range.array_of_unicode_codepoints = NULL;
+    pack_range.num_chars = range.end - range.start + 1;
+    pack_range.chardata_for_range = &chardata_for_range[dst_ndx];
+    dst_ndx += pack_range.num_chars;
+  }
+
+  // printf("pack font: %s\n", opt.font_filename.c_str());
+
+  GlyphCache glyph_cache;
+  GlyphCache* cache = NULL;
+  if (!opt.cache_dir.empty()) {
+    std::error_code ec;
+    std::experimental::filesystem::create_directories(opt.cache_dir, ec);
+    StageTimer timer(stats, "load glyph cache");
+    LoadGlyphCache(CachePath(opt, GlyphCacheKey(font_hash, opt), ".glyphs"), &glyph_cache);
+    cache = &glyph_cache;
+  }
+
+  const uint64_t font_fingerprint = FontFingerprint(opt);
+  stbtt_pack_context context = {};
+  std::vector<AtlasPage> pages;
+  std::vector<int> glyph_pages;
+  if (!PackFontRanges(&context, face, ranges.data(), ranges.size(), glyph_indices, opt, font_hash, font_fingerprint, &pages, &glyph_pages, cache, stats)) {
+    fprintf(stderr, "error packing font: %s\n", opt.font_filename.c_str());
+    return false;
+  }
+
+  if (cache && opt.verbose) {
+    printf("glyph cache: %d hits, %d misses\n", stats->glyphs_cached, stats->glyphs_cache_missed);
+  }
+  if (cache && cache->dirty) {
+    StageTimer timer(stats, "save glyph cache");
+    SaveGlyphCache(*cache);
+  }
+
+  if (opt.stats) {
+    PrintStats(*stats);
+  }
+
+  // printf("end pack font: %s\n", opt.out_name.c_str());
+
+  std::vector<std::string> atlas_filenames;
+  for (size_t p = 0; p < pages.size(); ++p) {
+    const AtlasPage& page = pages[p];
+    std::string atlas_filename = PageFilename(opt, (int)p);
+    atlas_filenames.push_back(atlas_filename);
+
+    printf("write font atlas: %s\n", atlas_filename.c_str());
+
+    // rows are converted as the writer asks for them so there's never a
+    // second copy of the whole atlas
+    const int channels = page.channels == 4 || opt.output_format == kOutputRGBA ? 4 : 1;
+    const PngRowFunc get_row = [&](int y, unsigned char* row) {
+      GetAtlasRow(page, opt, channels, y, row);
+    };
+    if (opt.benchmark_png) {
+      std::vector<unsigned char> image(page.width * page.height * channels);
+      for (int y = 0; y < page.height; ++y) {
+        get_row(y, image.data() + y * page.width * channels);
+      }
+      BenchmarkPng(page.width, page.height, channels, image, opt);
+    }
+    StageTimer write_timer(stats, "write atlas");
+    bool written = false;
+    switch (opt.output_format) {
+      case kOutputRGBA:
+      case kOutputGray8:
+        written = WritePng(atlas_filename, page.width, page.height, channels, get_row, opt);
+        break;
+      case kOutputRaw:
+        written = WriteRaw(atlas_filename, page.width, page.height, channels, get_row);
+        break;
+      case kOutputKTX:
+        written = WriteKtx(atlas_filename, page.width, page.height, channels, get_row);
+        break;
+      default:
+        break;
+    }
+    if (!written) {
+      fprintf(stderr, "error: couldn't write %s\n", atlas_filename.c_str());
+      return false;
+    }
+    write_timer.Stop();
+    stats->bytes_written += FileBytes(atlas_filename);
+  }
+
+  int baseline = 0;
+#if 0
+  {
+    stbtt_fontinfo font;
+    stbtt_InitFont(&font, font_data.data(), 0);
+
+    const float scale = stbtt_ScaleForPixelHeight(&font, opt.font_size);
+    int ascent;
+    stbtt_GetFontVMetrics(&font, &ascent, 0, 0);
+    baseline = (int)(ascent * scale) + opt.y_offset;
+  }
+#endif
+
+  // the .json and .bin are both written from this
+  std::vector<GlyphMetrics> metrics;
+  metrics.reserve(total_chars);
+  int ndx = 0;
+  for (const auto& pack_range : ranges) {
+    for (int i = 0; i < pack_range.num_chars; ++i, ++ndx) {
+      const stbtt_packedchar& packed_char = pack_range.chardata_for_range[i];
+      GlyphMetrics m;
+      m.codepoint = pack_range.first_unicode_codepoint_in_range + i;
+      m.page = glyph_pages[ndx];
+      m.x = packed_char.x0;
+      m.y = packed_char.y0;
+      m.w = packed_char.x1 - packed_char.x0 + 1;
+      m.h = packed_char.y1 - packed_char.y0 + 1;
+      m.x_off = packed_char.xoff;
+      m.y_off = packed_char.yoff;
+      m.x_advance = packed_char.xadvance;
+      m.x_off2 = packed_char.xoff2;
+      m.y_off2 = packed_char.yoff2;
+      metrics.push_back(m);
+    }
+  }
+
+  std::string json_filename = std::string(opt.out_name) + ".json";
+
+  printf("write font data: %s\n", json_filename.c_str());
+
+  StageTimer json_timer(stats, "write json");
+  FILE* file = fopen(json_filename.c_str(), "wb");
+  fprintf(file, R"({
+  "font": %s,
+  "fontSize": %g,
+  "fontIndex": %d,
+  "baseline": %d,
+  "yOffset": %d,
+  "oversample": %d,
+  "padding": %d,
+  "light": %s,
+  "glyphHeight": %d,
+  "fontFingerprint": "%016llx",
+  "atlasWidth": %d,
+  "atlasHeight": %d,
+  "atlas": %s,
+)", json_string(opt.font_filename).c_str(),
+    opt.font_size,
+    opt.font_index,
+    baseline,
+    opt.y_offset,
+    opt.oversample,
+    opt.padding,
+    opt.light ? "true" : "false",
+    opt.glyph_height,
+    (unsigned long long)font_fingerprint,
+    pages[0].width,
+    pages[0].height,
+    json_string(atlas_filenames[0]).c_str());
+  if (font_hash) {
+    fprintf(file, "  \"fontHash\": \"%016llx\",\n", (unsigned long long)font_hash);
+  }
+  if (opt.output_format != kOutputRGBA) {
+    fprintf(file, "  \"atlasFormat\": %s,\n", json_string(output_format_names[opt.output_format]).c_str());
+  }
+  if (opt.sdf || opt.msdf) {
+    fprintf(file, "  \"distanceField\": { \"type\": \"%s\", \"spread\": %d },\n", opt.msdf ? "msdf" : "sdf", opt.sdf_spread);
+  }
+  if (opt.max_page_size) {
+    fprintf(file, "  \"pages\": [\n");
+    for (size_t p = 0; p < pages.size(); ++p) {
+      fprintf(file, "    { \"atlas\": %s, \"atlasWidth\": %d, \"atlasHeight\": %d }%s\n",
+              json_string(atlas_filenames[p]).c_str(),
+              pages[p].width,
+              pages[p].height,
+              p == pages.size() - 1 ? "" : ",");
+    }
+    fprintf(file, "  ],\n");
+  }
+  fprintf(file, "  \"glyphs\": [\n");
+
+  for (size_t i = 0; i < metrics.size(); ++i) {
+    const GlyphMetrics& m = metrics[i];
+    fprintf(file, "    {\n");
+    if (opt.max_page_size) {
+      fprintf(file, "      \"page\": %d,\n", m.page);
+    }
+    fprintf(file, R"(      "codePoint": %d,
+      "tex": { "x": %d, "y": %d, "w": %d, "h": %d },
+      "xOff": %g,
+      "yOff": %g,
+      "xAdvance": %g,
+      "xOff2": %g,
+      "yOff2": %g
+    }%s
+)",
+            m.codepoint,
+            m.x,
+            m.y,
+            m.w,
+            m.h,
+            m.x_off,
+            m.y_off,
+            m.x_advance,
+            m.x_off2,
+            m.y_off2,
+            i == metrics.size() - 1 ? "" : ",");
+  }
+  fprintf(file, R"(  ]
+}
+)");
+
+  fclose(file);
+  json_timer.Stop();
+  stats->bytes_written += FileBytes(json_filename);
+
+  if (opt.metrics_bin) {
+    std::string bin_filename = opt.out_name + ".bin";
+    printf("write font data: %s\n", bin_filename.c_str());
+    StageTimer timer(stats, "write bin");
+    if (!WriteMetricsBin(bin_filename, metrics, pages, baseline, opt)) {
+      fprintf(stderr, "error: couldn't write %s\n", bin_filename.c_str());
+      return false;
+    }
+    timer.Stop();
+    stats->bytes_written += FileBytes(bin_filename);
+  }
+
+  if (!opt.cache_dir.empty()) {
+    // under the options RestoreAtlasFromCache will look for, not the ones
+    // a bitmap strike changed
+    StageTimer timer(stats, "save atlas cache");
+    SaveAtlasToCache(requested, font_hash, (int)pages.size());
+  }
+
+  return true;
+}
+
+// Peak resident memory of the process in bytes since the last
+// ResetPeakRss, or since it started where that can't be reset.
+int64_t PeakRssBytes() {
+#if defined(_WIN32)
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+    return 0;
+  }
+  return (int64_t)counters.PeakWorkingSetSize;
+#elif defined(__linux__)
+  FILE* fp = fopen("/proc/self/status", "rb");
+  if (!fp) {
+    return 0;
+  }
+  char line[256];
+  long long kb = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "VmHWM: %lld kB", &kb) == 1) {
+      break;
+    }
+  }
+  fclose(fp);
+  return kb * 1024;
+#else
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (int64_t)usage.ru_maxrss;  // bytes on macOS
+#endif
+}
+
+// Returns false where the peak can't be reset, like Windows, and then
+// PeakRssBytes is the peak of the whole run so far.
+bool ResetPeakRss() {
+#if defined(__linux__)
+  FILE* fp = fopen("/proc/self/clear_refs", "wb");
+  if (!fp) {
+    return false;
+  }
+  const bool reset = fputs("5", fp) >= 0;
+  return fclose(fp) == 0 && reset;
+#else
+  return false;
+#endif
+}
+
+struct BenchmarkSet {
+  const char* name;
+  int start;
+  int count;
+};
+
+const BenchmarkSet benchmark_sets[] = {
+  { "ascii", 0x20, 95 },
+  { "kana", 0x3040, 192 },
+  { "cjk-2k", 0x4E00, 2000 },
+  { "cjk-6k", 0x4E00, 6000 },
+};
+
+// The benchmarks run on a TrueType font made up here when --font doesn't
+// have a set, so every case always runs on the same glyphs. It has a glyph
+// for every codepoint in benchmark_sets, each one different: a frame with
+// some bars across it and a round blob, so there are holes and quadratic
+// curves like in a real font. Latin glyphs vary in width and some have descenders,
+// the rest are near full width squares like kana and kanji.
+struct SyntheticPoint {
+  int x;
+  int y;
+  bool on_curve;
+};
+
+typedef std::vector<SyntheticPoint> SyntheticContour;
+
+struct SyntheticGlyph {
+  int advance = 0;
+  int x_min = 0;
+  int y_min = 0;
+  int x_max = 0;
+  int y_max = 0;
+  std::vector<SyntheticContour> contours;
+};
+
+const int kSyntheticUnitsPerEm = 1000;
+
+uint64_t SyntheticMix(uint64_t v) {
+  v += 0x9E3779B97F4A7C15ULL;
+  v = (v ^ (v >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  v = (v ^ (v >> 27)) * 0x94D049BB133111EBULL;
+  return v ^ (v >> 31);
+}
+
+// clockwise, so filled, unless hole
+SyntheticContour SyntheticRect(int x0, int y0, int x1, int y1, bool hole) {
+  SyntheticContour c = { { x0, y0, true }, { x0, y1, true }, { x1, y1, true }, { x1, y0, true } };
+  if (hole) {
+    std::reverse(c.begin(), c.end());
+  }
+  return c;
+}
+
+SyntheticGlyph MakeSyntheticGlyph(int codepoint) {
+  SyntheticGlyph g;
+  const uint64_t h = SyntheticMix(codepoint);
+  const bool latin = codepoint < 0x100;
+  const int width = latin ? 200 + (int)(h % 500) : 800 + (int)(h % 150);
+  g.x_min = latin ? 40 : 60;
+  g.x_max = g.x_min + width;
+  g.y_min = latin ? ((h >> 16) % 3 == 0 ? -200 : 0) : -100 + (int)((h >> 16) % 50);
+  g.y_max = latin ? 500 + (int)((h >> 20) % 250) : 750 + (int)((h >> 20) % 100);
+  g.advance = g.x_max + g.x_min;
+  if (codepoint == 0x20) {
+    g.x_min = g.y_min = g.x_max = g.y_max = 0;
+    return g;
+  }
+
+  const int t = latin ? 60 : 50;  // stroke width
+  g.contours.push_back(SyntheticRect(g.x_min, g.y_min, g.x_max, g.y_max, false));
+  g.contours.push_back(SyntheticRect(g.x_min + t, g.y_min + t, g.x_max - t, g.y_max - t, true));
+  const int w = g.x_max - g.x_min;
+  const int hgt = g.y_max - g.y_min;
+  for (int i = 0; i < 6; ++i) {
+    if (!((h >> (24 + i)) & 1)) {
+      continue;
+    }
+    const int at = (i % 3 + 1) * 25;  // percent across
+    if (i < 3) {
+      const int y = g.y_min + hgt * at / 100;
+      g.contours.push_back(SyntheticRect(g.x_min, y, g.x_max, y + t, false));
+    } else {
+      const int x = g.x_min + w * at / 100;
+      g.contours.push_back(SyntheticRect(x, g.y_min, x + t, g.y_max, false));
+    }
+  }
+  // only off curve points, the on curve ones are implied half way between
+  const int r = std::min(w, hgt) / 4;
+  const int cx = g.x_min + t + r + (int)((h >> 32) % std::max(1, w - 2 * (t + r)));
+  const int cy = g.y_min + t + r + (int)((h >> 40) % std::max(1, hgt - 2 * (t + r)));
+  g.contours.push_back({ { cx - r, cy, false }, { cx, cy + r, false }, { cx + r, cy, false }, { cx, cy - r, false } });
+  return g;
+}
+
+void PutU16(std::vector<unsigned char>* v, int n) {
+  v->push_back((unsigned char)(n >> 8));
+  v->push_back((unsigned char)n);
+}
+
+void PutU32(std::vector<unsigned char>* v, uint32_t n) {
+  PutU16(v, (int)(n >> 16));
+  PutU16(v, (int)(n & 0xFFFF));
+}
+
+uint32_t TableChecksum(const std::vector<unsigned char>& table) {
+  uint32_t sum = 0;
+  for (size_t i = 0; i < table.size(); i += 4) {
+    uint32_t word = 0;
+    for (size_t j = 0; j < 4; ++j) {
+      word = word << 8 | (i + j < table.size() ? table[i + j] : 0);
+    }
+    sum += word;
+  }
+  return sum;
+}
+
+bool WriteSyntheticFont(const std::string& filename) {
+  // glyph 0 is .notdef, then each set's codepoints in order
+  std::vector<int> codepoints;
+  for (const auto& set : benchmark_sets) {
+    for (int c = set.start; c < set.start + set.count; ++c) {
+      if (codepoints.empty() || c > codepoints.back()) {
+        codepoints.push_back(c);
+      }
+    }
+  }
+  std::vector<SyntheticGlyph> glyphs(1);
+  glyphs[0].advance = kSyntheticUnitsPerEm / 2;
+  for (const int c : codepoints) {
+    glyphs.push_back(MakeSyntheticGlyph(c));
+  }
+  const int num_glyphs = (int)glyphs.size();
+
+  std::vector<unsigned char> glyf, loca, hmtx;
+  int max_points = 0;
+  int max_contours = 0;
+  int max_advance = 0;
+  int x_min = 0, y_min = 0, x_max = 0, y_max = 0;
+  for (const auto& g : glyphs) {
+    PutU32(&loca, (uint32_t)glyf.size());
+    PutU16(&hmtx, g.advance);
+    PutU16(&hmtx, g.x_min);
+    max_advance = std::max(max_advance, g.advance);
+    if (g.contours.empty()) {
+      continue;
+    }
+    x_min = std::min(x_min, g.x_min);
+    y_min = std::min(y_min, g.y_min);
+    x_max = std::max(x_max, g.x_max);
+    y_max = std::max(y_max, g.y_max);
+    PutU16(&glyf, (int)g.contours.size());
+    PutU16(&glyf, g.x_min);
+    PutU16(&glyf, g.y_min);
+    PutU16(&glyf, g.x_max);
+    PutU16(&glyf, g.y_max);
+    int num_points = 0;
+    for (const auto& c : g.contours) {
+      num_points += (int)c.size();
+      PutU16(&glyf, num_points - 1);
+    }
+    PutU16(&glyf, 0);  // no instructions
+    // every coordinate as a 16 bit delta so the only flag is on curve
+    for (const auto& c : g.contours) {
+      for (const auto& p : c) {
+        glyf.push_back(p.on_curve ? 1 : 0);
+      }
+    }
+    int last = 0;
+    for (const auto& c : g.contours) {
+      for (const auto& p : c) {
+        PutU16(&glyf, p.x - last);
+        last = p.x;
+      }
+    }
+    last = 0;
+    for (const auto& c : g.contours) {
+      for (const auto& p : c) {
+        PutU16(&glyf, p.y - last);
+        last = p.y;
+      }
+    }
+    while (glyf.size() % 4) {
+      glyf.push_back(0);
+    }
+    max_points = std::max(max_points, num_points);
+    max_contours = std::max(max_contours, (int)g.contours.size());
+  }
+  PutU32(&loca, (uint32_t)glyf.size());
+
+  std::vector<unsigned char> head;
+  PutU32(&head, 0x00010000);  // version
+  PutU32(&head, 0x00010000);  // fontRevision
+  PutU32(&head, 0);           // checkSumAdjustment
+  PutU32(&head, 0x5F0F3CF5);  // magicNumber
+  PutU16(&head, 3);           // flags: baseline and left side bearing at 0
+  PutU16(&head, kSyntheticUnitsPerEm);
+  for (int i = 0; i < 4; ++i) {
+    PutU32(&head, 0);  // created and modified
+  }
+  PutU16(&head, x_min);
+  PutU16(&head, y_min);
+  PutU16(&head, x_max);
+  PutU16(&head, y_max);
+  PutU16(&head, 0);  // macStyle
+  PutU16(&head, 8);  // lowestRecPPEM
+  PutU16(&head, 2);  // fontDirectionHint
+  PutU16(&head, 1);  // indexToLocFormat, 32 bit
+  PutU16(&head, 0);  // glyphDataFormat
+
+  std::vector<unsigned char> hhea;
+  PutU32(&hhea, 0x00010000);
+  PutU16(&hhea, 900);   // ascender
+  PutU16(&hhea, -250);  // descender
+  PutU16(&hhea, 0);     // lineGap
+  PutU16(&hhea, max_advance);
+  PutU16(&hhea, 0);      // minLeftSideBearing
+  PutU16(&hhea, 0);      // minRightSideBearing
+  PutU16(&hhea, x_max);  // xMaxExtent
+  PutU16(&hhea, 1);      // caretSlopeRise
+  for (int i = 0; i < 7; ++i) {
+    PutU16(&hhea, 0);  // caretSlopeRun, caretOffset, reserved
+  }
+  PutU16(&hhea, 0);  // metricDataFormat
+  PutU16(&hhea, num_glyphs);
+
+  std::vector<unsigned char> maxp;
+  PutU32(&maxp, 0x00010000);
+  PutU16(&maxp, num_glyphs);
+  PutU16(&maxp, max_points);
+  PutU16(&maxp, max_contours);
+  PutU16(&maxp, 0);  // maxCompositePoints
+  PutU16(&maxp, 0);  // maxCompositeContours
+  PutU16(&maxp, 2);  // maxZones
+  for (int i = 0; i < 8; ++i) {
+    PutU16(&maxp, 0);  // no hinting
+  }
+
+  // one format 12 subtable, a group per run of consecutive codepoints
+  std::vector<std::pair<int, int>> groups;  // first codepoint, count
+  for (const int c : codepoints) {
+    if (!groups.empty() && groups.back().first + groups.back().second == c) {
+      ++groups.back().second;
+    } else {
+      groups.push_back(std::make_pair(c, 1));
+    }
+  }
+  std::vector<unsigned char> cmap;
+  PutU16(&cmap, 0);  // version
+  PutU16(&cmap, 1);  // numTables
+  PutU16(&cmap, 3);  // Windows
+  PutU16(&cmap, 10);  // Unicode full repertoire
+  PutU32(&cmap, 12);  // offset
+  PutU16(&cmap, 12);  // format
+  PutU16(&cmap, 0);
+  PutU32(&cmap, 16 + 12 * (uint32_t)groups.size());
+  PutU32(&cmap, 0);  // language
+  PutU32(&cmap, (uint32_t)groups.size());
+  int glyph_id = 1;
+  for (const auto& group : groups) {
+    PutU32(&cmap, group.first);
+    PutU32(&cmap, group.first + group.second - 1);
+    PutU32(&cmap, glyph_id);
+    glyph_id += group.second;
+  }
+
+  // tables in tag order
+  const std::pair<const char*, const std::vector<unsigned char>*> tables[] = {
+    { "cmap", &cmap }, { "glyf", &glyf }, { "head", &head }, { "hhea", &hhea },
+    { "hmtx", &hmtx }, { "loca", &loca }, { "maxp", &maxp },
+  };
+  const int num_tables = (int)(sizeof(tables) / sizeof(tables[0]));
+  std::vector<unsigned char> font;
+  PutU32(&font, 0x00010000);
+  PutU16(&font, num_tables);
+  PutU16(&font, 64);  // searchRange for 7 tables
+  PutU16(&font, 2);   // entrySelector
+  PutU16(&font, num_tables * 16 - 64);
+  uint32_t offset = 12 + 16 * num_tables;
+  for (const auto& table : tables) {
+    font.insert(font.end(), table.first, table.first + 4);
+    PutU32(&font, TableChecksum(*table.second));
+    PutU32(&font, offset);
+    PutU32(&font, (uint32_t)table.second->size());
+    offset += ((uint32_t)table.second->size() + 3) & ~3u;
+  }
+  for (const auto& table : tables) {
+    font.insert(font.end(), table.second->begin(), table.second->end());
+    while (font.size() % 4) {
+      font.push_back(0);
+    }
+  }
+
+  FILE* fp = fopen(filename.c_str(), "wb");
+  if (!fp) {
+    fprintf(stderr, "error: couldn't write %s\n", filename.c_str());
+    return false;
+  }
+  const bool wrote = fwrite(font.data(), 1, font.size(), fp) == font.size();
+  fclose(fp);
+  return wrote;
+}
+
+const int kBenchmarkRuns = 3;
+
+double StageMs(const Stats& stats, const char* name) {
+  double ms = 0.0;
+  for (const auto& stage : stats.stages) {
+    if (!strcmp(stage.name, name)) {
+      ms += stage.wall_ms;
+    }
+  }
+  return ms;
+}
+
+// Sends stdout nowhere and stderr to a file until Finish, so what the
+// pipeline prints doesn't end up in the middle of the benchmark table.
+// Finish returns what was written to stderr.
+struct QuietOutput {
+  explicit QuietOutput(const std::string& stderr_filename) : filename(stderr_filename) {
+    fflush(stdout);
+    fflush(stderr);
+#ifdef _WIN32
+    saved_stdout = _dup(_fileno(stdout));
+    saved_stderr = _dup(_fileno(stderr));
+    const int null_fd = _open("NUL", _O_WRONLY);
+    const int err_fd = _open(filename.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC, _S_IREAD | _S_IWRITE);
+    _dup2(null_fd, _fileno(stdout));
+    _dup2(err_fd, _fileno(stderr));
+    _close(null_fd);
+    _close(err_fd);
+#else
+    saved_stdout = dup(STDOUT_FILENO);
+    saved_stderr = dup(STDERR_FILENO);
+    const int null_fd = open("/dev/null", O_WRONLY);
+    const int err_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(err_fd, STDERR_FILENO);
+    close(null_fd);
+    close(err_fd);
+#endif
+  }
+  ~QuietOutput() {
+    Finish();
+  }
+  std::string Finish() {
+    if (saved_stdout < 0) {
+      return std::string();
+    }
+    fflush(stdout);
+    fflush(stderr);
+#ifdef _WIN32
+    _dup2(saved_stdout, _fileno(stdout));
+    _dup2(saved_stderr, _fileno(stderr));
+    _close(saved_stdout);
+    _close(saved_stderr);
+#else
+    dup2(saved_stdout, STDOUT_FILENO);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stdout);
+    close(saved_stderr);
+#endif
+    saved_stdout = saved_stderr = -1;
+    std::vector<unsigned char> data;
+    FILE* fp = fopen(filename.c_str(), "rb");
+    if (fp) {
+      unsigned char buf[4096];
+      size_t n;
+      while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        data.insert(data.end(), buf, buf + n);
+      }
+      fclose(fp);
+    }
+    return std::string(data.begin(), data.end());
+  }
+
+  std::string filename;
+  int saved_stdout = -1;
+  int saved_stderr = -1;
+};
+
+// The last "error:" line of output without the prefix, or its last line
+std::string LastError(const std::string& output) {
+  std::string last;
+  std::string last_error;
+  size_t start = 0;
+  while (start < output.size()) {
+    size_t end = output.find('\n', start);
+    if (end == std::string::npos) {
+      end = output.size();
+    }
+    const std::string line = output.substr(start, end - start);
+    if (!line.empty()) {
+      last = line;
+      if (!line.compare(0, 7, "error: ")) {
+        last_error = line.substr(7);
+      }
+    }
+    start = end + 1;
+  }
+  return !last_error.empty() ? last_error : !last.empty() ? last : "failed";
+}
+
+// --benchmark-suite: runs the whole pipeline, from opening the face to
+// writing the .json, for each glyph set and option combination, best of
+// kBenchmarkRuns, and writes the results to opt.benchmark_suite. Cases and
+// keys are always in the same order so reports from two commits can be
+// diffed. Sets --font has none of, or all of them without --font, run on
+// the synthetic font. Failures are reported with their error and make it
+// return false.
+bool RunBenchmarkSuite(const Options& base) {
+  namespace fs = std::experimental::filesystem;
+  std::error_code ec;
+  const fs::path dir = fs::temp_directory_path(ec) / "font-atlas-generator-benchmark";
+  fs::create_directories(dir, ec);
+  if (ec) {
+    fprintf(stderr, "error: can't make %s: %s\n", dir.string().c_str(), ec.message().c_str());
+    return false;
+  }
+
+  FT_Library library;
+  if (FT_Init_FreeType(&library)) {
+    fprintf(stderr, "an error occurred during freetype library initialization");
+    return false;
+  }
+
+  const std::string synthetic_font = (dir / "synthetic.ttf").string();
+  if (!WriteSyntheticFont(synthetic_font)) {
+    FT_Done_FreeType(library);
+    return false;
+  }
+
+  const float font_size = base.font_size > 0.0f ? base.font_size : 32.0f;
+  FILE* fp = fopen(base.benchmark_suite.c_str(), "wb");
+  if (!fp) {
+    fprintf(stderr, "error: couldn't write %s\n", base.benchmark_suite.c_str());
+    FT_Done_FreeType(library);
+    return false;
+  }
+  fprintf(fp, R"({
+  "version": 2,
+  "font": %s,
+  "fontSize": %g,
+  "threads": %d,
+  "simd": "%s",
+  "runs": %d,
+  "cases": [
+)", json_string(base.font_filename).c_str(), font_size, base.threads, SimdName(), kBenchmarkRuns);
+
+  printf("benchmark suite: %s at %g, best of %d\n", base.font_filename.empty() ? "synthetic font" : base.font_filename.c_str(),
+         font_size, kBenchmarkRuns);
+  printf("  %-44s %7s %11s %9s %9s %9s %8s\n", "case", "glyphs", "glyphs/sec", "total ms", "pack ms", "encode ms", "peak MB");
+  bool first_case = true;
+  bool any_synthetic = false;
+  bool peak_per_case = true;
+  int num_failed = 0;
+  for (const auto& set : benchmark_sets) {
+    bool synthetic = true;
+    FT_Face face;
+    if (!base.font_filename.empty() && !OpenFace(library, base, &face)) {
+      for (int c = set.start; c < set.start + set.count && synthetic; ++c) {
+        synthetic = FT_Get_Char_Index(face, c) == 0;
+      }
+      FT_Done_Face(face);
+    }
+    any_synthetic |= synthetic;
+    for (const int oversample : { 1, 4 }) {
+      for (const bool light : { false, true }) {
+        for (const bool fixed_height : { false, true }) {
+          Options opt = base;
+          opt.cache_dir.clear();
+          opt.previous_atlas.clear();
+          opt.profile.clear();
+          opt.profile_trace.clear();
+          opt.benchmark_downsample = false;
+          opt.benchmark_png = false;
+          opt.stats = false;
+          opt.verbose = false;
+          opt.font_size = font_size;
+          opt.oversample = oversample;
+          opt.light = light;
+          opt.glyph_height = fixed_height ? (int)ceilf(font_size * 1.5f) : 0;
+          opt.ranges.assign(1, Range(set.start, set.start + set.count - 1));
+          opt.out_name = (dir / "atlas").string();
+          if (synthetic) {
+            opt.font_filename = synthetic_font;
+            opt.font_index = 0;
+          }
+
+          char name[64];
+          snprintf(name, sizeof(name), "%s/oversample-%d/%s/%s", set.name, oversample,
+                   light ? "light" : "normal", fixed_height ? "fixed-height" : "variable-height");
+          const std::string label = std::string(name) + (synthetic ? " *" : "");
+
+          Stats best;
+          double best_ms = 0.0;
+          int64_t peak_rss = 0;
+          bool ok = true;
+          std::string error;
+          for (int run = 0; run < kBenchmarkRuns && ok; ++run) {
+            QuietOutput quiet((dir / "stderr.txt").string());
+            peak_per_case &= ResetPeakRss();
+            Stats stats;
+            const double start = NowMs();
+            ok = !OpenFace(library, opt, &face, &stats);
+            if (ok) {
+              ok = GenerateAtlas(face, opt, 0, &stats);
+              FT_Done_Face(face);
+            }
+            const double elapsed = NowMs() - start;
+            peak_rss = std::max(peak_rss, PeakRssBytes());
+            const std::string output = quiet.Finish();
+            if (!ok) {
+              error = LastError(output);
+            }
+            if (ok && (run == 0 || elapsed < best_ms)) {
+              best = stats;
+              best_ms = elapsed;
+            }
+          }
+
+          fprintf(fp, "%s    {\n      \"name\": \"%s\",\n      \"syntheticFont\": %s,\n", first_case ? "" : ",\n",
+                  name, synthetic ? "true" : "false");
+          first_case = false;
+          if (!ok) {
+            fprintf(fp, "      \"failed\": true,\n      \"error\": %s\n    }", json_string(error).c_str());
+            printf("  %-44s failed: %s\n", label.c_str(), error.c_str());
+            ++num_failed;
+            continue;
+          }
+          const double render_ms = StageMs(best, "load+render");
+          const double pack_ms = StageMs(best, "pack");
+          const double encode_ms = StageMs(best, "write atlas");
+          const double glyphs_per_sec = render_ms > 0.0 ? best.codepoints / (render_ms / 1000.0) : 0.0;
+          fprintf(fp, R"(      "failed": false,
+      "glyphs": %d,
+      "glyphsPerSec": %.1f,
+      "totalMs": %.3f,
+      "renderMs": %.3f,
+      "packMs": %.3f,
+      "packAttempts": %d,
+      "encodeMs": %.3f,
+      "atlasWidth": %d,
+      "atlasHeight": %d,
+      "bytesWritten": %lld,
+      "%s": %lld
+    })", best.codepoints, glyphs_per_sec, best_ms, render_ms, pack_ms, best.pack_attempts, encode_ms,
+               best.atlas_width, best.atlas_height, (long long)best.bytes_written,
+               peak_per_case ? "peakRssBytes" : "processPeakRssBytes", (long long)peak_rss);
+          printf("  %-44s %7d %11.0f %9.2f %9.2f %9.2f %8.1f\n", label.c_str(), best.codepoints, glyphs_per_sec,
+                 best_ms, pack_ms, encode_ms, peak_rss / 1048576.0);
+        }
+      }
+    }
+  }
+  fprintf(fp, "\n  ]\n}\n");
+  fclose(fp);
+  FT_Done_FreeType(library);
+  fs::remove_all(dir, ec);
+  if (any_synthetic) {
+    printf("  * on the synthetic font, %s\n", base.font_filename.empty() ? "no --font" : "--font doesn't have these");
+  }
+  if (!peak_per_case) {
+    printf("  peak MB is the peak of the whole run so far, it can't be reset between cases here\n");
+  }
+  printf("write benchmark report: %s\n", base.benchmark_suite.c_str());
+  if (num_failed) {
+    fprintf(stderr, "error: %d benchmark case(s) failed\n", num_failed);
+    return false;
+  }
+  return true;
+}
+
+// --benchmark-packers: packs the glyphs of each of benchmark_sets from the
+// synthetic font with every packer. Only --font-size, --padding,
+// --glyph-height, --light and --atlas-width/height change the glyphs or
+// the atlas, so anyone can rerun it and compare packers on the same rects.
+bool RunPackerBenchmark(const Options& base) {
+  namespace fs = std::experimental::filesystem;
+  std::error_code ec;
+  const fs::path dir = fs::temp_directory_path(ec) / "font-atlas-generator-benchmark";
+  fs::create_directories(dir, ec);
+  if (ec) {
+    fprintf(stderr, "error: can't make %s: %s\n", dir.string().c_str(), ec.message().c_str());
+    return false;
+  }
+  Options opt = base;
+  opt.font_filename = (dir / "synthetic.ttf").string();
+  opt.font_index = 0;
+  opt.font_size = base.font_size > 0.0f ? base.font_size : 32.0f;
+  opt.oversample = 1;
+  if (!WriteSyntheticFont(opt.font_filename)) {
+    return false;
+  }
+
+  FT_Library library;
+  if (FT_Init_FreeType(&library)) {
+    fprintf(stderr, "an error occurred during freetype library initialization");
+    return false;
+  }
+  FT_Face face;
+  if (OpenFace(library, opt, &face)) {
+    fprintf(stderr, "error: could not read: %s\n", opt.font_filename.c_str());
+    FT_Done_FreeType(library);
+    return false;
+  }
+  for (const auto& set : benchmark_sets) {
+    std::vector<stbrp_rect> rects(set.count);
+    for (int i = 0; i < set.count; ++i) {
+      stbrp_rect& r = rects[i];
+      r = stbrp_rect();
+      const FT_UInt glyph_index = FT_Get_Char_Index(face, set.start + i);
+      if (!glyph_index || FT_Load_Glyph(face, glyph_index, opt.light ? FT_LOAD_TARGET_LIGHT : FT_LOAD_TARGET_NORMAL)) {
+        continue;
+      }
+      r.w = (stbrp_coord)(((face->glyph->metrics.width + 63) >> 6) + opt.padding * 2);
+      r.h = (stbrp_coord)(opt.glyph_height ? opt.glyph_height : ((face->glyph->metrics.height + 63) >> 6) + opt.padding * 2);
+    }
+    printf("%s at %g, synthetic font\n", set.name, opt.font_size);
+    BenchmarkPackers(rects.data(), set.count, opt);
+  }
+  FT_Done_Face(face);
+  FT_Done_FreeType(library);
+  fs::remove_all(dir, ec);
+  return true;
+}
+
+std::string camel_case_to_dash(const std::string& s) {
+  std::string t;
+  for (const auto c : s) {
+    if (c >= 'A' && c <= 'Z') {
+      t.push_back('-');
+      t.push_back(c - 'A' + 'a');
+    } else {
+      t.push_back(c);
+    }
+  }
+  return t;
+}
+
+// Turns one manifest entry into command line style "--option=value" args
+bool manifest_entry_to_args(const JsonValue& entry, std::vector<std::string>* args) {
+  if (entry.type != JsonValue::kObject) {
+    return false;
+  }
+  // make-fonts.js gives every font a debugColor but gen-font.js only passes
+  // it on with showGrid, otherwise it would tint the whole atlas
+  bool show_grid = false;
+  for (const auto& pair : entry.object) {
+    if (pair.first == "showGrid" && pair.second.type == JsonValue::kBool) {
+      show_grid = pair.second.boolean;
+    }
+  }
+  for (const auto& pair : entry.object) {
+    const std::string& key = pair.first;
+    // fontName is the name gen-font.js puts in the .yy file
+    if (key == "fontName" || (key == "debugColor" && !show_grid)) {
+      continue;
+    }
+    const std::string option = "--" + (key == "outputName" ? std::string("outname") : camel_case_to_dash(key));
+    const JsonValue& value = pair.second;
+    const std::vector<JsonValue> values = value.type == JsonValue::kArray
+        ? value.array
+        : std::vector<JsonValue>(1, value);
+    for (const auto& v : values) {
+      switch (v.type) {
+        case JsonValue::kBool:
+          args->push_back(option + (v.boolean ? "=true" : "=false"));
+          break;
+        case JsonValue::kNumber:
+        case JsonValue::kString:
+          args->push_back(option + "=" + v.string);
+          break;
+        default:
+          fprintf(stderr, "error: bad value for %s in manifest\n", key.c_str());
+          return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Generates every atlas in a --manifest file in this one process.
+//
+// All faces come from one FT_Library and each font file is only read once.
+// Atlases that use the same face are generated one after the other, changing
+// the size of the face, and up to --threads faces are worked on at the same
+// time. The library isn't thread safe for creating and destroying faces so
+// that's done under a lock.
+bool RunManifest(const Options& base, const CodepointSet& base_used) {
+  std::vector<unsigned char> manifest_data;
+  if (!readFile(base.manifest.c_str(), &manifest_data)) {
+    return false;
+  }
+  JsonValue manifest;
+  if (!parse_json(manifest_data, &manifest)) {
+    fprintf(stderr, "error: could not parse manifest: %s\n", base.manifest.c_str());
+    return false;
+  }
+  const JsonValue* entries = &manifest;
+  if (manifest.type == JsonValue::kObject) {
+    for (const auto& pair : manifest.object) {
+      if (pair.first == "fonts") {
+        entries = &pair.second;
+      }
+    }
+  }
+  if (entries->type != JsonValue::kArray) {
+    fprintf(stderr, "error: manifest must be an array of fonts: %s\n", base.manifest.c_str());
+    return false;
+  }
+
+  std::vector<Options> atlases;
+  for (size_t i = 0; i < entries->array.size(); ++i) {
+    std::vector<std::string> args;
+    if (!manifest_entry_to_args(entries->array[i], &args)) {
+      fprintf(stderr, "error: bad entry %d in manifest: %s\n", (int)i, base.manifest.c_str());
+      return false;
+    }
+    std::vector<const char*> argv(1, "manifest");
+    for (const auto& arg : args) {
+      argv.push_back(arg.c_str());
+    }
+
+    Options opt = base;
+    opt.manifest.clear();
+    opt.threads = 1;
+    CodepointSet used = base_used;
+    if (!parse_args((int)argv.size(), argv.data(), &opt, &used) || !check_options(&opt, used)) {
+      fprintf(stderr, "error: bad entry %d in manifest: %s\n", (int)i, base.manifest.c_str());
+      return false;
+    }
+    atlases.push_back(opt);
+  }
+
+  // stages of each atlas for --profile
+  std::vector<Stats> atlas_stats(atlases.size());
+  // a font is only hashed if one of its atlases needs it, the others get 0
+  std::map<std::string, uint64_t> font_hashes;
+  std::set<std::string> fonts_to_hash;
+  for (const Options& opt : atlases) {
+    if (NeedsFontHash(opt)) {
+      fonts_to_hash.insert(opt.font_filename);
+    }
+  }
+  for (size_t i = 0; i < atlases.size(); ++i) {
+    const Options& opt = atlases[i];
+    if (font_hashes.find(opt.font_filename) != font_hashes.end()) {
+      continue;
+    }
+    font_hashes[opt.font_filename] = 0;
+    if (fonts_to_hash.count(opt.font_filename)) {
+      StageTimer timer(&atlas_stats[i], "hash font");
+      std::shared_ptr<MappedFile> file = MapFontFile(opt.font_filename);
+      if (!file) {
+        fprintf(stderr, "error: could not read: %s\n", opt.font_filename.c_str());
+        return false;
+      }
+      font_hashes[opt.font_filename] = FontHash(opt, opt.font_filename, *file);
+    }
+  }
+
+  // group the atlases by face, keeping manifest order. Each group shares
+  // one FT_Face so FreeType's per face work, like the autofitter's globals,
+  // is done once for all the sizes in it, and with --cache-dir not at all
+  // once an AutofitMap is saved.
+  std::vector<char> succeeded(atlases.size(), 0);
+  std::vector<std::vector<int>> groups;
+  std::map<std::pair<std::string, int>, int> group_by_face;
+  for (int i = 0; i < (int)atlases.size(); ++i) {
+    const Options& opt = atlases[i];
+    if (!opt.cache_dir.empty()) {
+      StageTimer timer(&atlas_stats[i], "restore from cache");
+      if (RestoreAtlasFromCache(opt, font_hashes[opt.font_filename])) {
+        timer.Stop();
+        AddToProfile(opt, atlas_stats[i], true);
+        succeeded[i] = 1;
+        continue;
+      }
+    }
+    auto key = std::make_pair(opt.font_filename, opt.font_index);
+    auto it = group_by_face.find(key);
+    if (it == group_by_face.end()) {
+      it = group_by_face.insert(std::make_pair(key, (int)groups.size())).first;
+      groups.push_back(std::vector<int>());
+    }
+    groups[it->second].push_back(i);
+  }
+
+  FT_Library library;
+  if (FT_Init_FreeType(&library)) {
+    fprintf(stderr, "an error occurred during freetype library initialization");
+    return false;
+  }
+
+  std::mutex library_mutex;
+  std::atomic<int> next_group(0);
+  auto work = [&]() {
+    for (;;) {
+      const int g = next_group.fetch_add(1);
+      if (g >= (int)groups.size()) {
+        break;
+      }
+      const Options& first = atlases[groups[g][0]];
+      FT_Face face;
+      FT_Error error;
+      {
+        std::lock_guard<std::mutex> lock(library_mutex);
+        error = OpenFace(library, first, &face, &atlas_stats[groups[g][0]]);
+      }
+      if (error) {
+        fprintf(stderr, "error: could not read: %s\n", first.font_filename.c_str());
+        continue;
+      }
+      LoadAutofitMap(face, first, font_hashes[first.font_filename], &atlas_stats[groups[g][0]]);
+      for (const int ndx : groups[g]) {
+        const Options& opt = atlases[ndx];
+        Stats& stats = atlas_stats[ndx];
+        {
+          StageTimer timer(&stats, "set size");
+          SetFaceSize(face, opt);
+        }
+        succeeded[ndx] = GenerateAtlas(face, opt, font_hashes[opt.font_filename], &stats);
+        SaveAutofitMap(face, opt, font_hashes[opt.font_filename], &stats);
+        AddToProfile(opt, stats, succeeded[ndx] != 0);
+      }
+      std::lock_guard<std::mutex> lock(library_mutex);
+      FT_Done_Face(face);
+    }
+  };
+
+  const int num_workers = std::max(1, std::min(base.threads, (int)groups.size()));
+  std::vector<std::thread> threads;
+  for (int t = 1; t < num_workers; ++t) {
+    threads.emplace_back(work);
+  }
+  work();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  FT_Done_FreeType(library);
+
+  bool all_succeeded = true;
+  for (size_t i = 0; i < atlases.size(); ++i) {
+    if (!succeeded[i]) {
+      fprintf(stderr, "error: failed to generate: %s\n", atlases[i].out_name.c_str());
+      all_succeeded = false;
+    }
+  }
+  return all_succeeded;
+}
+
+int main(int argc, const char *argv[])
+{
+  const double start_ms = NowMs();
+  const double start_cpu_ms = CpuMs(false);
+  Options opt;
+  CodepointSet used;
+  if (!parse_command_line(argc, argv, &opt, &used)) {
+    fprintf(stderr, help);
+    return EXIT_FAILURE;
+  }
+
+  if (!opt.benchmark_suite.empty()) {
+    return RunBenchmarkSuite(opt) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (opt.benchmark_packers) {
+    return RunPackerBenchmark(opt) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (!opt.manifest.empty()) {
+    const bool succeeded = RunManifest(opt, used);
+    return WriteProfile(opt, start_ms, start_cpu_ms) && succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  Stats stats;
+  uint64_t font_hash = 0;
+  if (NeedsFontHash(opt)) {
+    StageTimer hash_timer(&stats, "hash font");
+    std::shared_ptr<MappedFile> file = MapFontFile(opt.font_filename);
+    if (!file) {
+      fprintf(stderr, "error: could not read: %s\n", opt.font_filename.c_str());
+      return EXIT_FAILURE;
+    }
+    font_hash = FontHash(opt, opt.font_filename, *file);
+  }
+  if (!opt.cache_dir.empty()) {
+    StageTimer restore_timer(&stats, "restore from cache");
+    if (RestoreAtlasFromCache(opt, font_hash)) {
+      restore_timer.Stop();
+      AddToProfile(opt, stats, true);
+      return WriteProfile(opt, start_ms, start_cpu_ms) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  FT_Library library;
+
+  int error = FT_Init_FreeType(&library);
+  if (error) {
+    fprintf(stderr, "an error occurred during freetype library initialization");
+    return EXIT_FAILURE;
+  }
+
+  FT_Face face;
+  error = OpenFace(library, opt, &face, &stats);
+  if (error) {
+    fprintf(stderr, "error: could not read: %s\n", opt.font_filename.c_str());
+    return EXIT_FAILURE;
+  }
+
+  LoadAutofitMap(face, opt, font_hash, &stats);
+  const bool succeeded = GenerateAtlas(face, opt, font_hash, &stats);
+  SaveAutofitMap(face, opt, font_hash, &stats);
+  AddToProfile(opt, stats, succeeded);
+  return WriteProfile(opt, start_ms, start_cpu_ms) && succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -856,6 +856,12 @@ FT_BEGIN_HEADER
    *     FT_Load_Glyph( face, ..., FT_LOAD_FORCE_AUTOHINT );
    *   }
    *
+   *   The property can also be set with @FT_Property_Set; `prop.map' must
+   *   then point to `num_glyphs' values as previously returned for the
+   *   same font.  Setting it before the auto-hinter touches the face
+   *   skips the analysis of the character map, which can take a while
+   *   for large CJK fonts.  The array is copied.
+   *
    * @since:
    *   2.4.11
    *
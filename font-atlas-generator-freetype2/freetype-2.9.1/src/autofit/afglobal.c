@@ -336,6 +336,21 @@
   af_face_globals_new( FT_Face          face,
                        AF_FaceGlobals  *aglobals,
                        AF_Module        module )
+  {
+    return af_face_globals_new_with_styles( face, aglobals, module, NULL );
+  }
+
+
+  /* Like `af_face_globals_new', but if `glyph_styles' is non-NULL it */
+  /* gets copied instead of computing the style coverage, which scans */
+  /* every glyph of every covered script.  The caller must pass one   */
+  /* valid entry per glyph, as returned by `glyph-to-script-map'.     */
+
+  FT_LOCAL_DEF( FT_Error )
+  af_face_globals_new_with_styles( FT_Face           face,
+                                   AF_FaceGlobals   *aglobals,
+                                   AF_Module         module,
+                                   const FT_UShort*  glyph_styles )
   {
     FT_Error        error;
     FT_Memory       memory;
@@ -368,7 +383,10 @@
     globals->hb_buf  = hb_buffer_create();
 #endif
 
-    error = af_face_globals_compute_style_coverage( globals );
+    if ( glyph_styles )
+      FT_ARRAY_COPY( globals->glyph_styles, glyph_styles, face->num_glyphs );
+    else
+      error = af_face_globals_compute_style_coverage( globals );
     if ( error )
     {
       af_face_globals_free( globals );
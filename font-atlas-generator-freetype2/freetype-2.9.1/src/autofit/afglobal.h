@@ -149,6 +149,12 @@ FT_BEGIN_HEADER
                        AF_FaceGlobals  *aglobals,
                        AF_Module        module );
 
+  FT_LOCAL( FT_Error )
+  af_face_globals_new_with_styles( FT_Face           face,
+                                   AF_FaceGlobals   *aglobals,
+                                   AF_Module         module,
+                                   const FT_UShort*  glyph_styles );
+
   FT_LOCAL( FT_Error )
   af_face_globals_get_metrics( AF_FaceGlobals    globals,
                                FT_UInt           gindex,
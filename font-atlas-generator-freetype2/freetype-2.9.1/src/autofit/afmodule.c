@@ -185,6 +185,54 @@
 
       return error;
     }
+    else if ( !ft_strcmp( property_name, "glyph-to-script-map" ) )
+    {
+      FT_Prop_GlyphToScriptMap*  prop;
+      AF_FaceGlobals             globals;
+      FT_Long                    nn;
+
+
+#ifdef FT_CONFIG_OPTION_ENVIRONMENT_PROPERTIES
+      if ( value_is_string )
+        return FT_THROW( Invalid_Argument );
+#endif
+
+      prop = (FT_Prop_GlyphToScriptMap*)value;
+
+      if ( !prop->face )
+        return FT_THROW( Invalid_Face_Handle );
+      if ( !prop->map )
+        return FT_THROW( Invalid_Argument );
+
+      for ( nn = 0; nn < prop->face->num_glyphs; nn++ )
+        if ( ( prop->map[nn] & AF_STYLE_MASK ) >= AF_STYLE_MAX )
+          return FT_THROW( Invalid_Argument );
+
+      globals = (AF_FaceGlobals)prop->face->autohint.data;
+      if ( globals )
+      {
+        FT_ARRAY_COPY( globals->glyph_styles,
+                       prop->map,
+                       globals->glyph_count );
+        return error;
+      }
+
+      /* create the globals from the given map, */
+      /* skipping the style coverage analysis   */
+      error = af_face_globals_new_with_styles( prop->face,
+                                               &globals,
+                                               module,
+                                               prop->map );
+      if ( !error )
+      {
+        prop->face->autohint.data =
+          (FT_Pointer)globals;
+        prop->face->autohint.finalizer =
+          (FT_Generic_Finalizer)af_face_globals_free;
+      }
+
+      return error;
+    }
     else if ( !ft_strcmp( property_name, "increase-x-height" ) )
     {
       FT_Prop_IncreaseXHeight*  prop;
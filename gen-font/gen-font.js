@@ -26,6 +26,9 @@ const optionSpec = {
     { option: 'debug-color',  type: 'String',  description: 'color for grid for debugging'},
     { option: 'max-atlas-size',  type: 'Number',  description: 'max atlas size (default, 2048)', default: '2048'},
     { option: 'error-on-crop',  type: 'Boolean',  description: 'error if glyph cropped', default: 'true' },
+    { option: 'cache-dir',  type: 'String',  description: 'folder to cache atlases in so unchanged fonts are not regenerated', default: 'font-cache' },
+    { option: 'keep-layout',  type: 'Boolean',  description: 'keep glyphs where the last atlas put them so only new glyphs change the png. The layout is saved next to the .yy as <output-name>.atlas.json, commit it with the .png' },
+    { option: 'repack',  type: 'Boolean',  description: 'with --keep-layout, ignore the saved layout and pack every glyph again, then save the new layout' },
   ],
   helpStyle: {
     typeSeparator: '=',
@@ -37,12 +40,21 @@ const optionSpec = {
 
 const optionator = makeOptions(optionSpec);
 
-let args;
-try {
-  args = optionator.parse(process.argv);
-} catch (e) {
-  console.error(e);
-  printHelp();
+// const fontGenPath = path.join(__dirname, '..', 'font-atlas-generator', 'Debug', 'font-atlas-generator.exe');
+const fontGenPath = path.join(__dirname, '..', 'font-atlas-generator-freetype2', 'Debug', 'font-atlas-generator.exe');
+
+function parseArgs(argv) {
+  let args;
+  try {
+    args = optionator.parse(argv);
+  } catch (e) {
+    console.error(e);
+    printHelp();
+  }
+  if (args.help) {
+    printHelp();
+  }
+  return args;
 }
 
 function printHelp() {
@@ -50,24 +62,19 @@ function printHelp() {
   process.exit(1);  // eslint-disable-line
 }
 
-if (args.help) {
-  printHelp();
+function layoutFilename(args) {
+  return path.join(args.projectPath, 'fonts', args.outputName, `${args.outputName}.atlas.json`);
 }
 
-function makeFont(args) {
-  // const fontGenPath = path.join(__dirname, '..', 'font-atlas-generator', 'Debug', 'font-atlas-generator.exe');
-  const fontGenPath = path.join(__dirname, '..', 'font-atlas-generator-freetype2', 'Debug', 'font-atlas-generator.exe');
+// the font-atlas-generator args for one font, it writes outName.json and
+// outName.png
+function makeFontGenArgs(args, outName) {
   const usedCharsFilename = path.join(args.projectPath, 'datafiles', 'lang', 'lang_ja.json');
-  const outPath = path.join(args.projectPath, 'fonts', args.outputName);
-  const fntPath = 'delme.json';
-  const pngPath = 'delme.png';
-  const fntPNGFilename = path.join(outPath, `${args.outputName}.png`);
-  const fntYYFilename = path.join(outPath, `${args.outputName}.yy`);
 
   const fontGenArgs = [
   //  `--verbose=true`,
     `--error-on-crop=${args.errorOnCrop}`,
-    `--outname=delme`,
+    `--outname=${outName}`,
     `--font=${args.font}`,
     `--font-index=${args.fontIndex}`,
     `--font-size=${args.fontSize}`,
@@ -86,6 +93,16 @@ function makeFont(args) {
     `--used-chars-file=${usedCharsFilename}`,
   ];
 
+  if (args.cacheDir) {
+    fontGenArgs.push(`--cache-dir=${args.cacheDir}`);
+  }
+
+  // the layout is committed with the project, not taken from the cache dir,
+  // so everyone starts from the same atlas
+  if (args.keepLayout && !args.repack && fs.existsSync(layoutFilename(args))) {
+    fontGenArgs.push(`--previous-atlas=${layoutFilename(args)}`);
+  }
+
   if (args.showGrid) {
     fontGenArgs.push('--show-grid=true');
     if (args.debugColor) {
@@ -93,19 +110,32 @@ function makeFont(args) {
     }
   }
 
-  if (fs.existsSync(pngPath)) {
-    fs.unlinkSync(pngPath);
-  }
+  return fontGenArgs;
+}
 
-  console.log(fontGenPath, ...fontGenArgs);
-  return execFile(fontGenPath, fontGenArgs)
-  .then((output) => {
-    console.log(output.stdout);
-    console.log(output.stderr);
+// copies outName.json and outName.png made by font-atlas-generator into
+// the gamemaker project
+function updateProject(args, outName) {
+  const outPath = path.join(args.projectPath, 'fonts', args.outputName);
+  const fntPath = `${outName}.json`;
+  const pngPath = `${outName}.png`;
+  const fntPNGFilename = path.join(outPath, `${args.outputName}.png`);
+  const fntYYFilename = path.join(outPath, `${args.outputName}.yy`);
+
+  return Promise.resolve()
+  .then(() => {
     const fntJSON = fs.readFileSync(fntPath, {encoding: 'utf8'});
+    if (args.keepLayout) {
+      fs.writeFileSync(layoutFilename(args), fntJSON, {encoding: 'utf8'});
+    }
     return JSON.parse(fntJSON);
   })
   .then((fnt) => {
+    // a gamemaker font is one texture so atlases split by --max-page-size
+    // (name_0.png, name_1.png, ... and "pages" in the .json) can't be used
+    if (fnt.pages && fnt.pages.length > 1) {
+      throw new Error(`atlas has ${fnt.pages.length} pages, gamemaker fonts need a single page, don't use --max-page-size`);
+    }
     if (fnt.atlasWidth > args.maxAtlasSize || fnt.aliasHeight > args.maxAtlasSize) {
       throw new Error(`altas too large: max size: ${args.maxAtlasSize}, actual size: ${fnt.atlasWidth}x${fnt.atlasHeight}`);
     }
@@ -140,14 +170,39 @@ function makeFont(args) {
       };
     });
 
-    console.log('write:', fntYYFilename);
     // replace is hack to make diffs less different
-    fs.writeFileSync(fntYYFilename, JSON.stringify(orig, null, 4).replace(`"kerningPairs": [],`, `"kerningPairs": [\n        \n    ],`).replace(/\n/g, '\r\n'), {encoding: 'utf8'});
-    if (fs.existsSync(fntPNGFilename)) {
-      fs.unlinkSync(fntPNGFilename);
+    const yy = JSON.stringify(orig, null, 4).replace(`"kerningPairs": [],`, `"kerningPairs": [\n        \n    ],`).replace(/\n/g, '\r\n');
+    if (fs.readFileSync(fntYYFilename, {encoding: 'utf8'}) === yy) {
+      console.log('up to date:', fntYYFilename);
+    } else {
+      console.log('write:', fntYYFilename);
+      fs.writeFileSync(fntYYFilename, yy, {encoding: 'utf8'});
     }
-    console.log('write:', fntPNGFilename);
-    fs.copyFileSync(pngPath, fntPNGFilename);
+    if (fs.existsSync(fntPNGFilename) && fs.readFileSync(fntPNGFilename).equals(fs.readFileSync(pngPath))) {
+      console.log('up to date:', fntPNGFilename);
+    } else {
+      if (fs.existsSync(fntPNGFilename)) {
+        fs.unlinkSync(fntPNGFilename);
+      }
+      console.log('write:', fntPNGFilename);
+      fs.copyFileSync(pngPath, fntPNGFilename);
+    }
+  });
+}
+
+function makeFont(args) {
+  const outName = 'delme';
+  const fontGenArgs = makeFontGenArgs(args, outName);
+  if (fs.existsSync(`${outName}.png`)) {
+    fs.unlinkSync(`${outName}.png`);
+  }
+
+  console.log(fontGenPath, ...fontGenArgs);
+  return execFile(fontGenPath, fontGenArgs)
+  .then((output) => {
+    console.log(output.stdout);
+    console.log(output.stderr);
+    return updateProject(args, outName);
   })
   .catch((error) => {
     console.error(error.stderr, error);
@@ -221,5 +276,14 @@ function fixArray(obj, arrayKey, elemKey) {
     : [maybeArray];
 }
 
-makeFont(args);
+module.exports = {
+  fontGenPath,
+  parseArgs,
+  makeFontGenArgs,
+  updateProject,
+};
+
+if (require.main === module) {
+  makeFont(parseArgs(process.argv));
+}
 
@@ -7,6 +7,7 @@ const child_process = require('child_process');
 const util = require('util');
 
 const execFile = util.promisify(child_process.execFile);
+const genFont = require(path.join(__dirname, '..', 'gen-font', 'gen-font.js'));
 
 const optionSpec = {
   options: [
@@ -50,9 +51,11 @@ if (args.help) {
 // rem node gen-font\gen-font.js --project-path=..\build-new\dr_ch1_beta_0.gmx --bmfont-config=bmfont-scripts\fnt-ja-small.bmfc      --output-name=fnt_ja_small
 // rem node gen-font\gen-font.js --project-path=..\build-new\dr_ch1_beta_0.gmx --bmfont-config=bmfont-scripts\fnt-ja-tinynoelle.bmfc --output-name=fnt_ja_tinynoelle
 
-function genFont(options) {
+// the gen-font.js args for one font
+function genFontArgs(options) {
   const args = [
-    path.join(__dirname, '..', 'gen-font', 'gen-font.js'),
+    'node',
+    'gen-font.js',
     `--project-path=${path.join('..', 'build-new', 'DELTARUNE')}`,
   ];
 
@@ -60,13 +63,30 @@ function genFont(options) {
     args.push(`--${camelCaseToDash(key)}=${value}`)
   }
 
-  return execFile("node.exe", args);
+  return genFont.parseArgs(args);
+}
+
+// turns font-atlas-generator's --name=value args into a --manifest entry,
+// repeated args like --range become arrays
+function manifestEntry(fontGenArgs) {
+  const entry = {};
+  for (const arg of fontGenArgs) {
+    const [, name, str] = /^--([^=]+)=(.*)$/.exec(arg);
+    const key = dashToCamelCase(name);
+    const value = str === 'true' ? true : str === 'false' ? false : str;
+    entry[key] = key in entry ? [].concat(entry[key], value) : value;
+  }
+  return entry;
 }
 
 function camelCaseToDash(str) {
   return str.replace(/[A-Z]/g, r => `-${r.toLowerCase()}`);
 }
 
+function dashToCamelCase(str) {
+  return str.replace(/-([a-z])/g, (m, c) => c.toUpperCase());
+}
+
 async function main() {
   let fonts = [
     {
@@ -152,16 +172,40 @@ async function main() {
     const re = new RegExp(args.font);
     fonts = fonts.filter(f => re.test(f.outputName));
   }
-  for(const font of fonts) {
-    console.log('=======[', font.outputName, ']===================================');
+
+  // Every font is generated by one font-atlas-generator run so fonts from
+  // the same file share one FT_Face. FreeType's per face setup, like the
+  // autofitter's script analysis for --light, is then done once per file
+  // instead of once per font.
+  const manifestFilename = 'delme-manifest.json';
+  const outName = (args) => `delme-${args.outputName}`;
+  const fontArgs = fonts.map(genFontArgs);
+  const manifest = fontArgs.map((args) => manifestEntry(genFont.makeFontGenArgs(args, outName(args))));
+  fs.writeFileSync(manifestFilename, JSON.stringify(manifest, null, 2));
+  for (const args of fontArgs) {
+    if (fs.existsSync(`${outName(args)}.png`)) {
+      fs.unlinkSync(`${outName(args)}.png`);
+    }
+  }
+
+  console.log(genFont.fontGenPath, `--manifest=${manifestFilename}`);
+  try {
+    const result = await execFile(genFont.fontGenPath, [`--manifest=${manifestFilename}`]);
+    console.log(result.stdout);
+    console.log(result.stderr);
+  } catch (e) {
+    console.log(e.stdout);
+    console.error(e.stderr);
+    throw new Error('failed to generate fonts');
+  }
+
+  for (const args of fontArgs) {
+    console.log('=======[', args.outputName, ']===================================');
     try {
-      const result = await genFont(font);
-      console.log(result.stdout);
-      console.log(result.stderr);
+      await genFont.updateProject(args, outName(args));
     } catch (e) {
-      console.log(e.stdout);
-      console.error(e.stderr);
-      throw new Error(`failed for font: ${font.outputName}`);
+      console.error(e);
+      throw new Error(`failed for font: ${args.outputName}`);
     }
   }
 }
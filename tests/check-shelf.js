@@ -0,0 +1,83 @@
+// Checks the shelf packer: packs fixed --glyph-height sets with
+// --packer=shelf and fails if any glyph was cropped, if two glyphs' rects
+// overlap or if a rect is outside the atlas. Glyphs that share a rect,
+// because they draw the same pixels, are only checked once.
+//
+// usage: node check-shelf.js <font.ttf> [path to font-atlas-generator]
+
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
+const child_process = require('child_process');
+
+const fontFilename = process.argv[2];
+const fontGenPath = process.argv[3] || path.join(__dirname, '..', 'font-atlas-generator-freetype2', 'Debug', 'font-atlas-generator.exe');
+
+if (!fontFilename) {
+  console.error('usage: node check-shelf.js <font.ttf> [path to font-atlas-generator]');
+  process.exit(1);
+}
+
+const configs = [
+  ['--font-size=14', '--glyph-height=20', '--y-offset=2'],
+  ['--font-size=20', '--glyph-height=30', '--y-offset=4', '--padding=2'],
+  ['--font-size=32', '--glyph-height=48', '--y-offset=6', '--npot=true'],
+  ['--font-size=12', '--glyph-height=18', '--y-offset=2', '--oversample=4'],
+];
+
+function overlaps(a, b) {
+  return a.x < b.x + b.w && b.x < a.x + a.w && a.y < b.y + b.h && b.y < a.y + a.h;
+}
+
+function check(fnt) {
+  const errors = [];
+  const rects = [];
+  const seen = new Set();
+  fnt.glyphs.forEach((glyph) => {
+    const r = glyph.tex;
+    const key = `${glyph.page || 0} ${r.x} ${r.y} ${r.w} ${r.h}`;
+    if (r.w <= 0 || r.h <= 0 || seen.has(key)) {
+      return;
+    }
+    seen.add(key);
+    if (r.x < 0 || r.y < 0 || r.x + r.w > fnt.atlasWidth || r.y + r.h > fnt.atlasHeight) {
+      errors.push(`codepoint ${glyph.codePoint} at ${key} is outside the ${fnt.atlasWidth} x ${fnt.atlasHeight} atlas`);
+    }
+    rects.push({...r, page: glyph.page || 0, codePoint: glyph.codePoint});
+  });
+  for (let i = 0; i < rects.length; ++i) {
+    for (let j = i + 1; j < rects.length; ++j) {
+      if (rects[i].page === rects[j].page && overlaps(rects[i], rects[j])) {
+        errors.push(`codepoints ${rects[i].codePoint} and ${rects[j].codePoint} overlap`);
+      }
+    }
+  }
+  return errors;
+}
+
+const tmpDir = fs.mkdtempSync(path.join(os.tmpdir(), 'check-shelf-'));
+let failed = 0;
+configs.forEach((config) => {
+  let errors = [];
+  try {
+    child_process.execFileSync(path.resolve(fontGenPath), [
+      `--font=${path.resolve(fontFilename)}`,
+      '--outname=atlas',
+      '--range=32-1000',
+      '--packer=shelf',
+      '--error-on-crop=true',
+      ...config,
+    ], {cwd: tmpDir, stdio: ['ignore', 'ignore', 'pipe']});
+    errors = check(JSON.parse(fs.readFileSync(path.join(tmpDir, 'atlas.json'), {encoding: 'utf8'})));
+  } catch (e) {
+    errors.push(`generator failed: ${e.stderr ? e.stderr.toString().trim() : e}`);
+  }
+  console.log(`${errors.length ? 'FAIL' : 'ok'}: ${config.join(' ')}`);
+  errors.slice(0, 10).forEach((error) => console.error(`  ${error}`));
+  failed += errors.length ? 1 : 0;
+});
+fs.rmSync(tmpDir, {recursive: true, force: true});
+if (failed) {
+  console.error(`${failed} of ${configs.length} shelf packs failed`);
+  process.exit(1);
+}
@@ -0,0 +1,64 @@
+// Checks that the atlas doesn't depend on --threads. Each config is made
+// with --threads 1 and --threads N and every file written is compared byte
+// for byte.
+//
+// usage: node check-threads.js <font.ttf> [path to font-atlas-generator] [N]
+
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
+const child_process = require('child_process');
+
+const fontFilename = process.argv[2];
+const fontGenPath = process.argv[3] || path.join(__dirname, '..', 'font-atlas-generator-freetype2', 'Debug', 'font-atlas-generator.exe');
+const numThreads = parseInt(process.argv[4] || '4');
+
+if (!fontFilename) {
+  console.error('usage: node check-threads.js <font.ttf> [path to font-atlas-generator] [threads]');
+  process.exit(1);
+}
+
+const configs = [
+  ['--font-size=14'],
+  ['--font-size=20', '--light=true', '--glyph-height=28', '--y-offset=2'],
+  ['--font-size=12', '--oversample=4', '--alpha-min=10', '--alpha-max=144'],
+  ['--font-size=16', '--sdf=true'],
+  ['--font-size=16', '--max-page-size=128', '--output-format=gray8'],
+];
+
+function generate(dir, config, threads) {
+  fs.mkdirSync(dir, {recursive: true});
+  child_process.execFileSync(path.resolve(fontGenPath), [
+    `--font=${path.resolve(fontFilename)}`,
+    '--outname=atlas',
+    '--range=32-1000',
+    '--metrics-format=bin',
+    `--threads=${threads}`,
+    ...config,
+  ], {cwd: dir, stdio: 'ignore'});
+}
+
+const tmpDir = fs.mkdtempSync(path.join(os.tmpdir(), 'check-threads-'));
+let failed = 0;
+configs.forEach((config, ndx) => {
+  const oneDir = path.join(tmpDir, `${ndx}`, '1');
+  const manyDir = path.join(tmpDir, `${ndx}`, `${numThreads}`);
+  generate(oneDir, config, 1);
+  generate(manyDir, config, numThreads);
+  const files = fs.readdirSync(oneDir).sort();
+  const manyFiles = fs.readdirSync(manyDir).sort();
+  let ok = files.join() === manyFiles.join();
+  files.forEach((name) => {
+    if (ok && !fs.readFileSync(path.join(oneDir, name)).equals(fs.readFileSync(path.join(manyDir, name)))) {
+      console.error(`  ${name} differs`);
+      ok = false;
+    }
+  });
+  console.log(`${ok ? 'ok' : 'FAIL'}: ${config.join(' ')} (${files.join(', ')})`);
+  failed += ok ? 0 : 1;
+});
+fs.rmSync(tmpDir, {recursive: true, force: true});
+if (failed) {
+  console.error(`${failed} of ${configs.length} configs differ with --threads=${numThreads}`);
+  process.exit(1);
+}